@@ -0,0 +1,130 @@
+/** \file
+ *  NUMA placement micro-benchmark.
+ *
+ *  A producer pinned to the first node fills frames and pushes them
+ *  through a \ref Chan to a consumer pinned to the last node, which reads
+ *  every byte.  The run is repeated for each Chan_Alloc_Numa() placement
+ *  and the consumer's read bandwidth is reported:
+ *
+ *  \verbatim
+ *    default       buffers follow the producer; every read is remote
+ *    first-reader  buffers move to the consumer's node
+ *    bind          buffers bound to the consumer's node
+ *    interleave    half of the reads are remote
+ *  \endverbatim
+ *
+ *  On a machine with a single node all four should match.
+ *
+ *  Usage:
+ *  \verbatim
+ *    numabench [frames=400] [MB/frame=8] [depth=8]
+ *  \endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "config.h"
+#include "thread.h"
+#include "chan.h"
+#include "numaplace.h"
+
+typedef struct _bench
+{ Chan     *q;
+  unsigned  nframes;
+  size_t    bytes;
+  double    read_s;   ///< consumer: seconds spent reading frames
+  uint64_t  checksum;
+} bench_t;
+
+static void* producer(void *arg)
+{ bench_t *b = (bench_t*)arg;
+  Chan *w = Chan_Open(b->q,CHAN_WRITE);
+  void *buf = Chan_Token_Buffer_Alloc(b->q);
+  unsigned i;
+  for(i=0;i<b->nframes;++i)
+  { memset(buf,(int)(i&0xff),b->bytes);
+    if(CHAN_FAILURE(Chan_Next(w,&buf,b->bytes)))
+      break;
+  }
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(w);
+  return NULL;
+}
+
+static void* consumer(void *arg)
+{ bench_t *b = (bench_t*)arg;
+  Chan *r = Chan_Open(b->q,CHAN_READ); // opened here so first-reader placement sees this node
+  void *buf = Chan_Token_Buffer_Alloc(b->q);
+  while(CHAN_SUCCESS(Chan_Next(r,&buf,b->bytes)))
+  { const uint64_t *p = (const uint64_t*)buf,
+                   *e = p+b->bytes/sizeof(uint64_t);
+    uint64_t acc=0;
+    double t0 = Thread_Time();
+    while(p<e) acc+=*p++;
+    b->read_s   += Thread_Time()-t0;
+    b->checksum += acc;
+  }
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(r);
+  return NULL;
+}
+
+/** First processor on \a node, or -1. */
+static int processor_on(int node)
+{ unsigned cpu,n=Thread_Processor_Count();
+  for(cpu=0;cpu<n;++cpu)
+    if(Numa_Node_Of_Processor(cpu)==node)
+      return (int)cpu;
+  return -1;
+}
+
+int main(int argc, char* argv[])
+{ const char *names[] = {"default","first-reader","bind","interleave"};
+  ChanNuma    modes[] = {CHAN_NUMA_DEFAULT,CHAN_NUMA_FIRST_READER,CHAN_NUMA_BIND,CHAN_NUMA_INTERLEAVE};
+  unsigned nframes=400,depth=8,m,nodes=Numa_Node_Count();
+  double   mb=8.0;
+  int      near,far;
+  if(argc>1) nframes=atoi(argv[1]);
+  if(argc>2) mb     =atof(argv[2]);
+  if(argc>3) depth  =atoi(argv[3]);
+  if(nframes<1 || mb<=0.0 || depth<1 || (depth&(depth-1)))
+  { fprintf(stderr,"Usage: %s [frames] [MB/frame] [depth (power of 2)]"ENDL,argv[0]);
+    return 1;
+  }
+  near = processor_on(0);
+  far  = processor_on((int)nodes-1);
+  printf("%u node(s).  Producer on processor %d (node 0), consumer on processor %d (node %u)."ENDL,
+         nodes,near,far,nodes-1);
+  if(nodes==1)
+    printf("Single node: placements should perform the same."ENDL);
+  printf("%-14s %12s"ENDL,"placement","read MB/s");
+  for(m=0;m<sizeof(modes)/sizeof(*modes);++m)
+  { bench_t b;
+    ThreadAttr pa={0},ca={0};
+    unsigned pcpu=(unsigned)(near<0?0:near),
+             ccpu=(unsigned)(far <0?0:far);
+    Thread *tp,*tc;
+    memset(&b,0,sizeof(b));
+    b.nframes = nframes;
+    b.bytes   = (size_t)(mb*1024.0*1024.0)&~(size_t)7;
+    b.q       = Chan_Alloc_Numa(depth,b.bytes,modes[m],(int)nodes-1);
+    pa.cpus=&pcpu; pa.ncpus=(near>=0); pa.name="numa-producer";
+    ca.cpus=&ccpu; ca.ncpus=(far >=0); ca.name="numa-consumer";
+    tp = Thread_Alloc_Ex(producer,&b,&pa);
+    Chan_Wait_For_Writer_Count(b.q,1); // so the reader doesn't see an empty, writerless queue
+    tc = Thread_Alloc_Ex(consumer,&b,&ca);
+    if(!tc || !tp)
+    { fprintf(stderr,"Could not start pinned threads."ENDL);
+      return 1;
+    }
+    Thread_Join(tp);
+    Thread_Join(tc);
+    Thread_Free(tp);
+    Thread_Free(tc);
+    printf("%-14s %12.1f"ENDL,names[m],
+           b.read_s>0?nframes*(double)b.bytes/b.read_s/1024.0/1024.0:0.0);
+    Chan_Close(b.q);
+  }
+  return 0;
+}
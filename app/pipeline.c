@@ -0,0 +1,516 @@
+/** \file
+ *  Camera pipeline macro-benchmark.
+ *
+ *  Simulates an acquisition system end to end so that whole-system effects
+ *  of changes to \ref Chan can be measured:
+ *
+ *  \verbatim
+ *    source 0 --> raw[0] --> worker x W --\
+ *    source 1 --> raw[1] --> worker x W ---+--> proc --> merger --> out --> sink
+ *    ...                                  /
+ *  \endverbatim
+ *
+ *  - Each source emits multi-MB 16-bit frames at a fixed rate into its own
+ *    channel.  When the channel is full the frame is dropped, just like a
+ *    camera that overruns its DMA ring.
+ *  - Workers bin each frame 2x2 and push the result into a shared channel
+ *    (fan-in).
+ *  - The merger stitches binned frames with the same sequence number into a
+ *    mosaic and forwards complete (or evicted, incomplete) sets to the sink.
+ *  - The sink reads every pixel of the mosaic and records latency.
+ *
+ *  At the end of a fixed run the sustained frame rate, per-stage occupancy
+ *  (fraction of time spent working rather than waiting in Chan_Next()),
+ *  queue fill levels, dropped frames and memory use are reported.
+ *
+ *  Usage:
+ *  \verbatim
+ *    pipeline [seconds=5] [sources=2] [workers/source=2] [fps=60] [width=2048] [height=1024]
+ *  \endverbatim
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "thread.h"
+#include "chan.h"
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+#define MAX_SOURCES   16
+#define MAX_WORKERS   16
+#define RAW_DEPTH      8   // buffers per source channel (power of 2)
+#define PROC_DEPTH    16
+#define OUT_DEPTH      4
+#define MERGE_WINDOW   4   // number of in-flight frame sets held by the merger
+#define SAMPLE_US   1000   // queue monitor sampling period
+
+//////////////////////////////////////////////////////////////////////
+//  Utilities  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static double now_s(void)
+{
+#ifdef _MSC_VER
+  LARGE_INTEGER f,t;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+1e-9*t.tv_nsec;
+#endif
+}
+
+/** Resident set size and its peak in MB.  Reports -1 when unknown. */
+static void memory_use_mb(double *rss, double *peak)
+{ *rss=*peak=-1.0;
+#ifdef __linux__
+  { FILE *fp;
+    char line[256];
+    if(fp=fopen("/proc/self/status","r"))
+    { while(fgets(line,sizeof(line),fp))
+      { long kb;
+        if(sscanf(line,"VmRSS: %ld kB",&kb)==1) *rss =kb/1024.0;
+        if(sscanf(line,"VmHWM: %ld kB",&kb)==1) *peak=kb/1024.0;
+      }
+      fclose(fp);
+    }
+  }
+#elif !defined(_MSC_VER)
+  { struct rusage u;
+    if(getrusage(RUSAGE_SELF,&u)==0)
+      *peak = u.ru_maxrss/1024.0; // kB on most systems
+  }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Messages   ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _frame_header
+{ unsigned source;
+  unsigned seq;
+  double   t_acquired;   ///< time the oldest contributing frame was acquired
+  unsigned count;        ///< number of frames contributing (mosaic only)
+  unsigned pad;
+} frame_header_t;
+
+#define PIXELS(e) ((uint16_t*)(((frame_header_t*)(e))+1))
+
+//////////////////////////////////////////////////////////////////////
+//  Stages     ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _stage_stats
+{ double   busy;         ///< seconds spent doing work
+  double   wait;         ///< seconds spent inside Chan_Next()
+  unsigned nin;
+  unsigned nout;         ///< sink: frames contained in the delivered sets
+  unsigned dropped;      ///< source: overruns, merger: late frames
+  unsigned incomplete;   ///< merger: sets emitted with missing frames
+  double   latency_sum;  ///< sink
+  double   latency_max;  ///< sink
+  double   checksum;     ///< sink
+} stage_stats_t;
+
+typedef struct _config
+{ double   seconds;
+  unsigned nsources;
+  unsigned nworkers;     ///< per source
+  double   fps;
+  unsigned width,height;
+} config_t;
+
+typedef struct _stage
+{ int            id;
+  const config_t *cfg;
+  Chan          *in;     ///< opened reader (NULL for sources)
+  Chan          *out;    ///< opened writer (NULL for the sink)
+  stage_stats_t  stats;
+} stage_t;
+
+static volatile int stop;
+
+static void* source(void *arg)
+{ stage_t *s = (stage_t*)arg;
+  const config_t *cfg = s->cfg;
+  void    *buf = Chan_Token_Buffer_Alloc(s->out);
+  size_t   nbytes = Chan_Buffer_Size_Bytes(s->out);
+  double   period = (cfg->fps>0)?1.0/cfg->fps:0.0,
+           next = now_s();
+  unsigned seq = 0;
+  while(!stop)
+  { double t0=now_s();
+    if(period>0.0 && t0<next)
+    { usleep((unsigned)((next-t0)*1e6));
+      continue;
+    }
+    next += period;
+    { frame_header_t *h = (frame_header_t*)buf;
+      uint16_t *p = PIXELS(buf);
+      unsigned x,y;
+      h->source = s->id;
+      h->seq    = seq;
+      h->count  = 1;
+      h->t_acquired = t0;
+      for(y=0;y<cfg->height;++y)
+        for(x=0;x<cfg->width;++x)
+          *p++ = (uint16_t)(seq+x+y);
+    }
+    { double t1=now_s();
+      s->stats.busy+=t1-t0;
+      if(CHAN_SUCCESS(Chan_Next_Try(s->out,&buf,nbytes)))
+        ++s->stats.nout;
+      else
+        ++s->stats.dropped;
+      s->stats.wait+=now_s()-t1;
+    }
+    ++seq;
+  }
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(s->out);
+  return NULL;
+}
+
+static void* worker(void *arg)
+{ stage_t *s = (stage_t*)arg;
+  const config_t *cfg = s->cfg;
+  void    *ibuf = Chan_Token_Buffer_Alloc(s->in),
+          *obuf = Chan_Token_Buffer_Alloc(s->out);
+  size_t   isz  = Chan_Buffer_Size_Bytes(s->in),
+           osz  = Chan_Buffer_Size_Bytes(s->out);
+  unsigned w = cfg->width, h = cfg->height;
+  double   t0 = now_s(),t1;
+  while(CHAN_SUCCESS(Chan_Next(s->in,&ibuf,isz)))
+  { t1=now_s();
+    s->stats.wait+=t1-t0;
+    ++s->stats.nin;
+    *(frame_header_t*)obuf = *(frame_header_t*)ibuf;
+    { const uint16_t *src = PIXELS(ibuf);
+      uint16_t *dst = PIXELS(obuf);
+      unsigned x,y;
+      for(y=0;y<h;y+=2)
+      { const uint16_t *r0=src+y*w,*r1=r0+w;
+        for(x=0;x<w;x+=2)
+          *dst++ = (uint16_t)(((unsigned)r0[x]+r0[x+1]+r1[x]+r1[x+1])>>2);
+      }
+    }
+    t0=now_s();
+    s->stats.busy+=t0-t1;
+    if(CHAN_SUCCESS(Chan_Next(s->out,&obuf,osz)))
+      ++s->stats.nout;
+    t1=now_s();
+    s->stats.wait+=t1-t0;
+    t0=t1;
+  }
+  Chan_Token_Buffer_Free(ibuf);
+  Chan_Token_Buffer_Free(obuf);
+  Chan_Close(s->out);
+  Chan_Close(s->in);
+  return NULL;
+}
+
+typedef struct _merge_slot
+{ void    *buf;
+  unsigned seq;
+  unsigned count;
+} merge_slot_t;
+
+/** Pushes the set held in \a slot downstream.  Returns the time spent waiting. */
+static double merge_flush(stage_t *s, merge_slot_t *slot)
+{ size_t osz = Chan_Buffer_Size_Bytes(s->out);
+  double t = now_s();
+  if(!slot->count) return 0.0;
+  ((frame_header_t*)slot->buf)->count = slot->count;
+  if(slot->count<s->cfg->nsources)
+    ++s->stats.incomplete;
+  if(CHAN_SUCCESS(Chan_Next(s->out,&slot->buf,osz)))
+    ++s->stats.nout;
+  slot->count=0;
+  t=now_s()-t;
+  s->stats.wait+=t;
+  return t;
+}
+
+static void* merger(void *arg)
+{ stage_t *s = (stage_t*)arg;
+  const config_t *cfg = s->cfg;
+  merge_slot_t slots[MERGE_WINDOW];
+  void    *ibuf = Chan_Token_Buffer_Alloc(s->in);
+  size_t   isz  = Chan_Buffer_Size_Bytes(s->in);
+  unsigned bw = cfg->width/2, bh = cfg->height/2,
+           mw = bw*cfg->nsources;
+  double   t0 = now_s(),t1;
+  int i;
+  for(i=0;i<MERGE_WINDOW;++i)
+  { slots[i].buf   = Chan_Token_Buffer_Alloc(s->out);
+    slots[i].count = 0;
+  }
+  while(CHAN_SUCCESS(Chan_Next(s->in,&ibuf,isz)))
+  { const frame_header_t *h = (frame_header_t*)ibuf;
+    merge_slot_t *slot = slots+(h->seq%MERGE_WINDOW);
+    double blocked = 0.0;
+    t1=now_s();
+    s->stats.wait+=t1-t0;
+    ++s->stats.nin;
+    if(slot->count && slot->seq!=h->seq)
+    { if((int)(h->seq-slot->seq)<0) // arrived after its set was evicted
+      { ++s->stats.dropped;
+        t0=now_s();
+        s->stats.busy+=t0-t1;
+        continue;
+      }
+      blocked+=merge_flush(s,slot);
+    }
+    if(!slot->count)
+    { frame_header_t *m = (frame_header_t*)slot->buf;
+      slot->seq = h->seq;
+      m->source = 0;
+      m->seq    = h->seq;
+      m->t_acquired = h->t_acquired;
+    } else if(h->t_acquired<((frame_header_t*)slot->buf)->t_acquired)
+      ((frame_header_t*)slot->buf)->t_acquired = h->t_acquired;
+    { const uint16_t *src = PIXELS(ibuf);
+      uint16_t *dst = PIXELS(slot->buf)+h->source*bw;
+      unsigned y;
+      for(y=0;y<bh;++y)
+        memcpy(dst+y*mw,src+y*bw,bw*sizeof(uint16_t));
+    }
+    if(++slot->count==cfg->nsources)
+      blocked+=merge_flush(s,slot);
+    t0=now_s();
+    s->stats.busy+=t0-t1-blocked;
+  }
+  for(i=0;i<MERGE_WINDOW;++i)
+  { merge_flush(s,slots+i);
+    Chan_Token_Buffer_Free(slots[i].buf);
+  }
+  Chan_Token_Buffer_Free(ibuf);
+  Chan_Close(s->out);
+  Chan_Close(s->in);
+  return NULL;
+}
+
+static void* sink(void *arg)
+{ stage_t *s = (stage_t*)arg;
+  void    *buf = Chan_Token_Buffer_Alloc(s->in);
+  size_t   sz  = Chan_Buffer_Size_Bytes(s->in),
+           n   = (s->cfg->width/2)*(s->cfg->height/2)*s->cfg->nsources;
+  double   t0 = now_s(),t1;
+  while(CHAN_SUCCESS(Chan_Next(s->in,&buf,sz)))
+  { const uint16_t *p = PIXELS(buf);
+    uint64_t acc=0;
+    size_t i;
+    t1=now_s();
+    s->stats.wait+=t1-t0;
+    ++s->stats.nin;
+    for(i=0;i<n;++i)
+      acc+=p[i];
+    s->stats.checksum+=(double)acc;
+    s->stats.nout+=((frame_header_t*)buf)->count;
+    t0=now_s();
+    { double lat = t0-((frame_header_t*)buf)->t_acquired;
+      s->stats.latency_sum+=lat;
+      if(lat>s->stats.latency_max)
+        s->stats.latency_max=lat;
+    }
+    s->stats.busy+=t0-t1;
+  }
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(s->in);
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Queue monitor  ///////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _queue_stats
+{ const char *name;
+  Chan       *q;
+  unsigned    nfull,nempty;
+} queue_stats_t;
+
+typedef struct _monitor
+{ queue_stats_t *queues;
+  unsigned       nqueues;
+  unsigned       nsamples;
+  volatile int   stop;
+} monitor_t;
+
+static void* monitor(void *arg)
+{ monitor_t *m = (monitor_t*)arg;
+  while(!m->stop)
+  { unsigned i;
+    for(i=0;i<m->nqueues;++i)
+    { m->queues[i].nfull +=Chan_Is_Full (m->queues[i].q)!=0;
+      m->queues[i].nempty+=Chan_Is_Empty(m->queues[i].q)!=0;
+    }
+    ++m->nsamples;
+    usleep(SAMPLE_US);
+  }
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Report     ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static void report_stage(const char *name, stage_t *stages, unsigned n, double wall)
+{ stage_stats_t t;
+  unsigned i;
+  memset(&t,0,sizeof(t));
+  for(i=0;i<n;++i)
+  { t.busy      +=stages[i].stats.busy;
+    t.wait      +=stages[i].stats.wait;
+    t.nin       +=stages[i].stats.nin;
+    t.nout      +=stages[i].stats.nout;
+    t.dropped   +=stages[i].stats.dropped;
+    t.incomplete+=stages[i].stats.incomplete;
+  }
+  printf("  %-8s %3u  %8u %8u %8u %8u  %6.1f%% %6.1f%%"ENDL,
+      name,n,t.nin,t.nout,t.dropped,t.incomplete,
+      100.0*t.busy/(wall*n),100.0*t.wait/(wall*n));
+}
+
+int main(int argc,char* argv[])
+{ config_t cfg = {5.0,2,2,60.0,2048,1024};
+  stage_t  sources[MAX_SOURCES],workers[MAX_SOURCES*MAX_WORKERS],merge,drain;
+  Thread  *threads[MAX_SOURCES*(MAX_WORKERS+1)+2],*mon;
+  Chan    *raw[MAX_SOURCES],*proc,*out;
+  queue_stats_t queues[MAX_SOURCES+2];
+  monitor_t m;
+  unsigned i,j,nthreads=0,nworkers;
+  double   t0,wall;
+
+  if(argc>1) cfg.seconds =atof(argv[1]);
+  if(argc>2) cfg.nsources=atoi(argv[2]);
+  if(argc>3) cfg.nworkers=atoi(argv[3]);
+  if(argc>4) cfg.fps     =atof(argv[4]);
+  if(argc>5) cfg.width   =atoi(argv[5]);
+  if(argc>6) cfg.height  =atoi(argv[6]);
+  cfg.width &=~1u;
+  cfg.height&=~1u;
+  if(cfg.nsources<1 || cfg.nsources>MAX_SOURCES
+   ||cfg.nworkers<1 || cfg.nworkers>MAX_WORKERS
+   ||cfg.width<2    || cfg.height<2)
+  { fprintf(stderr,"Usage: %s [seconds] [sources<=%d] [workers/source<=%d] [fps] [width] [height]"ENDL,
+        argv[0],MAX_SOURCES,MAX_WORKERS);
+    return 1;
+  }
+  nworkers=cfg.nsources*cfg.nworkers;
+
+  { size_t frame  = sizeof(frame_header_t)+cfg.width*cfg.height*sizeof(uint16_t),
+           binned = sizeof(frame_header_t)+(cfg.width/2)*(cfg.height/2)*sizeof(uint16_t),
+           mosaic = sizeof(frame_header_t)+(cfg.width/2)*(cfg.height/2)*sizeof(uint16_t)*cfg.nsources;
+    printf("Pipeline: %u source(s) x %u worker(s), %.1f fps, %ux%u (%.2f MB/frame), %.1f s"ENDL,
+        cfg.nsources,cfg.nworkers,cfg.fps,cfg.width,cfg.height,frame/1048576.0,cfg.seconds);
+    for(i=0;i<cfg.nsources;++i)
+      raw[i]=Chan_Alloc(RAW_DEPTH,frame);
+    proc=Chan_Alloc(PROC_DEPTH,binned);
+    out =Chan_Alloc(OUT_DEPTH,mosaic);
+  }
+
+  // Open every reference up front so no stage can observe a channel
+  // without its writers and shut down early.
+  for(i=0;i<cfg.nsources;++i)
+  { stage_t *s=sources+i;
+    memset(s,0,sizeof(*s));
+    s->id=i; s->cfg=&cfg;
+    s->out=Chan_Open(raw[i],CHAN_WRITE);
+    for(j=0;j<cfg.nworkers;++j)
+    { stage_t *w=workers+i*cfg.nworkers+j;
+      memset(w,0,sizeof(*w));
+      w->id=i*cfg.nworkers+j; w->cfg=&cfg;
+      w->in =Chan_Open(raw[i],CHAN_READ);
+      w->out=Chan_Open(proc,CHAN_WRITE);
+    }
+  }
+  memset(&merge,0,sizeof(merge));
+  merge.cfg=&cfg;
+  merge.in =Chan_Open(proc,CHAN_READ);
+  merge.out=Chan_Open(out,CHAN_WRITE);
+  memset(&drain,0,sizeof(drain));
+  drain.cfg=&cfg;
+  drain.in =Chan_Open(out,CHAN_READ);
+
+  memset(&m,0,sizeof(m));
+  for(i=0;i<cfg.nsources;++i)
+  { queues[i].q=raw[i];
+    queues[i].name="raw";
+  }
+  queues[i  ].q=proc; queues[i  ].name="proc";
+  queues[i+1].q=out;  queues[i+1].name="out";
+  for(i=0;i<cfg.nsources+2;++i)
+    queues[i].nfull=queues[i].nempty=0;
+  m.queues=queues;
+  m.nqueues=cfg.nsources+2;
+
+  t0=now_s();
+  mon=Thread_Alloc(monitor,&m);
+  threads[nthreads++]=Thread_Alloc(sink,&drain);
+  threads[nthreads++]=Thread_Alloc(merger,&merge);
+  for(i=0;i<nworkers;++i)
+    threads[nthreads++]=Thread_Alloc(worker,workers+i);
+  for(i=0;i<cfg.nsources;++i)
+    threads[nthreads++]=Thread_Alloc(source,sources+i);
+
+  usleep((unsigned)(cfg.seconds*1e6));
+  stop=1;
+  for(i=0;i<nthreads;++i)
+    Thread_Join(threads[i]);
+  wall=now_s()-t0;
+  m.stop=1;
+  Thread_Join(mon);
+  Thread_Free(mon);
+  for(i=0;i<nthreads;++i)
+    Thread_Free(threads[i]);
+
+  { unsigned produced=0,dropped=0;
+    double rss,peak;
+    for(i=0;i<cfg.nsources;++i)
+    { produced+=sources[i].stats.nout+sources[i].stats.dropped;
+      dropped +=sources[i].stats.dropped;
+    }
+    printf(ENDL"  %-8s %3s  %8s %8s %8s %8s  %7s %7s"ENDL,
+        "stage","n","in","out","dropped","partial","busy","wait");
+    report_stage("source",sources,cfg.nsources,wall);
+    report_stage("worker",workers,nworkers,wall);
+    report_stage("merger",&merge,1,wall);
+    report_stage("sink",&drain,1,wall);
+
+    printf(ENDL"  %-8s %7s %7s"ENDL,"queue","full","empty");
+    for(i=0;i<m.nqueues;++i)
+    { char name[16];
+      if(i<cfg.nsources) sprintf(name,"%s[%u]",queues[i].name,i);
+      else               sprintf(name,"%s",queues[i].name);
+      printf("  %-8s %6.1f%% %6.1f%%"ENDL,name,
+          100.0*queues[i].nfull /(m.nsamples?m.nsamples:1),
+          100.0*queues[i].nempty/(m.nsamples?m.nsamples:1));
+    }
+
+    printf(ENDL"  Frames acquired   %8u (%.1f fps)"ENDL,produced,produced/wall);
+    printf(    "  Frames dropped    %8u (%.2f%%)"ENDL,dropped,produced?100.0*dropped/produced:0.0);
+    printf(    "  Sets delivered    %8u (%.1f sets/s, %.1f frames/s sustained)"ENDL,
+        drain.stats.nin,drain.stats.nin/wall,drain.stats.nout/wall);
+    printf(    "  Latency           mean %.2f ms, max %.2f ms"ENDL,
+        drain.stats.nin?1e3*drain.stats.latency_sum/drain.stats.nin:0.0,1e3*drain.stats.latency_max);
+    memory_use_mb(&rss,&peak);
+    printf(    "  Memory            rss %.1f MB, peak %.1f MB"ENDL,rss,peak);
+  }
+
+  for(i=0;i<cfg.nsources;++i)
+    Chan_Close(raw[i]);
+  Chan_Close(proc);
+  Chan_Close(out);
+  return 0;
+}
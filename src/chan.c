@@ -122,6 +122,15 @@
     is set by the Chan_Alloc() call. Chan_Resize() can be used to change 
     the size of the blocks, though it is only possible to \a increase the size.
 
+    For small messages, Chan_Alloc_Inline() trades the swap for a copy.
+    When the block size is at most \c FIFO_INLINE_MAX_BYTES (64 unless
+    defined otherwise at compile time), messages are kept inline in one
+    contiguous, cache-aligned array, and Chan_Next() copies them in and
+    out instead of swapping pointers.  The token buffer you get back is
+    the one you passed in, so don't hold on to it expecting the queue to
+    keep your data.  Resizing past the limit switches the queue to
+    separate blocks, and swaps, from then on.  Chan_Alloc() always swaps.
+
     When a buffer is swapped on to a queue via Chan_Next(), it may be resized
     so it is large enough to hold a block.  It is recommended that  
     Chan_Token_Buffer_Alloc() is used to pre-allocate buffers that 
@@ -138,6 +147,122 @@
       if(data) Chan_Token_Buffer_Free(data);  // remember to free the data!
     }
     \endcode
+
+    \section numa NUMA placement
+
+    On machines with several memory nodes, a buffer filled by a thread on
+    one socket and read on another costs remote bandwidth on every
+    message.  Chan_Alloc_Numa() places the buffers of a channel: on the
+    node of its first reader, on a given node, or interleaved over all
+    nodes.  Every buffer the channel allocates afterwards, including
+    token buffers, expansion and resizing, is placed the same way.
+    Buffers that weren't placed the same way, by this or another channel,
+    are replaced by placed copies when they're swapped in, so the ring stays on the right node as
+    buffers are recycled.  Allocate token buffers with
+    Chan_Token_Buffer_Alloc() to avoid the copies.
+
+    \section allocators Allocators
+
+    Chan_Alloc_With_Allocator() takes a \ref ChanAllocator whose hooks
+    replace malloc(), realloc() and free() for every buffer the channel
+    touches: the ring, token buffers, expansion, resizing and the copies
+    made by Chan_Next_Copy().  Use it to keep messages in pinned or
+    registered memory.  As with placement, buffers from elsewhere that are
+    swapped in are replaced by copies from the allocator.
+
+    Chan_Token_Buffer_Free() returns a buffer to whichever allocator it came
+    from, so buffers received from the channel can be released with it,
+    even after the channel is closed.  Don't free() them.
+
+    Each buffer starts \c CHAN_BUFFER_HEADER_BYTES into its allocation,
+    where the channel records which allocator it belongs to.  The hooks
+    are asked for that much more than the block size, and \c realloc and
+    \c free get back the pointer \c alloc returned.
+
+    \section inplace Working in place
+
+    Instead of swapping token buffers, a writer can fill the queue's own
+    memory, and a reader can use a message where it lies:
+    \code
+    { void *slot; size_t cap,n;
+      if(CHAN_SUCCESS(Chan_Reserve(writer,&slot,&cap)))
+      { n = fill(slot,cap);                 // up to cap bytes
+        Chan_Commit(writer,n);
+      }
+      if(CHAN_SUCCESS(Chan_Acquire(reader,&slot,&n)))
+      { use(slot,n);                        // the n bytes committed
+        Chan_Release(reader);
+      }
+    }
+    \endcode
+    Nobody owns a token, nothing is allocated or swapped, and it works the
+    same for inline and separately allocated slots.  Chan_Acquire() fails
+    like Chan_Next() does: when the queue is empty and there are no more
+    writers.
+
+    A channel has at most one reserved and one acquired slot at a time.
+    Other writers (including Chan_Next()) wait for the commit, and other
+    readers wait for the release, so keep the work in between short.
+    Operations that would move the slots, like expanding or growing the
+    buffers, wait too; don't call Chan_Resize() while a slot is held.
+    Closing a writer drops its uncommitted slot, and closing a reader
+    releases its slot.
+
+    \section vec Scatter-gather messages
+
+    A big frame normally needs one contiguous block, and growing the
+    frames means resizing every block in the queue.  A channel made with
+    Chan_Alloc_Vec() carries messages as lists of fixed-size chunks
+    instead:
+    \code
+    { Chan *q = Chan_Alloc_Vec(8,64<<20,0),   // up to 64 MB in 4 kB chunks
+           *w = Chan_Open(q,CHAN_WRITE);
+      ChanVec *v = Chan_Vec_Alloc(q);
+      Chan_Vec_Size(q,v,frame_bytes);          // chunks come from a pool
+      fill(v->iov,v->count);
+      Chan_Next_Vec(w,&v);                     // swaps, like Chan_Next()
+      ...
+      Chan_Token_Buffer_Free(v);               // also frees its chunks
+    }
+    \endcode
+    A reader gets a ChanVec from Chan_Next_Vec() and can hand \c iov
+    straight to writev().  Chunks travel with their message and come back
+    round through the swap, so Chan_Vec_Size() usually only adjusts the
+    last chunk's length.  When a message needs more chunks than its token
+    holds, spares come from the channel's pool; extra chunks go back to it.
+    Nothing is ever reallocated.  Messages bigger than the limit passed to
+    Chan_Alloc_Vec() are refused.
+
+    A ChanVec read from one vector channel can be passed straight to
+    Chan_Next_Vec() on another.  Its chunks move to a token of the new
+    channel if they're the same size; otherwise the message is copied.
+    Use Chan_Next_Vec(), not Chan_Next(), on these channels.
+
+    \section realtime Real-time channels
+
+    Normally Chan_Next() may allocate: undersized tokens are resized, a full
+    queue may be expanded, and Chan_Open() allocates a handle.  An allocator
+    that takes a lock can then stall the caller for milliseconds.
+    Chan_Alloc_Realtime() makes a channel that does all of its allocation
+    up front:
+
+    - Ring buffers, the copy workspace and \a max_handles handles are
+      allocated by the call.  Chan_Open() fails when the handles run out.
+    - With \a lock_memory, buffers are locked in memory with mlock() (or
+      VirtualLock()), so they never page fault.  Chan_Alloc_Realtime()
+      returns NULL if they can't be locked; check RLIMIT_MEMLOCK.  Token
+      buffers from Chan_Token_Buffer_Alloc() are locked too.
+    - Sizes are fixed.  Chan_Next() fails, rather than reallocating, when a
+      token is NULL or isn't exactly Chan_Buffer_Size_Bytes(); readers may
+      pass bigger tokens.  The copy variants accept messages up to the
+      buffer size.  Chan_Resize() and Chan_Set_Expand_On_Full() are ignored.
+
+    Swapped-in tokens aren't checked, so allocate them with
+    Chan_Token_Buffer_Alloc() before the time-critical part starts.
+
+    In debug builds (without \c NDEBUG), any allocation by the queue
+    while Chan_Next(), Chan_Peek() or their variants run on a real-time
+    channel is a fatal error.
   */
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-value"
@@ -145,6 +270,7 @@
 
 #include <stdio.h>   // for printf used in reporting errors, etc...
 #include <string.h>
+#include <stddef.h>  // offsetof
 #include "config.h"
 #include "thread.h"
 #include "chan.h"
@@ -153,6 +279,10 @@
 #define SUCCESS (0) 
 #define FAILURE (1)
 
+#if CHAN_BUFFER_HEADER_BYTES!=FIFO_BUFFER_HEADER_BYTES
+#error "CHAN_BUFFER_HEADER_BYTES must match FIFO_BUFFER_HEADER_BYTES"
+#endif
+
 #define DEBUG_CHAN
 
 //////////////////////////////////////////////////////////////////////
@@ -225,6 +355,25 @@ typedef struct
   Condition          haveReader; //predicate: nreaders>0
 
   void              *workspace;  // Token buffer used for copy operations.
+  int                place_on_read; // CHAN_NUMA_FIRST_READER, not yet placed
+  int                copies;      // see Chan_Alloc_Inline()
+
+  int                realtime;    // see Chan_Alloc_Realtime()
+  int                lock_memory;
+  struct _chan      *handles;     // preallocated handles (real-time only)
+  struct _chan     **spare;       // stack of unused handles
+  u32                nhandles;
+  u32                nspare;
+
+  struct _chan      *reserver;    // writer between Chan_Reserve() and Chan_Commit()
+  struct _chan      *acquirer;    // reader between Chan_Acquire() and Chan_Release()
+
+  size_t             chunk_bytes; // scatter-gather channels only, otherwise 0
+  size_t             max_chunks;
+  size_t             max_bytes;
+  void             **pool;        // spare chunks
+  size_t             npool,
+                     pool_cap;
 } __chan_t;
 
 typedef struct _chan
@@ -233,10 +382,30 @@ typedef struct _chan
   ChanMode  mode;
 } chan_t;
 
-__chan_t* chan_alloc(size_t buffer_count, size_t buffer_size_bytes)
+#define REALTIME_BEGIN(q) { if((q)->realtime) Fifo_No_Alloc_Begin(); }
+#define REALTIME_END(q)   { if((q)->realtime) Fifo_No_Alloc_End();   }
+
+// Handles come from the pool for real-time channels.  NULL if it's empty.
+// must be called from inside a lock, except on a new channel
+static chan_t *handle_alloc(__chan_t *q)
+{ if(!q->handles)
+    return (chan_t*)malloc(sizeof(chan_t));
+  return q->nspare?q->spare[--q->nspare]:NULL;
+}
+
+// Returns 1 if <c> went back to a pool.
+// must be called from inside a lock
+static int handle_free(__chan_t *q, chan_t *c)
+{ if(q->handles && q->handles<=c && c<q->handles+q->nhandles)
+  { q->spare[q->nspare++]=c;
+    return 1;
+  }
+  return 0;
+}
+
+static __chan_t* chan_init(Fifo *fifo)
 { __chan_t *c=0;
-  Fifo *fifo;
-  if(fifo=Fifo_Alloc(buffer_count,buffer_size_bytes))
+  if(fifo)
   { Chan_Assert(c=(__chan_t*)calloc(1,sizeof(__chan_t)));
     c->fifo = fifo;
     c->lock = MUTEX_INITIALIZER;
@@ -251,35 +420,126 @@ __chan_t* chan_alloc(size_t buffer_count, size_t buffer_size_bytes)
   return c;
 }
 
+__chan_t* chan_alloc(size_t buffer_count, size_t buffer_size_bytes, NumaPolicy policy, int node)
+{ return chan_init(Fifo_Alloc_Placed(buffer_count,buffer_size_bytes,policy,node));
+}
+
+static Chan* chan_handle(__chan_t *q)
+{ chan_t *c=0;
+  if(q)
+  { Chan_Assert(c=handle_alloc(q));
+    c->q = q;
+    c->mode = CHAN_NONE;
+  }
+  return (Chan*)c;
+}
+
 void chan_destroy(__chan_t* c)
 { //precondition - called when the last reference is released
   //             - nobody should be waiting
   Fifo_Free_Token_Buffer(c->workspace);
   Fifo_Free(c->fifo);
+  free(c->handles);
+  free(c->spare);
+  while(c->npool)
+    free(c->pool[--c->npool]);
+  free(c->pool);
   free(c);
 }
 
 Chan* Chan_Alloc( size_t buffer_count, size_t buffer_size_bytes)
-{ chan_t   *c=0;
-  __chan_t *q=0;
-  if(q=chan_alloc(buffer_count,buffer_size_bytes))
-  { Chan_Assert(c=(chan_t*)malloc(sizeof(chan_t)));
-    c->q = q;
-    c->mode = CHAN_NONE;
-  }
+{ return Chan_Alloc_Numa(buffer_count,buffer_size_bytes,CHAN_NUMA_DEFAULT,-1);
+}
+
+Chan* Chan_Alloc_Inline( size_t buffer_count, size_t buffer_size_bytes)
+{ chan_t *c;
+  if(buffer_size_bytes>FIFO_INLINE_MAX_BYTES)
+    return Chan_Alloc(buffer_count,buffer_size_bytes);
+  return_val_if(!(c=(chan_t*)chan_handle(chan_init(Fifo_Alloc_Inline(buffer_count,buffer_size_bytes)))),NULL);
+  c->q->copies = 1;
   return (Chan*)c;
 }
 
-inline
+Chan* Chan_Alloc_Numa( size_t buffer_count, size_t buffer_size_bytes, ChanNuma placement, int node)
+{ __chan_t *q=0;
+  NumaPolicy policy = NUMA_POLICY_DEFAULT;
+  switch(placement)
+  { case CHAN_NUMA_BIND:       policy=NUMA_POLICY_BIND;       break;
+    case CHAN_NUMA_INTERLEAVE: policy=NUMA_POLICY_INTERLEAVE; break;
+    default: ;
+  }
+  if(q=chan_alloc(buffer_count,buffer_size_bytes,policy,node))
+    q->place_on_read = (placement==CHAN_NUMA_FIRST_READER);
+  return chan_handle(q);
+}
+
+Chan* Chan_Alloc_With_Allocator( size_t buffer_count, size_t buffer_size_bytes, const ChanAllocator *allocator)
+{ FifoAllocator a;
+  return_val_if(!allocator,NULL);
+  a.alloc   = allocator->alloc;
+  a.realloc = allocator->realloc;
+  a.free    = allocator->free;
+  a.ctx     = allocator->ctx;
+  return chan_handle(chan_init(Fifo_Alloc_With_Allocator(buffer_count,buffer_size_bytes,&a)));
+}
+
+Chan* Chan_Alloc_Realtime( size_t buffer_count, size_t buffer_size_bytes, unsigned max_handles, int lock_memory)
+{ __chan_t *q;
+  u32 i;
+  return_val_if(max_handles<1,NULL);
+  return_val_if(!(q=chan_init(Fifo_Alloc_Realtime(buffer_count,buffer_size_bytes,lock_memory))),NULL);
+  q->realtime    = 1;
+  q->lock_memory = lock_memory;
+  q->nhandles    = max_handles;
+  Chan_Assert(q->handles=(chan_t*) calloc(max_handles,sizeof(chan_t)));
+  Chan_Assert(q->spare  =(chan_t**)calloc(max_handles,sizeof(chan_t*)));
+  for(i=max_handles;i>0;--i)
+    q->spare[q->nspare++]=q->handles+i-1;
+  if(lock_memory)
+  { // the workspace was allocated before the fifo knew to lock it
+    Fifo_Free_Token_Buffer(q->workspace);
+    q->workspace=Fifo_Alloc_Token_Buffer(q->fifo);
+  }
+  return chan_handle(q);
+}
+
+// must be called from inside a lock
+static void place_for_reader(__chan_t *q)
+{ int node;
+  q->place_on_read=0;
+  if((node=Numa_Current_Node())<0)
+    return;
+  Fifo_Set_Placement(q->fifo,NUMA_POLICY_BIND,node);
+  Fifo_Free_Token_Buffer(q->workspace);
+  q->workspace = Fifo_Alloc_Token_Buffer(q->fifo);
+}
+
 Chan *Chan_Alloc_Copy( Chan *chan)
-{ return Chan_Alloc(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan));
+{ __chan_t *q = ((chan_t*)chan)->q;
+  const FifoAllocator *a = Fifo_Get_Allocator(q->fifo);
+  if(q->realtime)
+    return Chan_Alloc_Realtime(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan),q->nhandles,q->lock_memory);
+  if(q->chunk_bytes)
+    return Chan_Alloc_Vec(Chan_Buffer_Count(chan),q->max_bytes,q->chunk_bytes);
+  if(a)
+    return chan_handle(chan_init(Fifo_Alloc_With_Allocator(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan),a)));
+  if(q->copies)
+    return Chan_Alloc_Inline(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan));
+  return Chan_Alloc(Chan_Buffer_Count(chan),Chan_Buffer_Size_Bytes(chan));
 }
 
 // must be called from inside a lock
 chan_t* incref(chan_t *c)
 { chan_t *n;
+  if(c->q->handles)
+  { return_val_if(!(n=handle_alloc(c->q)),NULL); // out of preallocated handles
+    ++(c->q->ref_count);
+    memcpy(n,c,sizeof(chan_t));
+    Condition_Notify_All(&c->q->changedRefCount);
+    return n;
+  }
   ++(c->q->ref_count);
-  goto_if_not(n=malloc(sizeof(chan_t)),ErrorAlloc);
+  goto_if_not(n=handle_alloc(c->q),ErrorAlloc);
   memcpy(n,c,sizeof(chan_t));
   DEBUG_SHOW_REFS;
   Condition_Notify_All(&c->q->changedRefCount);
@@ -293,21 +553,26 @@ ErrorAlloc:
 
 void decref(chan_t **pc)
 { u32 remaining;
+  int pooled;
   chan_t *c;
+  __chan_t *q;
   Chan_Assert(pc);
   c=*pc; *pc=0;
   Chan_Assert(c);
-  Mutex_Lock(&c->q->lock);
-  remaining = --(c->q->ref_count);
+  q=c->q;
+  Mutex_Lock(&q->lock);
+  remaining = --(q->ref_count);
   DEBUG_SHOW_REFS;
-  Mutex_Unlock(&c->q->lock);
+  pooled = handle_free(q,c);   // c may be reused from here on
+  Mutex_Unlock(&q->lock);
   Chan_Assert(remaining>=0);
   if(remaining==0)
-    chan_destroy(c->q);
+    chan_destroy(q);
   else
-    Condition_Notify_All(&c->q->changedRefCount);
+    Condition_Notify_All(&q->changedRefCount);
     
-  free(c);
+  if(!pooled)
+    free(c);
 }
 
 Chan* Chan_Open( Chan *self, ChanMode mode)
@@ -320,6 +585,8 @@ Chan* Chan_Open( Chan *self, ChanMode mode)
   switch(mode)
   { case CHAN_READ:
       ++(n->q->nreaders);
+      if(n->q->place_on_read)
+        place_for_reader(n->q);
       if(Fifo_Is_Empty(n->q->fifo))
         n->q->flush=0;
       Condition_Notify_All(&n->q->haveReader);
@@ -353,6 +620,16 @@ int Chan_Close( Chan *self_ )
   }
   Mutex_Lock(&self->q->lock);
   { __chan_t *q = self->q;
+    if(q->reserver==self)      // drop an uncommitted slot
+    { q->reserver=NULL;
+      Condition_Notify_All(&q->notfull);
+    }
+    if(q->acquirer==self)      // finish with an unreleased one
+    { q->acquirer=NULL;
+      Fifo_Release(q->fifo);
+      Condition_Notify_All(&q->notfull);
+      Condition_Notify_All(&q->notempty);
+    }
     switch(self->mode)
     { case CHAN_READ:  
         Chan_Assert( (--(q->nreaders))>=0 );
@@ -414,6 +691,10 @@ void Chan_Wait_For_Have_Reader(Chan* self_)
 
 void Chan_Set_Expand_On_Full( Chan* self_, int expand_on_full)
 { chan_t *self = (chan_t*)self_;  
+  if(self->q->realtime && expand_on_full)
+  { chan_warning("Warning: Chan_Set_Expand_On_Full() ignored for a real-time channel."ENDL);
+    return;
+  }
   self->q->expand_on_full=expand_on_full;
   if(expand_on_full)
     Condition_Notify_All(&self->q->notfull);
@@ -423,10 +704,37 @@ void Chan_Set_Expand_On_Full( Chan* self_, int expand_on_full)
 // Next
 // ----
 
+// Reserved and acquired slots are in use in place, so nothing may swap,
+// move or resize them until they're committed or released.
+static inline int _pinned(__chan_t *q)
+{ return q->reserver || q->acquirer;
+}
+
+// Anything that might resize the ring waits for pinned slots first.
+// must be called from inside a lock
+static void wait_unpinned(__chan_t *q)
+{ if(_pinned(q))
+  { Thread_Block_Begin();
+    while(_pinned(q))
+      Condition_Wait(&q->notfull,&q->lock);
+    Thread_Block_End();
+  }
+}
+
+static inline int _push_wait(__chan_t *q, size_t sz)
+{ return (Fifo_Is_Full(q->fifo) && (q->expand_on_full==0 || q->acquirer))
+      || q->reserver
+      || (q->acquirer && sz>Fifo_Buffer_Size_Bytes(q->fifo));
+}
+
 unsigned int chan_push__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
 { 
-  while(Fifo_Is_Full(q->fifo) && q->expand_on_full==0)
-    Condition_Wait(&q->notfull,&q->lock); // TODO: use timed wait?
+  if(_push_wait(q,sz))
+  { Thread_Block_Begin();
+    while(_push_wait(q,sz))
+      Condition_Wait(&q->notfull,&q->lock); // TODO: use timed wait?
+    Thread_Block_End();
+  }
   if(FIFO_SUCCESS(Fifo_Push(q->fifo,pbuf,sz,q->expand_on_full)))
     return SUCCESS;
   return FAILURE;
@@ -439,8 +747,12 @@ static inline int _pop_bypass_wait(__chan_t *q)
 
 unsigned int chan_pop__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
 { //int starved;
-  while(Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q))
-    Condition_Wait(&q->notempty,&q->lock); // TODO: use timed wait?
+  if((Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q)) || q->acquirer)
+  { Thread_Block_Begin();
+    while((Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q)) || q->acquirer)
+      Condition_Wait(&q->notempty,&q->lock); // TODO: use timed wait?
+    Thread_Block_End();
+  }
   //starved = Fifo_Is_Empty(q->fifo) && q->nwriters==0;
   if(FIFO_SUCCESS(Fifo_Pop(q->fifo,pbuf,sz)))
     return SUCCESS;
@@ -454,23 +766,43 @@ static inline int _peek_bypass_wait(__chan_t *q)
 
 unsigned int chan_peek__locked(__chan_t *q, void **pbuf, size_t sz, unsigned timeout_ms)
 { //int starved;
-  while(Fifo_Is_Empty(q->fifo) && !_peek_bypass_wait(q))
-    Condition_Wait(&q->notempty,&q->lock); // TODO:!! use timed wait
+  if(Fifo_Is_Empty(q->fifo) && !_peek_bypass_wait(q))
+  { Thread_Block_Begin();
+    while(Fifo_Is_Empty(q->fifo) && !_peek_bypass_wait(q))
+      Condition_Wait(&q->notempty,&q->lock); // TODO:!! use timed wait
+    Thread_Block_End();
+  }
   //starved = Fifo_Is_Empty(q->fifo) && q->nwriters==0;
   if(FIFO_SUCCESS(Fifo_Peek(q->fifo,pbuf,sz)))
     return SUCCESS;
   return FAILURE;
 }
 
+// Real-time channels never resize, so tokens must fit exactly.  Copies
+// may be smaller than a buffer.
+static int realtime_rejects(__chan_t *q, void **pbuf, size_t sz, int copy, int push)
+{ size_t n = Fifo_Buffer_Size_Bytes(q->fifo);
+  if(!*pbuf)    return 1;
+  if(copy)      return sz>n;
+  return push?(sz!=n):(sz<n);
+}
+
 unsigned int chan_push(chan_t *self, void **pbuf, size_t sz, int copy, unsigned timeout_ms)
 { // TO SELF: use timeout=0 for try 
   // precondition: this should be a "Write" mode channel
+  return_val_if(self->q->realtime && realtime_rejects(self->q,pbuf,sz,copy,1),FAILURE);
   Mutex_Lock(&self->q->lock);
+  REALTIME_BEGIN(self->q);
   { __chan_t *q = self->q;
     if(timeout_ms==0)
       goto_if(Fifo_Is_Full(q->fifo),NoPush);
-    if(copy)
-    { Fifo_Resize(q->fifo,sz);
+    if(copy && q->realtime)
+    { memcpy(q->workspace,*pbuf,sz);
+      goto_if(CHAN_FAILURE(chan_push__locked(q,&q->workspace,Fifo_Buffer_Size_Bytes(q->fifo),timeout_ms)),NoPush);
+    } else if(copy)
+    { if(sz>Fifo_Buffer_Size_Bytes(q->fifo))
+        wait_unpinned(q);
+      Fifo_Resize(q->fifo,sz);
       Fifo_Resize_Token_Buffer(q->fifo,&q->workspace);
       memcpy(q->workspace,*pbuf,sz);
       goto_if(CHAN_FAILURE(chan_push__locked(q,&q->workspace,sz,timeout_ms)),NoPush);
@@ -479,49 +811,64 @@ unsigned int chan_push(chan_t *self, void **pbuf, size_t sz, int copy, unsigned
       goto_if(CHAN_FAILURE(chan_push__locked(q,pbuf,sz,timeout_ms)),NoPush);
     }
   }
+  REALTIME_END(self->q);
   Mutex_Unlock(&self->q->lock);
   Condition_Notify(&self->q->notempty);
   return SUCCESS;
 NoPush:
+  REALTIME_END(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
 
 unsigned int chan_pop(chan_t *self, void **pbuf, size_t sz, int copy, unsigned timeout_ms)
 { 
+  return_val_if(self->q->realtime && realtime_rejects(self->q,pbuf,sz,copy,0),FAILURE);
   Mutex_Lock(&self->q->lock);
+  REALTIME_BEGIN(self->q);
   { __chan_t *q = self->q;
     if(timeout_ms==0)
       goto_if(Fifo_Is_Empty(q->fifo),NoPop);
-    if(copy)
-    { Fifo_Resize(q->fifo,sz);
+    if(copy && q->realtime)
+    { goto_if(CHAN_FAILURE(chan_pop__locked(q,&q->workspace,Fifo_Buffer_Size_Bytes(q->fifo),timeout_ms)),NoPop);
+      memcpy(*pbuf,q->workspace,sz);
+    } else if(copy)
+    { if(sz>Fifo_Buffer_Size_Bytes(q->fifo))
+        wait_unpinned(q);
+      Fifo_Resize(q->fifo,sz);
       Fifo_Resize_Token_Buffer(q->fifo,&q->workspace);
       goto_if(CHAN_FAILURE(chan_pop__locked(q,&q->workspace,sz,timeout_ms)),NoPop);
       memcpy(*pbuf,q->workspace,sz);
     } else
       goto_if(CHAN_FAILURE(chan_pop__locked(q,pbuf,sz,timeout_ms)),NoPop);
   }            
+  REALTIME_END(self->q);
   Condition_Notify(&self->q->notfull);
   Mutex_Unlock(&self->q->lock);
   return SUCCESS;
 NoPop:
+  REALTIME_END(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
 
 unsigned int chan_peek(chan_t *self, void **pbuf, size_t sz, unsigned timeout_ms)
 { 
+  return_val_if(self->q->realtime && realtime_rejects(self->q,pbuf,sz,0,0),FAILURE);
   Mutex_Lock(&self->q->lock);
+  REALTIME_BEGIN(self->q);
   { __chan_t *q = self->q;
     if(timeout_ms==0)
       goto_if(Fifo_Is_Empty(q->fifo),NoPeek);
     goto_if(Fifo_Is_Empty(q->fifo) && q->nwriters==0,NoPeek); // possibly avoid the resize/copy
     goto_if(CHAN_FAILURE(chan_peek__locked(q,pbuf,sz,timeout_ms)),NoPeek);
   }
+  REALTIME_END(self->q);
   Mutex_Unlock(&self->q->lock);
   // no size change so no notify
   return SUCCESS;
 NoPeek:
+  REALTIME_END(self->q);
   Mutex_Unlock(&self->q->lock);
   return FAILURE;
 }
@@ -609,6 +956,239 @@ unsigned int Chan_Peek_Timed ( Chan *self_, void **pbuf, size_t sz, unsigned tim
 }
 
 
+// ----------------------
+// Reserve/Commit
+// Acquire/Release
+// ----------------------
+//
+// Work in place on the ring's own memory.
+//
+unsigned int Chan_Reserve( Chan *self_, void **pbuf, size_t *cap )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t *q = self->q;
+  return_val_if(self->mode!=CHAN_WRITE || !pbuf,FAILURE);
+  Mutex_Lock(&q->lock);
+  REALTIME_BEGIN(q);
+  goto_if(q->reserver==self,Error);   // already holds one
+  if(q->reserver || (Fifo_Is_Full(q->fifo) && (q->expand_on_full==0 || q->acquirer)))
+  { Thread_Block_Begin();
+    while(q->reserver || (Fifo_Is_Full(q->fifo) && (q->expand_on_full==0 || q->acquirer)))
+      Condition_Wait(&q->notfull,&q->lock);
+    Thread_Block_End();
+  }
+  if(Fifo_Is_Full(q->fifo))
+    Fifo_Expand(q->fifo);
+  *pbuf = Fifo_Reserve(q->fifo);
+  if(cap)
+    *cap = Fifo_Buffer_Size_Bytes(q->fifo);
+  q->reserver = self;
+  REALTIME_END(q);
+  Mutex_Unlock(&q->lock);
+  return SUCCESS;
+Error:
+  REALTIME_END(q);
+  Mutex_Unlock(&q->lock);
+  return FAILURE;
+}
+
+unsigned int Chan_Commit( Chan *self_, size_t nbytes )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t *q = self->q;
+  Mutex_Lock(&q->lock);
+  goto_if(q->reserver!=self || nbytes>Fifo_Buffer_Size_Bytes(q->fifo),Error);
+  Fifo_Commit(q->fifo,nbytes);
+  q->reserver = NULL;
+  Condition_Notify_All(&q->notfull);  // other reservers
+  Mutex_Unlock(&q->lock);
+  Condition_Notify(&q->notempty);
+  return SUCCESS;
+Error:
+  Mutex_Unlock(&q->lock);
+  return FAILURE;
+}
+
+unsigned int Chan_Acquire( Chan *self_, void **pbuf, size_t *nbytes )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t *q = self->q;
+  return_val_if(self->mode!=CHAN_READ || !pbuf,FAILURE);
+  Mutex_Lock(&q->lock);
+  REALTIME_BEGIN(q);
+  goto_if(q->acquirer==self,Error);   // already holds one
+  if(q->acquirer || (Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q)))
+  { Thread_Block_Begin();
+    while(q->acquirer || (Fifo_Is_Empty(q->fifo) && !_pop_bypass_wait(q)))
+      Condition_Wait(&q->notempty,&q->lock);
+    Thread_Block_End();
+  }
+  goto_if(Fifo_Is_Empty(q->fifo),Error);
+  *pbuf = Fifo_Acquire(q->fifo,nbytes);
+  q->acquirer = self;
+  REALTIME_END(q);
+  Mutex_Unlock(&q->lock);
+  return SUCCESS;
+Error:
+  REALTIME_END(q);
+  Mutex_Unlock(&q->lock);
+  return FAILURE;
+}
+
+unsigned int Chan_Release( Chan *self_ )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t *q = self->q;
+  Mutex_Lock(&q->lock);
+  goto_if(q->acquirer!=self,Error);
+  Fifo_Release(q->fifo);
+  q->acquirer = NULL;
+  Condition_Notify_All(&q->notempty); // other acquirers
+  Condition_Notify_All(&q->notfull);
+  Mutex_Unlock(&q->lock);
+  return SUCCESS;
+Error:
+  Mutex_Unlock(&q->lock);
+  return FAILURE;
+}
+
+
+// --------------
+// Scatter-gather
+// --------------
+//
+// The ring holds ChanVec descriptors, which are swapped like any other
+// token.  They're made by an allocator so that freeing one frees its
+// chunks, and so descriptors start out empty.  The allocator's context is
+// the chunk size.  Descriptors are never resized, so "realloc" is the
+// identity.
+//
+// The fifo must never copy a descriptor and then free it: that frees the
+// chunks the copy refers to.  So descriptors from other channels are
+// swapped for ours by vec_adopt() before they reach the fifo.
+//
+#define VEC_BYTES(nchunks) (offsetof(ChanVec,iov)+(nchunks)*sizeof(ChanIOVec))
+
+static void *vec_alloc(size_t bytes, void *ctx)
+{ return calloc(1,bytes);
+}
+
+static void *vec_realloc(void *buf, size_t bytes, void *ctx)
+{ return buf;
+}
+
+static void vec_free(void *p, void *ctx)
+{ ChanVec *v = (ChanVec*)((char*)p+CHAN_BUFFER_HEADER_BYTES);
+  size_t i;
+  for(i=0;i<v->count;++i)
+    free(v->iov[i].base);
+  free(p);
+}
+
+Chan* Chan_Alloc_Vec( size_t buffer_count, size_t max_message_bytes, size_t chunk_bytes)
+{ ChanAllocator a = {vec_alloc,vec_realloc,vec_free,NULL};
+  size_t max_chunks;
+  chan_t *c;
+  if(!chunk_bytes) chunk_bytes = 4096;
+  a.ctx = (void*)chunk_bytes;
+  return_val_if(!max_message_bytes,NULL);
+  max_chunks = (max_message_bytes+chunk_bytes-1)/chunk_bytes;
+  return_val_if(!(c=(chan_t*)Chan_Alloc_With_Allocator(buffer_count,VEC_BYTES(max_chunks),&a)),NULL);
+  c->q->chunk_bytes = chunk_bytes;
+  c->q->max_chunks  = max_chunks;
+  c->q->max_bytes   = max_message_bytes;
+  return (Chan*)c;
+}
+
+ChanVec* Chan_Vec_Alloc( Chan *self )
+{ return_val_if(!((chan_t*)self)->q->chunk_bytes,NULL);
+  return (ChanVec*)Chan_Token_Buffer_Alloc(self);
+}
+
+unsigned int Chan_Vec_Size( Chan *self_, ChanVec *vec, size_t nbytes )
+{ chan_t *self = (chan_t*)self_;
+  __chan_t *q = self->q;
+  size_t need,i,last;
+  return_val_if(!q->chunk_bytes || !vec || nbytes>q->max_bytes,FAILURE);
+  need = (nbytes+q->chunk_bytes-1)/q->chunk_bytes;
+  Mutex_Lock(&q->lock);
+  while(vec->count<need && q->npool)  // reuse spare chunks
+    vec->iov[vec->count++].base = q->pool[--q->npool];
+  while(vec->count>need)              // give back extra ones
+  { if(q->npool==q->pool_cap)
+    { q->pool_cap = q->pool_cap?2*q->pool_cap:q->max_chunks;
+      Chan_Assert(q->pool=(void**)realloc(q->pool,q->pool_cap*sizeof(void*)));
+    }
+    q->pool[q->npool++] = vec->iov[--vec->count].base;
+  }
+  Mutex_Unlock(&q->lock);
+  while(vec->count<need)              // the pool ran dry
+  { void *chunk;
+    goto_if_not(chunk=Numa_Alloc(q->chunk_bytes,NUMA_POLICY_DEFAULT,-1),Error);
+    vec->iov[vec->count++].base = chunk;
+  }
+  for(i=0;i<vec->count;++i)
+    vec->iov[i].len = q->chunk_bytes;
+  last = nbytes-(need?need-1:0)*q->chunk_bytes;
+  if(need)
+    vec->iov[need-1].len = last;
+  vec->nbytes = nbytes;
+  return SUCCESS;
+Error:
+  for(i=0;i<vec->count;++i)           // lengths stay consistent
+    vec->iov[i].len = q->chunk_bytes;
+  vec->nbytes = vec->count*q->chunk_bytes;
+  return FAILURE;
+}
+
+/* Replaces a descriptor from another channel with one of ours.  Chunks
+   of our size move to the new descriptor; otherwise the message is
+   copied into our chunks. */
+static unsigned int vec_adopt( Chan *self_, ChanVec **pvec )
+{ __chan_t *q = ((chan_t*)self_)->q;
+  const FifoAllocator *a;
+  ChanVec *old = *pvec,*v;
+  size_t i,j,off;
+  return_val_if(!old,SUCCESS);
+  a = Fifo_Get_Buffer_Allocator(old);
+  return_val_if(a==Fifo_Get_Allocator(q->fifo),SUCCESS); // ours
+  return_val_if(!a || a->alloc!=vec_alloc || old->nbytes>q->max_bytes,FAILURE);
+  v = Chan_Vec_Alloc(self_);
+  if((size_t)a->ctx==q->chunk_bytes && old->count<=q->max_chunks)
+  { memcpy(v->iov,old->iov,old->count*sizeof(ChanIOVec));
+    v->count   = old->count;
+    v->nbytes  = old->nbytes;
+    old->count = 0;                   // the chunks are v's now
+  } else
+  { goto_if(CHAN_FAILURE(Chan_Vec_Size(self_,v,old->nbytes)),Error);
+    for(i=j=off=0;i<v->count;++i)     // gather old's chunks into v's
+    { size_t k=0;
+      while(k<v->iov[i].len && j<old->count)
+      { size_t n = v->iov[i].len-k;
+        if(n>old->iov[j].len-off)
+          n = old->iov[j].len-off;
+        memcpy((char*)v->iov[i].base+k,(char*)old->iov[j].base+off,n);
+        k+=n;
+        if((off+=n)==old->iov[j].len)
+        { ++j;
+          off=0;
+        }
+      }
+    }
+  }
+  Chan_Token_Buffer_Free(old);
+  *pvec = v;
+  return SUCCESS;
+Error:
+  Chan_Token_Buffer_Free(v);
+  return FAILURE;
+}
+
+unsigned int Chan_Next_Vec( Chan *self_, ChanVec **pvec )
+{ chan_t *self = (chan_t*)self_;
+  return_val_if(!self->q->chunk_bytes || !pvec,FAILURE);
+  return_val_if(CHAN_FAILURE(vec_adopt(self_,pvec)),FAILURE);
+  return_val_if(*pvec && (*pvec)->count>self->q->max_chunks,FAILURE);
+  return Chan_Next(self_,(void**)pvec,Fifo_Buffer_Size_Bytes(self->q->fifo));
+}
+
+
 // -----------------
 // Memory management
 // -----------------
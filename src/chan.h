@@ -20,7 +20,48 @@ typedef enum _chan_mode
   CHAN_MODE_MAX,
 } ChanMode;
 
+/** Where Chan_Alloc_Numa() puts a channel's buffers on NUMA machines. */
+typedef enum _chan_numa
+{ CHAN_NUMA_DEFAULT=0,     ///< first touch, usually the allocating thread's node
+  CHAN_NUMA_FIRST_READER,  ///< moved to the node of the first thread to open the channel for reading
+  CHAN_NUMA_BIND,          ///< on the given node
+  CHAN_NUMA_INTERLEAVE,    ///< spread over every node
+} ChanNuma;
+
+#define CHAN_BUFFER_HEADER_BYTES 64 ///< Bookkeeping in front of each buffer from a \ref ChanAllocator.
+
+/** Hooks used for every buffer of a channel made with
+    Chan_Alloc_With_Allocator().  See \ref allocators.
+*/
+typedef struct _chan_allocator
+{ void *(*alloc)  (size_t bytes, void *ctx);            ///< Returns NULL on failure.
+  void *(*realloc)(void *buf, size_t bytes, void *ctx); ///< Optional.  If NULL, buffers grow by alloc, copy and free.
+  void  (*free)   (void *buf, void *ctx);
+  void   *ctx;                                          ///< Passed to the hooks.  Must outlive the channel's buffers.
+} ChanAllocator;
+
+/** One chunk of a scatter-gather message.  Laid out like POSIX
+    <tt>struct iovec</tt>, so a ChanVec's \c iov can be passed to
+    writev() or pwritev() as is.
+*/
+typedef struct _chan_iovec
+{ void  *base;
+  size_t len;
+} ChanIOVec;
+
+/** A scatter-gather message: the token for Chan_Next_Vec(). */
+typedef struct _chan_vec
+{ size_t    count;   ///< Chunks in \c iov.
+  size_t    nbytes;  ///< Message size: the sum of the chunk lengths.
+  ChanIOVec iov[1];  ///< Really as long as the channel's chunk limit.
+} ChanVec;
+
        Chan  *Chan_Alloc      ( size_t buffer_count, size_t buffer_size_bytes);
+       Chan  *Chan_Alloc_Inline( size_t buffer_count, size_t buffer_size_bytes); ///< Copies messages of up to \c FIFO_INLINE_MAX_BYTES in and out of the queue instead of swapping.  Bigger ones get a Chan_Alloc() channel.  See \ref mem.
+       Chan  *Chan_Alloc_Vec  ( size_t buffer_count, size_t max_message_bytes, size_t chunk_bytes); ///< Scatter-gather messages.  \a chunk_bytes of 0 means 4096.  See \ref vec.
+       Chan  *Chan_Alloc_With_Allocator( size_t buffer_count, size_t buffer_size_bytes, const ChanAllocator *allocator); ///< Returns NULL if \a allocator is missing a hook.
+       Chan  *Chan_Alloc_Numa ( size_t buffer_count, size_t buffer_size_bytes, ChanNuma placement, int node); ///< \a node is used with \ref CHAN_NUMA_BIND.  See \ref numa.
+       Chan  *Chan_Alloc_Realtime( size_t buffer_count, size_t buffer_size_bytes, unsigned max_handles, int lock_memory); ///< Never allocates after this call.  \a max_handles counts every handle open at once, including the one returned.  See \ref realtime.
 extern Chan  *Chan_Alloc_Copy ( Chan *chan);
        Chan  *Chan_Open       ( Chan *self, ChanMode mode);             ///< does ref counting and access type
        int    Chan_Close      ( Chan *self);                            ///< does ref counting
@@ -45,6 +86,15 @@ unsigned int Chan_Peek_Try   ( Chan *self, void **pbuf, size_t sz);
 unsigned int Chan_Peek_Timed ( Chan *self, void **pbuf, size_t sz, unsigned timeout_ms);
 
 
+unsigned int Chan_Reserve     ( Chan *writer, void **pbuf, size_t *cap);    ///< Get the next slot to fill, in place.  May block.  See \ref inplace.
+unsigned int Chan_Commit      ( Chan *writer, size_t nbytes);               ///< Enqueue the reserved slot.  \a nbytes must fit the slot.
+unsigned int Chan_Acquire     ( Chan *reader, void **pbuf, size_t *nbytes); ///< Get the next message, in place, and its length: what was committed, or the size it was pushed with.  May block.
+unsigned int Chan_Release     ( Chan *reader);                              ///< Dequeue the acquired message.
+
+ChanVec*     Chan_Vec_Alloc   ( Chan *self);                                ///< An empty message token.  Release with Chan_Token_Buffer_Free(), which frees its chunks.
+unsigned int Chan_Vec_Size    ( Chan *self, ChanVec *vec, size_t nbytes);   ///< Gives \a vec enough chunks for \a nbytes, reusing spare chunks.  Fails past the channel's limit.
+unsigned int Chan_Next_Vec    ( Chan *self, ChanVec **pvec);                ///< Push or pop a scatter-gather message.  May block the calling thread.
+
 int         Chan_Is_Full                    ( Chan *self);
 int         Chan_Is_Empty                   ( Chan *self);
 extern void Chan_Resize                     ( Chan *self, size_t nbytes);
@@ -2,9 +2,16 @@
 #pragma clang diagnostic ignored "-Wunused-value"
 
 #include "fifo.h"
+#include "numaplace.h"
+#include "thread.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 //////////////////////////////////////////////////////////////////////
 //  Logging    ///////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
@@ -26,6 +33,41 @@ void fifo_breakme() {}
 #define DEBUG_RING_FIFO_WARN_RESIZE_ON_PEEK
 #endif
 
+// real-time check: fail loudly if anything allocates between
+// Fifo_No_Alloc_Begin() and Fifo_No_Alloc_End()
+#ifndef NDEBUG
+#define DEBUG_RING_FIFO_REALTIME
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#ifdef DEBUG_RING_FIFO_REALTIME
+static THREAD_LOCAL int _no_alloc = 0;
+#define CHECK_NO_ALLOC(msg) \
+  if(_no_alloc) \
+    fifo_error("Allocation on a real-time path.\n%s\n",msg)
+#else
+#define CHECK_NO_ALLOC(msg)
+#endif
+
+void Fifo_No_Alloc_Begin(void)
+{
+#ifdef DEBUG_RING_FIFO_REALTIME
+  ++_no_alloc;
+#endif
+}
+
+void Fifo_No_Alloc_End(void)
+{
+#ifdef DEBUG_RING_FIFO_REALTIME
+  --_no_alloc;
+#endif
+}
+
 // debug
 #if 0
 #define DEBUG_RING_FIFO
@@ -50,13 +92,17 @@ void fifo_breakme() {}
 #define MOD_UNSIGNED_POW2(n,d)   ( (n) & ((d)-1) )
 
 void *Fifo_Malloc( size_t nelem, const char *msg )
-{ void *item = malloc( nelem );
+{ void *item;
+  CHECK_NO_ALLOC(msg);
+  item = malloc( nelem );
   if( !item )
     fifo_error("Could not allocate memory.\n%s\n",msg);
   return item;
 }
 void *Fifo_Calloc( size_t nelem, size_t bytes_per_elem, const char *msg )
-{ void *item = calloc( nelem, bytes_per_elem );
+{ void *item;
+  CHECK_NO_ALLOC(msg);
+  item = calloc( nelem, bytes_per_elem );
   if( !item )
     fifo_error("Could not allocate memory.\n%s\n",msg);
   return item;
@@ -64,6 +110,7 @@ void *Fifo_Calloc( size_t nelem, size_t bytes_per_elem, const char *msg )
 void Fifo_Realloc( void **item, size_t nelem, const char *msg )
 { void *it = *item;
   Fifo_Assert(item);
+  CHECK_NO_ALLOC(msg);
   if( !it )
     it = malloc( nelem );
   else
@@ -185,10 +232,289 @@ typedef struct _ring_fifo
   size_t        tail; // read  cursor
 
   size_t        buffer_size_bytes;
+
+  struct _owner *owner; // allocator or placement of buffers, or NULL
+  int           realtime;    // never allocate after Alloc_Realtime
+  int           lock_memory; // mlock buffers (real-time only)
+
+  char         *slots;  // inline messages, or NULL to use <ring>
+  size_t        stride; // bytes per slot, a power of 2
+  size_t        nslots; // a power of 2
+
+  size_t       *lens;   // bytes in the message at each position, indexed like the ring
 } Fifo_;
 
-Fifo*
-Fifo_Alloc(size_t buffer_count, size_t buffer_size_bytes )
+#define INLINE(self) ((self)->slots!=NULL)
+
+//////////////////////////////////////////////////////////////////////
+//  Owners     ///////////////////////////////////////////////////////
+//
+//  An owner is either a FifoAllocator or a NUMA placement, which is an
+//  allocator too, over Numa_Alloc().
+//
+//  Buffers from an owner start FIFO_BUFFER_HEADER_BYTES into
+//  their allocation.  The header ends with the buffer's owner, so
+//  Fifo_Free_Token_Buffer() can route a buffer back without a fifo, and
+//  a fifo tells its own buffers from foreign ones with a compare.  A tag,
+//  the buffer's address scrambled, tells these buffers from malloc'd
+//  ones.  The words in front of a malloc'd block are malloc's own
+//  bookkeeping, so reading them is safe, and they won't hold the tag.
+//
+//  Owners are reference counted by the fifo and by each of their
+//  buffers, so buffers may outlive the fifo that made them.
+//////////////////////////////////////////////////////////////////////
+typedef struct _owner
+{ FifoAllocator a;
+  NumaPolicy    policy; // for placements
+  int           node;
+  volatile long refs;
+} owner_t;
+
+typedef struct _buf_header
+{ owner_t *owner;
+  size_t   tag;
+} buf_header_t;
+
+#define HEADER(buf)  ((buf_header_t*)(buf)-1)
+#define BUF_TAG(buf) ((size_t)(buf)^(size_t)0x9E3779B97F4A7C15ULL)
+
+/* Owner of <buf>, or NULL for malloc'd (or placed) buffers. */
+static owner_t *owner_of(void *buf)
+{ return (buf && HEADER(buf)->tag==BUF_TAG(buf))?HEADER(buf)->owner:NULL;
+}
+
+/* The buffer in allocation <p> from <o>.  Takes a reference to <o>. */
+static void *own(void *p, owner_t *o)
+{ char *buf = (char*)p+FIFO_BUFFER_HEADER_BYTES;
+  InterlockedIncrement(&o->refs);
+  HEADER(buf)->owner = o;
+  HEADER(buf)->tag   = BUF_TAG(buf);
+  return buf;
+}
+
+/* The allocation behind <buf>.  The tag is cleared, so the memory isn't
+   taken for a buffer once it's reused.  The owner keeps the buffer's
+   reference. */
+static void *disown(void *buf)
+{ HEADER(buf)->tag = 0;
+  return (char*)buf-FIFO_BUFFER_HEADER_BYTES;
+}
+
+static void owner_release(owner_t *o)
+{ if(InterlockedDecrement(&o->refs)==0)
+    free(o);
+}
+
+static void *placed_alloc(size_t bytes, void *ctx)
+{ owner_t *o = (owner_t*)ctx;
+  return Numa_Alloc(bytes,o->policy,o->node);
+}
+
+static void placed_free(void *p, void *ctx)
+{ free(p);
+}
+
+#define PLACES(o) ((o)->a.alloc==placed_alloc)
+
+/* An owner for <allocator>, or, if that's NULL, for buffers placed by
+   <policy>.  The caller holds the one reference. */
+static owner_t *owner_alloc(const FifoAllocator *allocator, NumaPolicy policy, int node)
+{ owner_t *o = (owner_t*)Fifo_Malloc( sizeof(owner_t), "owner_alloc" );
+  if(allocator)
+    o->a = *allocator;
+  else
+  { o->a.alloc   = placed_alloc;
+    o->a.realloc = NULL;         // placing anew means a new allocation
+    o->a.free    = placed_free;
+    o->a.ctx     = o;
+  }
+  o->policy = policy;
+  o->node   = node;
+  o->refs   = 1;
+  return o;
+}
+
+/* Buffers from <o> can stand in for <mine>'s: same owner, or the same
+   placement. */
+static int owner_suits(owner_t *o, owner_t *mine)
+{ return o==mine
+      || (o && PLACES(o) && PLACES(mine) && o->policy==mine->policy && o->node==mine->node);
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Buffers    ///////////////////////////////////////////////////////
+//
+//  Every buffer the fifo hands out or takes in goes through these, so
+//  placed fifos keep all of their buffers on the right node and fifos
+//  with an allocator keep all of theirs in it.  Foreign buffers swapped
+//  in by callers are recognized by their owner and replaced.  Owned
+//  buffers go back through buf_free().
+//////////////////////////////////////////////////////////////////////
+
+static void buf_free(void *buf)
+{ owner_t *o;
+  if(!buf) return;
+  if(o=owner_of(buf))
+  { o->a.free(disown(buf),o->a.ctx);
+    owner_release(o);
+  } else
+    free(buf);
+}
+
+static void *buf_alloc(Fifo_ *self, size_t bytes, const char *msg)
+{ void *p;
+  CHECK_NO_ALLOC(msg);
+  if(self->owner)
+  { if(!(p=self->owner->a.alloc(bytes+FIFO_BUFFER_HEADER_BYTES,self->owner->a.ctx)))
+      fifo_error("Could not allocate memory from allocator.\n%s\n",msg);
+    return own(p,self->owner);
+  }
+  return Fifo_Malloc(bytes,msg);
+}
+
+/* Grows *pbuf to <bytes>, keeping the first <keep> bytes. */
+static void buf_realloc(Fifo_ *self, void **pbuf, size_t keep, size_t bytes, const char *msg)
+{ void *p;
+  owner_t *o;
+  CHECK_NO_ALLOC(msg);
+  o = owner_of(*pbuf);
+  if(o && o==self->owner && o->a.realloc)
+  { if(!(p=o->a.realloc(disown(*pbuf),bytes+FIFO_BUFFER_HEADER_BYTES,o->a.ctx)))
+      fifo_error("Could not reallocate memory from allocator.\n%s\n",msg);
+    *pbuf = own(p,o);
+    owner_release(o);                   // own() took a second reference
+    return;
+  }
+  if(!o && !self->owner)
+  { Fifo_Realloc(pbuf,bytes,msg);
+    return;
+  }
+  p = buf_alloc(self,bytes,msg);
+  if(*pbuf)
+  { memcpy(p,*pbuf,keep<bytes?keep:bytes);
+    buf_free(*pbuf);
+  }
+  *pbuf = p;
+}
+
+/* Polices a buffer about to be swapped on to the ring: undersized or
+   (for placed fifos and fifos with an allocator) foreign buffers are
+   replaced. */
+static void buf_police(Fifo_ *self, void **pbuf, size_t sz, size_t keep)
+{ if(sz<self->buffer_size_bytes)                  //small arg - resize to larger before swap
+    buf_realloc(self,pbuf,keep,self->buffer_size_bytes,"police"); //null arg - also handled by this mechanism
+  else if(self->owner && !owner_suits(owner_of(*pbuf),self->owner))
+    buf_realloc(self,pbuf,keep,sz,"police owner");
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Inline slots  ////////////////////////////////////////////////////
+//
+//  Small messages are copied in and out of one contiguous, page-aligned
+//  array instead of being swapped.  The stride is a power of two so no
+//  slot straddles a cache line.  Slots keep their index modulo the
+//  capacity, just like ring buffers, so converting to a ring when a
+//  resize outgrows FIFO_INLINE_MAX_BYTES keeps messages in place.
+//////////////////////////////////////////////////////////////////////
+static char *slots_alloc(size_t bytes, const char *msg)
+{ void *p;
+  CHECK_NO_ALLOC(msg);
+  if(!(p=Numa_Alloc(bytes,NUMA_POLICY_DEFAULT,-1)))
+    fifo_error("Could not allocate memory.\n%s\n",msg);
+  return (char*)p;
+}
+
+static inline char *_slot(Fifo_ *self, size_t idx)
+{ return self->slots + MOD_UNSIGNED_POW2(idx,self->nslots)*self->stride;
+}
+
+static inline void _set_len(Fifo_ *self, size_t idx, size_t nbytes)
+{ self->lens[MOD_UNSIGNED_POW2(idx,Fifo_Buffer_Count(self))] = nbytes;
+}
+
+/* Data for queue position <idx> in either mode. */
+static inline void *_at(Fifo_ *self, size_t idx)
+{ if(INLINE(self))
+    return _slot(self,idx);
+  return self->ring->contents[MOD_UNSIGNED_POW2(idx,self->ring->nelem)];
+}
+
+static void inline_restride(Fifo_ *self, size_t stride)
+{ char *s = slots_alloc(self->nslots*stride,"Fifo_Resize: inline");
+  size_t i;
+  for(i=0;i<self->nslots;++i)
+    memcpy(s+i*stride,self->slots+i*self->stride,self->stride);
+  free(self->slots);
+  self->slots  = s;
+  self->stride = stride;
+}
+
+static void inline_to_ring(Fifo_ *self, size_t bytes)
+{ vector_PVOID *r = vector_PVOID_alloc(self->nslots);
+  size_t i;
+  for(i=0;i<r->nelem;++i)
+  { r->contents[i] = buf_alloc(self,bytes,"Fifo_Resize: leaving inline");
+    memcpy(r->contents[i],self->slots+i*self->stride,self->buffer_size_bytes);
+  }
+  free(self->slots);
+  self->slots = NULL;
+  self->ring  = r;
+}
+
+/* Copies a message into the head slot.  A NULL token gets a buffer, as
+   it would from a swap. */
+static void inline_put(Fifo_ *self, void **pbuf, size_t sz)
+{ if(!*pbuf)
+    *pbuf = buf_alloc(self,self->buffer_size_bytes,"push: null token");
+  if(sz>self->buffer_size_bytes)
+    sz = self->buffer_size_bytes;
+  _set_len(self,self->head,sz);
+  memcpy(_slot(self,self->head++),*pbuf,sz);
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Real-time buffers  ///////////////////////////////////////////////
+//
+//  Whole pages, so locking one buffer never pins or unpins another's.
+//  The mapped length sits in a header in front of the buffer, where
+//  rt_free() can find it to unlock.
+//////////////////////////////////////////////////////////////////////
+#define RT_HEADER 64 // keeps buffers cache-line aligned
+
+static void *rt_alloc(size_t bytes, void *ctx)
+{ size_t page = 4096,
+         n    = (bytes+RT_HEADER+page-1)/page*page;
+  char *p;
+  if(!(p=(char*)Numa_Alloc(n,NUMA_POLICY_DEFAULT,-1)))
+    return NULL;
+  *(size_t*)p = n;
+  return p+RT_HEADER;
+}
+
+static void rt_free(void *buf, void *ctx)
+{ char *p = (char*)buf-RT_HEADER;
+#ifdef _WIN32
+  VirtualUnlock(p,*(size_t*)p);
+#else
+  munlock(p,*(size_t*)p);
+#endif
+  free(p);
+}
+
+/* Locks a buffer of a real-time fifo.  Returns 0 on success. */
+static int rt_lock(void *buf)
+{ char *p = (char*)buf-FIFO_BUFFER_HEADER_BYTES-RT_HEADER;
+#ifdef _WIN32
+  return !VirtualLock(p,*(size_t*)p);
+#else
+  return mlock(p,*(size_t*)p);
+#endif
+}
+
+static const FifoAllocator _realtime_allocator = {rt_alloc,NULL,rt_free,NULL};
+
+static Fifo*
+fifo_alloc(size_t buffer_count, size_t buffer_size_bytes, NumaPolicy policy, int node, const FifoAllocator *allocator )
 { Fifo_ *self;
   
   Fifo_Assert( IS_POW2( buffer_count ) );
@@ -198,13 +524,22 @@ Fifo_Alloc(size_t buffer_count, size_t buffer_size_bytes )
   self->head = 0;
   self->tail = 0;
   self->buffer_size_bytes = buffer_size_bytes;
+  self->owner  = NULL;
+  self->realtime    = 0;
+  self->lock_memory = 0;
+  self->slots  = NULL;
+  self->stride = 0;
+  self->nslots = 0;
+  if(allocator || policy!=NUMA_POLICY_DEFAULT)
+    self->owner = owner_alloc(allocator,policy,node); // the fifo's reference
 
   self->ring = vector_PVOID_alloc( buffer_count );
+  self->lens = (size_t*)Fifo_Calloc( buffer_count, sizeof(size_t), "Fifo_Alloc: lengths" );
   { vector_PVOID *r = self->ring;
     PVOID *cur = r->contents + r->nelem,
           *beg = r->contents;
     while( cur-- > beg )
-      *cur = Fifo_Malloc( buffer_size_bytes, "Fifo_Alloc: Allocating buffers" );
+      *cur = buf_alloc( self, buffer_size_bytes, "Fifo_Alloc: Allocating buffers" );
   }
 
 #ifdef DEBUG_RINGFIFO_ALLOC
@@ -214,6 +549,54 @@ Fifo_Alloc(size_t buffer_count, size_t buffer_size_bytes )
   return self;
 }
 
+Fifo*
+Fifo_Alloc(size_t buffer_count, size_t buffer_size_bytes )
+{ return fifo_alloc(buffer_count,buffer_size_bytes,NUMA_POLICY_DEFAULT,-1,NULL);
+}
+
+Fifo*
+Fifo_Alloc_Placed(size_t buffer_count, size_t buffer_size_bytes, NumaPolicy policy, int node )
+{ return fifo_alloc(buffer_count,buffer_size_bytes,policy,node,NULL);
+}
+
+Fifo*
+Fifo_Alloc_With_Allocator(size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator )
+{ return_val_if(!allocator || !allocator->alloc || !allocator->free,NULL);
+  return fifo_alloc(buffer_count,buffer_size_bytes,NUMA_POLICY_DEFAULT,-1,allocator);
+}
+
+Fifo*
+Fifo_Alloc_Inline(size_t buffer_count, size_t buffer_size_bytes )
+{ Fifo_ *self;
+  return_val_if(!IS_POW2(buffer_count),NULL);
+  return_val_if(buffer_size_bytes>FIFO_INLINE_MAX_BYTES,NULL);
+  self = (Fifo_*)Fifo_Calloc( 1, sizeof(Fifo_), "Fifo_Alloc_Inline" );
+  self->buffer_size_bytes = buffer_size_bytes;
+  self->stride = _next_pow2_size_t(buffer_size_bytes?buffer_size_bytes:1);
+  self->nslots = buffer_count;
+  self->slots  = slots_alloc(self->nslots*self->stride,"Fifo_Alloc_Inline");
+  self->lens   = (size_t*)Fifo_Calloc(buffer_count,sizeof(size_t),"Fifo_Alloc_Inline: lengths");
+  return self;
+}
+
+Fifo*
+Fifo_Alloc_Realtime(size_t buffer_count, size_t buffer_size_bytes, int lock_memory )
+{ Fifo_ *self;
+  size_t i;
+  return_val_if(!buffer_size_bytes,NULL);
+  return_val_if(!(self=(Fifo_*)fifo_alloc(buffer_count,buffer_size_bytes,NUMA_POLICY_DEFAULT,-1,&_realtime_allocator)),NULL);
+  self->realtime    = 1;
+  self->lock_memory = lock_memory;
+  if(lock_memory)
+    for(i=0;i<self->ring->nelem;++i)
+      if(rt_lock(self->ring->contents[i]))
+      { fifo_warning("Could not lock fifo buffers in memory.\r\n");
+        Fifo_Free(self);
+        return NULL;
+      }
+  return self;
+}
+
 void 
 Fifo_Free( Fifo *self_ )
 { Fifo_ *self = (Fifo_*)self_;
@@ -223,25 +606,68 @@ Fifo_Free( Fifo *self_ )
     PVOID *cur = r->contents + r->nelem,
           *beg = r->contents;
     while( cur-- > beg )
-      free(*cur);
+      buf_free(*cur);
     vector_PVOID_free( r );
     self->ring = NULL;    
   }
+  free(self->slots);
+  free(self->lens);
+  if(self->owner)
+    owner_release(self->owner);
   free(self);	
 }
 
-void 
-Fifo_Expand( Fifo *self_ ) 
+void
+Fifo_Set_Placement( Fifo *self_, NumaPolicy policy, int node )
 { Fifo_ *self = (Fifo_*)self_;
   vector_PVOID *r = self->ring;
-  size_t old  = r->nelem,   // size of ring buffer _before_ realloc
-         n,                 // delta in size (number of added elements)
-         head = MOD_UNSIGNED_POW2( self->head, old ),
-         tail = MOD_UNSIGNED_POW2( self->tail, old ),
-         buffer_size_bytes = self->buffer_size_bytes;
+  owner_t *old = self->owner;
+  size_t i;
+  return_if_fail((!old || PLACES(old)) && !INLINE(self));
+  self->owner = (policy!=NUMA_POLICY_DEFAULT)?owner_alloc(NULL,policy,node):NULL;
+  for(i=0;i<r->nelem;++i) // move by copying, so contents keep their place
+    buf_realloc(self,r->contents+i,self->buffer_size_bytes,self->buffer_size_bytes,"Fifo_Set_Placement");
+  if(old)
+    owner_release(old);
+}
+
+static void
+inline_expand( Fifo_ *self )
+{ size_t n   = self->head-self->tail,
+         cap = 2*self->nslots,
+         i;
+  char *s = slots_alloc(cap*self->stride,"Fifo_Expand: inline");
+  for(i=0;i<n;++i) // queued messages move to the front, in order
+    memcpy(s+i*self->stride,_slot(self,self->tail+i),self->stride);
+  free(self->slots);
+  self->slots  = s;
+  self->nslots = cap;
+  self->tail   = 0;
+  self->head   = n;
+}
+
+/* Moves the lengths of queued messages to where Expand put them. */
+static void
+lens_expand( Fifo_ *self, size_t *old, size_t oldcap, size_t oldtail )
+{ size_t i,n = self->head-self->tail;
+  self->lens = (size_t*)Fifo_Calloc(Fifo_Buffer_Count(self),sizeof(size_t),"Fifo_Expand: lengths");
+  for(i=0;i<n;++i)
+    _set_len(self,self->tail+i,old[MOD_UNSIGNED_POW2(oldtail+i,oldcap)]);
+  free(old);
+}
+
+static void
+ring_expand( Fifo_ *self )
+{ vector_PVOID *r;
+  size_t old,n,head,tail,buffer_size_bytes;
+  r    = self->ring;
+  old  = r->nelem;                                // size of ring buffer _before_ realloc
+  head = MOD_UNSIGNED_POW2( self->head, old );
+  tail = MOD_UNSIGNED_POW2( self->tail, old );
+  buffer_size_bytes = self->buffer_size_bytes;
 
   vector_PVOID_request_pow2( r, old/*+1*/ ); // size to next pow2  
-  n = r->nelem - old; // the number of slots added
+  n = r->nelem - old; // delta in size: the number of slots added
     
   { PVOID *buf = r->contents,
           *beg = buf,     // (will be) beginning of interval requiring new malloced data
@@ -269,26 +695,52 @@ Fifo_Expand( Fifo *self_ )
       cur += old;
     }
     while( cur-- > beg )
-      *cur = Fifo_Malloc( buffer_size_bytes, 
-                             "Fifo_Expand: Allocating new buffers" );
+      *cur = buf_alloc( self, buffer_size_bytes, 
+                        "Fifo_Expand: Allocating new buffers" );
   }
 }
 
+void 
+Fifo_Expand( Fifo *self_ ) 
+{ Fifo_ *self = (Fifo_*)self_;
+  size_t *lens,cap,tail;
+  CHECK_NO_ALLOC("Fifo_Expand");
+  return_if_fail(!self->realtime);
+  lens = self->lens;
+  cap  = Fifo_Buffer_Count(self);
+  tail = self->tail;
+  if(INLINE(self))
+    inline_expand(self);
+  else
+    ring_expand(self);
+  lens_expand(self,lens,cap,tail);
+}
+
 void
 Fifo_Resize(Fifo* self_, size_t buffer_size_bytes)
 { Fifo_ *self = (Fifo_*)self_;
-  vector_PVOID *r = self->ring;
-  size_t i,n = r->nelem;
+  vector_PVOID *r;
+  size_t i,n;
+  if(INLINE(self))
+  { if(buffer_size_bytes>FIFO_INLINE_MAX_BYTES)
+      inline_to_ring(self,buffer_size_bytes);
+    else if(buffer_size_bytes>self->stride)
+      inline_restride(self,_next_pow2_size_t(buffer_size_bytes));
+    self->buffer_size_bytes = buffer_size_bytes;
+    return;
+  }
+  r = self->ring;
+  n = r->nelem;
+  if(self->realtime)
+  { if(buffer_size_bytes!=self->buffer_size_bytes)
+      fifo_warning("Fifo_Resize: ignored for a real-time fifo. (%zu != %zu)\r\n",buffer_size_bytes,self->buffer_size_bytes);
+    return;
+  }
   if (self->buffer_size_bytes < buffer_size_bytes)
   {
     // Resize the buffers    
     for(i=0;i<n;++i)
-    { size_t idx;
-      void *t;
-      idx = MOD_UNSIGNED_POW2(i,n);
-      Fifo_Assert(t = realloc(r->contents[idx], buffer_size_bytes));
-      r->contents[idx] = t;
-    }
+      buf_realloc(self,r->contents+i,self->buffer_size_bytes,buffer_size_bytes,"Fifo_Resize");
   }
   self->buffer_size_bytes = buffer_size_bytes;
 }
@@ -311,9 +763,17 @@ Fifo_Pop( Fifo *self_, void **pbuf, size_t sz)
 { Fifo_ *self = (Fifo_*)self_;
   fifo_debug("- head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   return_val_if( Fifo_Is_Empty(self), 1);
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-    Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
-  _swap( self, pbuf, self->tail++ );                        //big   arg - ignored
+  if(INLINE(self))                                          //copy out
+  { if( !*pbuf || sz<self->buffer_size_bytes )
+      buf_realloc(self,pbuf,0,self->buffer_size_bytes,"pop");
+    memcpy(*pbuf,_slot(self,self->tail++),self->buffer_size_bytes);
+    return 0;
+  }
+  if(self->realtime)                                        //small or null arg - rejected
+  { return_val_if( !*pbuf || sz<self->buffer_size_bytes, 2);
+  } else
+    buf_police( self, pbuf, sz, 0 );                        //big   arg - ignored
+  _swap( self, pbuf, self->tail++ );
   return 0;
 }
 
@@ -322,16 +782,13 @@ Fifo_Peek( Fifo *self_, void **pbuf, size_t sz)
 { Fifo_ *self = (Fifo_*)self_;
   fifo_debug("o head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   return_val_if( Fifo_Is_Empty(self), 1);
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  return_val_if( self->realtime && (!*pbuf || sz<self->buffer_size_bytes), 2);
+  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before copy
+  { buf_realloc(self,pbuf,0,self->buffer_size_bytes,"peek"); //null  arg -         - also handled by this mechanism
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PEEK;
   }
   
-  { vector_PVOID *r = self->ring;
-    memcpy( *pbuf, 
-            r->contents[MOD_UNSIGNED_POW2(self->tail, r->nelem)],
-            self->buffer_size_bytes );
-  }
+  memcpy( *pbuf, _at(self,self->tail), self->buffer_size_bytes );
   return 0;
 }
 
@@ -340,16 +797,13 @@ Fifo_Peek_At( Fifo *self_, void **pbuf, size_t sz, size_t index)
 { Fifo_ *self = (Fifo_*)self_;
   fifo_debug("o head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
   return_val_if( Fifo_Is_Empty(self), 1);  
-  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
+  return_val_if( self->realtime && (!*pbuf || sz<self->buffer_size_bytes), 2);
+  if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before copy
+  { buf_realloc(self,pbuf,0,self->buffer_size_bytes,"peek"); //null  arg -         - also handled by this mechanism
     DEBUG_RING_FIFO_WARN_RESIZE_ON_PEEK;
   }
     
-  { vector_PVOID *r = self->ring;
-    memcpy( *pbuf, 
-            r->contents[MOD_UNSIGNED_POW2(self->tail + index, r->nelem)],
-            self->buffer_size_bytes );
-  }
+  memcpy( *pbuf, _at(self,self->tail+index), self->buffer_size_bytes );
   return 0;
 }
 
@@ -359,14 +813,27 @@ Fifo_Push_Try( Fifo *self_, void **pbuf, size_t sz)
   Fifo_ *self = (Fifo_*)self_;
   if( Fifo_Is_Full(self) )
     return 1;
+  if( INLINE(self) && sz>self->buffer_size_bytes )          //big   arg - may leave inline mode
+    Fifo_Resize(self,sz);
+  if( INLINE(self) )                                        //copy in
+  { inline_put(self,pbuf,sz);
+    return 0;
+  }
+  if( self->realtime )                                      //size mismatch - rejected
+  { return_val_if( !*pbuf || sz!=self->buffer_size_bytes, 2);
+    _set_len( self, self->head, sz );
+    _swap( self, pbuf, self->head++ );
+    return 0;
+  }
       
   if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
-    DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //big   arg - police  - resize queue storage.
-  }
+  { DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //null  arg -         - also handled by this mechanism
+  }                                                         //big   arg - police  - resize queue storage.
+  buf_police( self, pbuf, sz, sz );
   if(sz>self->buffer_size_bytes)                            
     Fifo_Resize(self,sz);
     
+  _set_len( self, self->head, sz );
   _swap( self, pbuf, self->head++ );
   return 0;
 }
@@ -376,14 +843,33 @@ Fifo_Push( Fifo *self_, void **pbuf, size_t sz, int expand_on_full)
 { Fifo_ *self = (Fifo_*)self_;
   fifo_debug("+ head: %-5d tail: %-5d size: %-5d\r\n",self->head, self->tail, self->head - self->tail);
 
-  return_val_if( 0==Fifo_Push_Try(self, pbuf, sz), 0 );
+  { unsigned int ecode = Fifo_Push_Try(self, pbuf, sz);
+    return_val_if( ecode!=1, ecode );                       //pushed or rejected
+  }
+  return_val_if( self->realtime && expand_on_full, 2);     //no expanding
+  if( self->realtime )                                      //overwrite
+  { return_val_if( !*pbuf || sz!=self->buffer_size_bytes, 2); //size mismatch - rejected
+    self->tail++;
+    _set_len( self, self->head, sz );
+    _swap( self, pbuf, self->head++ );
+    return 1;
+  }
   
   // Handle when full      
+
+  if( INLINE(self) && sz>self->buffer_size_bytes )
+    Fifo_Resize(self,sz);
+  if( INLINE(self) )
+  { if( expand_on_full ) Fifo_Expand(self);
+    else                 self->tail++;
+    inline_put(self,pbuf,sz);
+    return !expand_on_full;
+  }
     
   if( sz<self->buffer_size_bytes )                          //small arg - police  - resize to larger before swap
-  { Fifo_Assert(*pbuf = realloc(*pbuf,self->buffer_size_bytes)); //null  arg -         - also handled by this mechanism
-    DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //big   arg - police  - resize queue storage.
-  }
+  { DEBUG_RING_FIFO_WARN_RESIZE_ON_PUSH;                    //null  arg -         - also handled by this mechanism
+  }                                                         //big   arg - police  - resize queue storage.
+  buf_police( self, pbuf, sz, sz );
   if(sz>self->buffer_size_bytes)                            
     Fifo_Resize(self,sz);  
     
@@ -391,10 +877,41 @@ Fifo_Push( Fifo *self_, void **pbuf, size_t sz, int expand_on_full)
     Fifo_Expand(self);  
   else                      // Overwrite
     self->tail++;
+  _set_len( self, self->head, sz );
   _swap( self, pbuf, self->head++ );
   return !expand_on_full;   // return true iff data was overwritten
 }
 
+void*
+Fifo_Reserve( Fifo *self_ )
+{ Fifo_ *self = (Fifo_*)self_;
+  return_val_if( Fifo_Is_Full(self), NULL );
+  return _at(self,self->head);
+}
+
+void
+Fifo_Commit( Fifo *self_, size_t nbytes )
+{ Fifo_ *self = (Fifo_*)self_;
+  Fifo_Assert( !Fifo_Is_Full(self) );
+  _set_len( self, self->head++, nbytes );
+}
+
+void*
+Fifo_Acquire( Fifo *self_, size_t *nbytes )
+{ Fifo_ *self = (Fifo_*)self_;
+  return_val_if( Fifo_Is_Empty(self), NULL );
+  if(nbytes)
+    *nbytes = self->lens[MOD_UNSIGNED_POW2(self->tail,Fifo_Buffer_Count(self))];
+  return _at(self,self->tail);
+}
+
+void
+Fifo_Release( Fifo *self_ )
+{ Fifo_ *self = (Fifo_*)self_;
+  Fifo_Assert( !Fifo_Is_Empty(self) );
+  self->tail++;
+}
+
 inline 
 size_t Fifo_Buffer_Size_Bytes(Fifo *self)
 { return ((Fifo_*)self)->buffer_size_bytes;
@@ -402,20 +919,39 @@ size_t Fifo_Buffer_Size_Bytes(Fifo *self)
 
 inline 
 size_t Fifo_Buffer_Count(Fifo *self)
-{ return ((Fifo_*)self)->ring->nelem;
+{ Fifo_ *f = (Fifo_*)self;
+  return INLINE(f)?f->nslots:f->ring->nelem;
 }
 
 void*
 Fifo_Alloc_Token_Buffer( Fifo *self_ )
 { Fifo_ *self = (Fifo_*)self_;
-  return Fifo_Malloc( self->buffer_size_bytes, 
+  void *buf = buf_alloc( self, self->buffer_size_bytes, 
                          "Fifo_Alloc_Token_Buffer" );
+  if(self->lock_memory && rt_lock(buf))
+    fifo_warning("Could not lock token buffer in memory.\r\n");
+  return buf;
 }
 
 void Fifo_Resize_Token_Buffer( Fifo *self_, void **pbuf )
 { Fifo_ *self = (Fifo_*)self_;
-  Fifo_Realloc( pbuf, self->buffer_size_bytes, 
-                         "Fifo_Realloc_Token_Buffer" );
+  return_if_fail(!self->realtime || !*pbuf);
+  buf_realloc( self, pbuf, 0, self->buffer_size_bytes, 
+               "Fifo_Realloc_Token_Buffer" );
+}
+
+const FifoAllocator *Fifo_Get_Allocator( Fifo *self_ )
+{ Fifo_ *self = (Fifo_*)self_;
+  return (self->owner && !PLACES(self->owner))?&self->owner->a:NULL;
+}
+
+const FifoAllocator *Fifo_Get_Buffer_Allocator( void *buf )
+{ owner_t *o = owner_of(buf);
+  return (o && !PLACES(o))?&o->a:NULL;
+}
+
+void Fifo_Free_Token_Buffer( void *buf )
+{ buf_free(buf);
 }
 
 unsigned char Fifo_Is_Empty(Fifo *self_)
@@ -424,6 +960,6 @@ unsigned char Fifo_Is_Empty(Fifo *self_)
 }
 unsigned char Fifo_Is_Full (Fifo *self_)
 { Fifo_ *self = (Fifo_*)self_;
-  return ( (self)->head == (self)->tail + (self)->ring->nelem );
+  return ( (self)->head == (self)->tail + Fifo_Buffer_Count(self) );
 }
 #pragma clang diagnostic pop
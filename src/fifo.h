@@ -1,6 +1,7 @@
 #pragma once
 
 #include "config.h"
+#include "numaplace.h"
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -42,6 +43,58 @@ extern "C"{
    Add's more buffers to the queue.  Does not resize the buffers.  Sizes the
    queue to the next power of two.
 
+ Alloc_Placed
+ Set_Placement
+   Places every buffer the fifo allocates with a NUMA policy.  Like
+   allocator buffers, placed buffers record where they came from in a
+   header (see Alloc_With_Allocator).  Buffers swapped on to the queue that
+   weren't placed the same way are replaced by placed copies, so buffers
+   recycled through the swap stay on the right node.  Set_Placement moves
+   existing buffers by copying them.
+
+ Alloc_With_Allocator
+   Every buffer the fifo allocates, frees or resizes goes through the hooks
+   in the FifoAllocator: ring buffers, token buffers, expansion and
+   policing.  <realloc> may be NULL, in which case buffers are grown by
+   alloc, copy and free.  The hooks are copied; <ctx> must outlive every
+   buffer the fifo hands out.  Buffers swapped on to the queue that came
+   from somewhere else are replaced by copies from the allocator.
+   Fifo_Free_Token_Buffer() routes any buffer back to the allocator it
+   came from, so it works after the fifo is gone.  Placement doesn't apply
+   to these fifos.
+   Buffers start FIFO_BUFFER_HEADER_BYTES into what <alloc> returns; the
+   fifo keeps its bookkeeping in front of them.  So <alloc> and <realloc>
+   are asked for that much more than the buffer size, and <realloc> and
+   <free> get the pointer <alloc> returned.
+
+ Get_Allocator
+ Get_Buffer_Allocator
+   The hooks of a fifo, or those a buffer came from.  NULL for malloc'd
+   and placed buffers.  A buffer is a fifo's own when the two are the
+   same pointer.
+
+ Alloc_Inline
+   Messages of up to FIFO_INLINE_MAX_BYTES live in one contiguous,
+   cache-aligned array of slots.  Push copies the token into the head slot
+   and Pop copies the tail slot out to the token, so there's no pointer to
+   chase per message; the token stays with the caller.  Resizing past
+   FIFO_INLINE_MAX_BYTES converts the queue to ordinary buffers.
+   Placement doesn't apply to these fifos.
+
+ Alloc_Realtime
+   A fifo that never allocates after it's made.  Buffers are whole pages
+   and, with <lock_memory>, are locked in memory (Alloc_Realtime returns
+   NULL if they can't be).  Sizes are fixed: Resize and Expand do nothing,
+   and Pop, Peek and Push return 2 rather than resizing a token that is
+   NULL, too small or (for Push) not exactly <buffer_size_bytes>.  Push
+   with <expand_on_full> on a full queue also returns 2.  Tokens aren't
+   policed, so use Alloc_Token_Buffer for them.
+
+ No_Alloc_Begin
+ No_Alloc_End
+   Bracket a path that must not allocate.  In debug builds, any allocation
+   by the fifo on the calling thread in between is a fatal error.
+
  Resize
    Changes the size of enqueued buffers.  Operates by realloc'ing buffers in
    the "dead" part of the queue and changing the <buffer_size_bytes> property.
@@ -58,10 +111,41 @@ extern "C"{
  Peek_At
    Operate by copying data out of the read point into a passed buffer.
 
+ Reserve
+ Commit
+   Reserve returns the memory of the slot the next push would fill, or NULL
+   if the queue is full.  Commit enqueues it as it stands, as a message of
+   <nbytes>.  Nothing may push, expand or resize in between.
+
+ Acquire
+ Release
+   Acquire returns the memory of the slot at the read point, or NULL if the
+   queue is empty, and the length of the message there: what was committed,
+   or the <sz> it was pushed with.  Release dequeues it.  Nothing may pop,
+   expand or resize in between.
+
 */
 typedef void Fifo;
 
+#define FIFO_BUFFER_HEADER_BYTES 64 // in front of buffers from a FifoAllocator
+
+#ifndef FIFO_INLINE_MAX_BYTES
+#define FIFO_INLINE_MAX_BYTES 64 // largest message Alloc_Inline keeps in the ring
+#endif
+
+typedef struct _fifo_allocator
+{ void *(*alloc)  ( size_t bytes, void *ctx );
+  void *(*realloc)( void *buf, size_t bytes, void *ctx ); // optional
+  void  (*free)   ( void *buf, void *ctx );
+  void   *ctx;
+} FifoAllocator;
+
 Fifo*   Fifo_Alloc   ( size_t buffer_count, size_t buffer_size_bytes );
+Fifo*   Fifo_Alloc_Placed ( size_t buffer_count, size_t buffer_size_bytes, NumaPolicy policy, int node );
+Fifo*   Fifo_Alloc_With_Allocator ( size_t buffer_count, size_t buffer_size_bytes, const FifoAllocator *allocator );
+Fifo*   Fifo_Alloc_Inline   ( size_t buffer_count, size_t buffer_size_bytes );
+Fifo*   Fifo_Alloc_Realtime ( size_t buffer_count, size_t buffer_size_bytes, int lock_memory );
+void    Fifo_Set_Placement( Fifo *self, NumaPolicy policy, int node );
 void    Fifo_Expand  ( Fifo *self );
 void    Fifo_Resize  ( Fifo *self, size_t buffer_size_bytes );
 void    Fifo_Free    ( Fifo *self );
@@ -72,11 +156,21 @@ extern unsigned int Fifo_Peek_At   ( Fifo *self, void **pbuf, size_t sz, size_t
 extern unsigned int Fifo_Push      ( Fifo *self, void **pbuf, size_t sz, int expand_on_full);// might resize queue's bufs,  *pbuf==NULL ok (allocs)
 extern unsigned int Fifo_Push_Try  ( Fifo *self, void **pbuf, size_t sz);                    // might resize queue's bufs,  *pbuf==NULL ok (allocs)
 
+       void*        Fifo_Reserve   ( Fifo *self );                                           // NULL if full
+       void         Fifo_Commit    ( Fifo *self, size_t nbytes );                            // nbytes: length of the message
+       void*        Fifo_Acquire   ( Fifo *self, size_t *nbytes );                           // NULL if empty.  nbytes: length of the message
+       void         Fifo_Release   ( Fifo *self );
+
 extern size_t       Fifo_Buffer_Size_Bytes ( Fifo *self );
 extern size_t       Fifo_Buffer_Count      ( Fifo *self );
        void*        Fifo_Alloc_Token_Buffer( Fifo *self );
        void         Fifo_Resize_Token_Buffer( Fifo *pself, void **pbuf );
-#define Fifo_Free_Token_Buffer(e) free(e)
+       void         Fifo_Free_Token_Buffer( void *buf );
+const FifoAllocator*Fifo_Get_Allocator     ( Fifo *self );                                    // NULL unless made with Alloc_With_Allocator
+const FifoAllocator*Fifo_Get_Buffer_Allocator( void *buf );                                 // NULL unless buf came from an allocator
+
+void    Fifo_No_Alloc_Begin( void );
+void    Fifo_No_Alloc_End  ( void );
 
 extern unsigned char Fifo_Is_Empty(Fifo *self_);
 extern unsigned char Fifo_Is_Full (Fifo *self_);
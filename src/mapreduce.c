@@ -1,5 +1,5 @@
 /** \file
-    Map-reduce framework implemented using \ref Chan.
+    Map-reduce framework implemented on a work-stealing scheduler.
     \section secMapEx map() example
 
     Take an array of 8-bit RGB tuples from a color image and map to 
@@ -16,7 +16,9 @@
     \endcode
 
     Perform the grayscale conversion in parallel over a 512x512 RGB image.
-    The output image will be dynamically allocated.
+    The output image will be dynamically allocated.  map() returns a
+    description of the output or, on failure, an MRData with \c data set to
+    NULL.
     \code
     MRData result = 
       map(MREmpty(sizeof(double)),
@@ -29,34 +31,285 @@
     If the output image has already been allocated:
     \code
     double out[512*512];
-    map(MRPackage(out,8,512*512)),
+    map(MRPackage(out,8,512*512*8),
         MRPackage(image,3,512*512*3),
         grayscale);
     // use "out"    
     \endcode
+
+    \section secMapSpanEx map_span() example
+
+    Calling a function per element keeps the compiler from vectorizing
+    across elements.  map_span() instead hands the function a whole chunk
+    at once, along with a context pointer for parameters:
+    \code
+    int scale(void *_dst, const void *_src, size_t n, void *ctx)
+    { double       *dst = (double*)_dst;
+      const double *src = (const double*)_src;
+      double        k   = *(double*)ctx;
+      size_t i;
+      for(i=0;i<n;++i)
+        dst[i] = k*src[i];
+      return 0;
+    }
+
+    double k=2.0;
+    map_span(MRPackage(out,8,n*8),MRPackage(in,8,n*8),scale,&k);
+    \endcode
+
+    \ref mrkernels.h has ready-made span functions with SSE4.1 and AVX2
+    paths, including the grayscale conversion above:
+    \code
+    map_span(MRPackage(out,8,512*512*8),
+             MRPackage(image,3,512*512*3),
+             MRKernel_Gray_RGB8_F64,NULL); // NULL: Rec. 601 weights
+    \endcode
+
+    \section secMapNEx map_n() example
+
+    Functions of several arrays, like a*x+y, don't need the arrays packed
+    into structs first.  map_n() takes any number of strided operands, up
+    to eight, and hands the function matching spans of each:
+    \code
+    int axpy(void *dst, size_t dst_stride, const void *const *src, const size_t *src_strides, size_t n, void *ctx)
+    { double a = *(double*)ctx, *d = (double*)dst;
+      const double *x = (const double*)src[0], *y = (const double*)src[1];
+      size_t i;
+      for(i=0;i<n;++i) d[i] = a*x[i]+y[i]; // every stride is sizeof(double)
+      return 0;
+    }
+
+    MRStrided in[2] = { MRPackageStrided(x,sizeof(double),0,n),
+                        MRPackageStrided(y,sizeof(double),0,n) };
+    map_n(MRPackageStrided(y,sizeof(double),0,n),in,2,axpy,&a);
+    \endcode
+    Strides let one channel of an interleaved image be an operand in place:
+    the green channel of packed 8-bit RGB pixels is
+    <tt>MRPackageStrided(image+1,1,3,npixels)</tt>.
+
+    \section secStreamEx Streaming
+
+    map_stream() sits in the middle of a \ref Chan pipeline.  It pulls
+    tokens from one channel, runs a span function over each on several
+    threads and pushes the results on to another.  Tokens are swapped, not
+    copied, at both ends.  It returns once the input runs dry and its
+    writers have closed, leaving the handles open for the caller to close:
+    \code
+    Chan *reader = Chan_Open(frames,CHAN_READ),
+         *writer = Chan_Open(gray,CHAN_WRITE);
+    map_stream(reader,writer,3,MRKernel_Gray_RGB8_F64,NULL,4,1);
+    Chan_Close(writer); // downstream sees the end of the stream
+    Chan_Close(reader);
+    \endcode
+
+    \section secLazyEx Fusing maps
+
+    Chaining map() calls writes out every intermediate array.  An MRLazy
+    records the chain instead and runs it as a single pass, streaming each
+    chunk through all the stages while it's still in cache:
+    \code
+    MRLazy *e = MRLazy_Alloc(MRPackage(image,3,512*512*3));
+    MRLazy_Map(e,grayscale,sizeof(double)); // rgb -> double
+    MRLazy_Map(e,scale,    sizeof(double)); // double -> double
+    MRLazy_Map(e,clamp,    sizeof(unsigned char)); // double -> u8
+    MRData out = MRLazy_Eval(e,MREmpty(sizeof(unsigned char)));
+    MRLazy_Free(e);
+    \endcode
+
+    \section secTiledEx map_tiled() example
+
+    Neighbourhood operations on images use map_tiled().  Each call of the
+    function gets one cache-sized tile.  With a halo, the tile's
+    neighbourhood is readable too, and image edges are replicated:
+    \code
+    int box3(const MRTile *t, void *ctx)
+    { size_t x,y;
+      for(y=0;y<t->h;++y)
+      { const float *r0 = (const float*)(t->src+(y-1)*t->src_stride),
+                    *r1 = (const float*)(t->src+ y   *t->src_stride),
+                    *r2 = (const float*)(t->src+(y+1)*t->src_stride);
+        float *out = (float*)(t->dst+y*t->dst_stride);
+        for(x=0;x<t->w;++x)
+          out[x] = (r0[x-1]+r0[x]+r0[x+1]+r1[x-1]+r1[x]+r1[x+1]+r2[x-1]+r2[x]+r2[x+1])/9.0f;
+      }
+      return 0;
+    }
+
+    MRData2D out = map_tiled(MREmpty2D(sizeof(float)),
+                             MRPackage2D(image,sizeof(float),width,height,0),
+                             box3,1,NULL);
+    // use the result
+    MRRelease2D(&out);
+    \endcode
+
+    \section secFoldEx foldl() example
+
+    Sum an array of doubles.  \a dst holds a single accumulator, and must
+    start out as the identity of the operator since each chunk of the input
+    starts from a copy of it.  When \c dst.data is NULL a zero-filled
+    accumulator is allocated.
+    \code
+    int add(void *acc, void *x)
+    { *(double*)acc += *(double*)x;
+      return 0;
+    }
+
+    double sum=0.0;
+    foldl(MRPackage(&sum,sizeof(sum),sizeof(sum)),
+          MRPackage(data,sizeof(double),n*sizeof(double)),
+          add);
+    \endcode
+
+    Each worker folds a chunk into a private accumulator, then the partial
+    results are combined pairwise in a tree of depth log2(chunks).
+
+    When the accumulator isn't the same type as the elements, as for a
+    histogram, pass a second function to foldl_ex() that combines two
+    accumulators:
+    \code
+    int bin  (void *h, void *x) { ((unsigned*)h)[*(unsigned char*)x]++; return 0; }
+    int merge(void *h, void *o) { int i; for(i=0;i<256;++i) ((unsigned*)h)[i]+=((unsigned*)o)[i]; return 0; }
+
+    unsigned hist[256]={0};
+    foldl_ex(MRPackage(hist,sizeof(hist),sizeof(hist)),
+             MRPackage(pixels,1,npixels),
+             bin,merge,MR_FOLD_COMMUTATIVE);
+    \endcode
+
+    Sums, minima, maxima, histograms and dot products over 8 and 16-bit
+    integers and floats are built in, with vectorized kernels.  See
+    foldl_reduce() in \ref mrkernels.h:
+    \code
+    unsigned long long hist[256];
+    foldl_reduce(MRPackage(hist,sizeof(hist),sizeof(hist)),
+                 MRPackage(pixels,1,npixels),
+                 MR_U8,MR_HISTOGRAM,NULL);
+    \endcode
+
+    The \ref MRFoldMode says how much freedom the operator allows:
+    \li \ref MR_FOLD_ASSOCIATIVE keeps the element order.  Chunk results are
+        combined in order, so non-commutative operators (matrix products,
+        function composition) give the same answer as a serial fold.
+    \li \ref MR_FOLD_COMMUTATIVE lets each worker accumulate whatever chunks
+        it runs, giving one partial result per worker instead of one per
+        chunk.
+    \li \ref MR_FOLD_STRICT is a serial left fold for operators that aren't
+        associative.
+
+    \section secScanEx scan() example
+
+    Output offsets for variable-length records are an exclusive prefix sum
+    of their lengths:
+    \code
+    int offsets[n];
+    scan(MRPackage(offsets,sizeof(int),sizeof(offsets)),
+         MRPackage(lengths,sizeof(int),sizeof(offsets)),
+         MRAdd_I32,NULL,MR_SCAN_EXCLUSIVE);
+    \endcode
+    Any associative operator works, given its identity.  The MRAdd
+    functions are recognized and run as typed loops.
+
+    \section secFilterEx mr_filter() and mr_flat_map() example
+
+    Keep the positive values:
+    \code
+    int positive(const void *e, void *ctx) { return *(const float*)e>0.0f; }
+
+    MRData out = mr_filter(MREmpty(sizeof(float)),src,positive,NULL);
+    \endcode
+    A flat map emits any number of outputs, up to a bound, per input.  This
+    one expands each run length into that many copies of a byte:
+    \code
+    typedef struct { unsigned char value,count; } run_t;
+    long expand(void *out, const void *e, void *ctx)
+    { const run_t *r = (const run_t*)e;
+      memset(out,r->value,r->count);
+      return r->count;
+    }
+
+    MRData out = mr_flat_map(MREmpty(1),runs,255,expand,NULL);
+    \endcode
+    Both run in two parallel passes.  The first processes each chunk and
+    counts its outputs.  A scan() of the counts gives every chunk its place
+    in the result, and the second pass copies the outputs there.
+
+    \section secFileEx Files bigger than memory
+
+    Map files with MRPackageFile() and MRPackageFileOut() and run
+    map_file() with a span function:
+    \code
+    MRFile *in  = MRPackageFile("samples.f64",sizeof(double)),
+           *out = MRPackageFileOut("scaled.f64",sizeof(double));
+    if(in && out)
+      map_file(out,in,scale,&k);
+    MRReleaseFile(in);
+    MRReleaseFile(out);
+    \endcode
+    map_file() works through the input in windows (see
+    MRSetFileWindowSize()).  While one window is processed the next is
+    read in ahead, and each finished window is dropped from memory, so the
+    resident set stays around two windows.  MRFileData() exposes the whole
+    mapping to the other calls, which then rely on the OS to page.
+
+    \section secMapThreads Worker threads
+
+    Work is executed on a process-wide \ref ThreadPool that is created the
+    first time it's needed.  The workers stay parked between calls, so
+    many small map() calls don't pay for thread creation.  Use
+    MRSetWorkerThreadCount() to size the pool; by default there's one
+    worker per processor.  The calling thread counts as one of the workers.
+
+    Memory-bound functions often run no faster, or slower, with every
+    processor busy.  MRSetCalibration() times the first few calls for each
+    function and input size with different worker counts and chunk sizes,
+    then sticks with the fastest.  MRGetCalibration() reports the choices.
+
+    Each call is split into contiguous chunks scheduled by Sched_For().
+    A worker runs a whole chunk in a tight loop, so scheduling costs are
+    paid per chunk rather than per element.  The chunk size is picked
+    automatically from the input size and worker count, or can be fixed
+    with MRSetGrainSize().
+    Every worker keeps its own deque of chunk ranges and only touches
+    another worker's deque to steal when it runs dry, so uneven
+    per-element costs balance without a shared queue.
   */
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include "config.h"
 #include "mapreduce.h"
 #include "thread.h"
-#include "chan.h"
+#include "scheduler.h"
 
 #define LOG(...) fprintf(stderr,__VA_ARGS__)
-#define ENDL "\n"
 #define TRY(e,lbl) do { if(!(e)) \
     {LOG("*** Error [%s]: %s(%d)"ENDL \
          "Expression evaluated as false."ENDL \
          "%s"ENDL,#lbl,__FILE__,__LINE__,#e); goto lbl;} } while(0)
 
-struct _map_reduce_data
-{ char   *data;
-  size_t  bytesof_elem;
-  size_t  bytesof_data;
-};
+#define MR_MIN_CHUNK_BYTES (32*1024) // keeps scheduling overhead small relative to the work
+#define MR_MAX_FOLD_PARTIALS  4096   // bounds the memory used by associative folds
+#define MR_TILE_BYTES   (128*1024)   // tile working set: half a typical L2
+#define MR_TILE_ROW_BYTES   4096     // widest automatic tile row
+#define MR_FUSE_BLOCK_BYTES (8*1024) // per intermediate buffer in a fused map: both fit in L1
+#define MR_CHUNKS_PER_WORKER   4
+#define MR_MAX_MAP_INPUTS      8     // operands of map_n(); bounds per-chunk pointer arrays
+#define MR_CALIB_ENTRIES      64     // calibrated (function,size class) pairs remembered
+#define MR_CALIB_MARGIN     1.05     // more workers must be this much faster to be chosen
 
-static int   _nthreads = 8;
-static Mutex _lock     = {0}; // right now, mostly protects access to _nthreads
+static int         _nthreads   = 0;   // 0: one per processor
+static size_t      _grain      = 0;   // 0: automatic
+static size_t      _tile_w     = 0;   // 0: automatic
+static size_t      _tile_h     = 0;
+static Mutex       _lock       = {0}; // protects the settings above, calibration and the worker pool
+static ThreadPool *_pool       = NULL;
+static int         _pool_users = 0;
+static int         _calibrate  = 0;
+static ThreadAttr  _attr;             // worker attributes from MRSetWorkerAttributes()
+static int         _attr_set   = 0;
+static int         _attr_stale = 0;   // the pool predates _attr
+static unsigned    _attr_cpus[THREAD_MAX_CPUS];
+static char        _attr_name[16];
 
 MRData MRPackage(void *buf, size_t bytesof_elem, size_t bytesof_data)
 { MRData out = {buf,bytesof_elem,bytesof_data};
@@ -68,11 +321,31 @@ MRData MREmpty(size_t bytesof_elem)
   return out;
 }
 
-void MRData_Release(MRData *mrdata)
+void MRRelease(MRData *mrdata)
 { if(mrdata->data) free(mrdata->data);
   memset(mrdata,0,sizeof(MRData));
 }
 
+MRStrided MRPackageStrided(void *buf, size_t bytesof_elem, size_t stride, size_t count)
+{ MRStrided out = {(char*)buf,bytesof_elem,stride?stride:bytesof_elem,count};
+  return out;
+}
+
+MRData2D MRPackage2D(void *buf, size_t bytesof_elem, size_t width, size_t height, size_t stride)
+{ MRData2D out = {(char*)buf,bytesof_elem,width,height,stride?stride:width*bytesof_elem};
+  return out;
+}
+
+MRData2D MREmpty2D(size_t bytesof_elem)
+{ MRData2D out = {NULL,bytesof_elem,0,0,0};
+  return out;
+}
+
+void MRRelease2D(MRData2D *mrdata)
+{ if(mrdata->data) free(mrdata->data);
+  memset(mrdata,0,sizeof(MRData2D));
+}
+
 void MRSetWorkerThreadCount(int nthreads)
 { 
   Mutex_Lock(&_lock);
@@ -80,57 +353,327 @@ void MRSetWorkerThreadCount(int nthreads)
   Mutex_Unlock(&_lock);
 }
 
-static Thread **alloc_threads(ThreadProc function,void *arg, int *nthreads)
+void MRSetGrainSize(size_t nelem)
 { 
-  Thread **ts;
-  int i;
-  *nthreads = 0;
   Mutex_Lock(&_lock);
-  TRY(ts = (Thread**)malloc(sizeof(Thread*)*_nthreads),MemoryError);
-  for(i=0;i<_nthreads;++i)
-    ts[i] = Thread_Alloc(function,arg);
-  *nthreads = _nthreads;
-MemoryError:
+  _grain = nelem;
+  Mutex_Unlock(&_lock);
+}
+
+void MRSetTileSize(size_t w, size_t h)
+{ 
+  Mutex_Lock(&_lock);
+  _tile_w = w;
+  _tile_h = h;
+  Mutex_Unlock(&_lock);
+}
+
+void MRSetWorkerAttributes(const ThreadAttr *attr)
+{
+  Mutex_Lock(&_lock);
+  _attr_set = (attr!=NULL);
+  if(attr)
+  { _attr       = *attr;
+    _attr.ncpus = attr->ncpus<THREAD_MAX_CPUS?attr->ncpus:THREAD_MAX_CPUS;
+    if(_attr.ncpus)
+      memcpy(_attr_cpus,attr->cpus,_attr.ncpus*sizeof(unsigned));
+    _attr.cpus  = _attr_cpus;
+    if(attr->name)
+    { strncpy(_attr_name,attr->name,sizeof(_attr_name)-1);
+      _attr.name = _attr_name;
+    }
+  }
+  _attr_stale = 1;
+  Mutex_Unlock(&_lock);
+}
+
+/** Attributes for worker \a i of a map_stream() call, or NULL for the
+    defaults.  Follows ThreadPool_Alloc_Ex() in placing workers.  Call
+    with _lock held.
+ */
+static const ThreadAttr *worker_attr(unsigned i, ThreadAttr *out, char name[16])
+{ if(!_attr_set) return NULL;
+  *out = _attr;
+  if(_attr.one_cpu_each && _attr.ncpus)
+  { out->cpus  = _attr.cpus+i%_attr.ncpus;
+    out->ncpus = 1;
+  }
+  if(_attr.name)
+  { snprintf(name,16,"%.11s%u",_attr.name,i);
+    out->name = name;
+  }
+  return out;
+}
+
+/** Returns the process-wide worker pool, creating it on first use.
+
+    The pool is sized by MRSetWorkerThreadCount().  Since the calling thread
+    participates in the work, the pool holds one less thread than the
+    requested count.  A change in the requested size takes effect the next
+    time the pool is acquired while no other call is using it.  Every
+    acquire_pool() must be paired with a release_pool().
+
+    \param[out] nworkers The number of participants to use with Sched_For().
+ */
+static ThreadPool *acquire_pool(unsigned *nworkers)
+{ ThreadPool *p;
+  unsigned want,nthreads;
+  Mutex_Lock(&_lock);
+  nthreads = (_nthreads>0)?(unsigned)_nthreads:Thread_Processor_Count();
+  want = (nthreads>1)?nthreads-1:1;
+  if(_pool && _pool_users==0 && (_attr_stale || ThreadPool_Thread_Count(_pool)!=want))
+  { ThreadPool_Free(_pool);
+    _pool=NULL;
+  }
+  if(!_pool)
+  { if(_attr_set && !(_pool=ThreadPool_Alloc_Ex(want,&_attr)))
+      LOG("*** Warning: Could not apply the worker attributes.  Using the defaults."ENDL);
+    if(!_pool)
+      _pool=ThreadPool_Alloc(want);
+    _attr_stale=0;
+  }
+  ++_pool_users;
+  p=_pool;
+  *nworkers = (nthreads>1)?nthreads:1;
+  if(*nworkers>Sched_Max_Workers(p))
+    *nworkers=Sched_Max_Workers(p);
+  Mutex_Unlock(&_lock);
+  return p;
+}
+
+static void release_pool(ThreadPool *p)
+{ Mutex_Lock(&_lock);
+  --_pool_users;
   Mutex_Unlock(&_lock);
-  return ts;
-}
-
-static void free_threads(Thread** ts, int nthreads)
-{ int i;
-  if(ts)
-  { for(i=0;i<nthreads;++i)
-      Thread_Free(ts[i]);
-    free(ts);
-  }
-}
-
-typedef struct _map_consumer_args
-{ Chan       *q;
-  MRFunction  f;
-} MapConsumerArgs;
-
-typedef struct _map_payload
-{ void *d;
-  void *s;
-} Payload;
-
-static void* map_consumer(void *args_)
-{ Chan    *reader;
-  Payload *data   = NULL;
-  size_t   nbytes = 0;
-  MapConsumerArgs *args = (MapConsumerArgs*) args_;
-  reader = Chan_Open(args->q,CHAN_READ);
-  TRY( Chan_Next(reader,(void**)&data,nbytes) ,ErrorFailedRead);
-  TRY( args->f(data->d,data->s)       ,ErrorFailedApply);
-ErrorFailedApply:
-  Chan_Token_Buffer_Free(data);
-ErrorFailedRead:
-  Chan_Close(reader);
-  /// \todo How to handle errors/pass them back to map()
-  return NULL;
+}
+
+/** The number of elements per chunk used to split \a n elements over
+    \a nworkers.
+
+    Aims for \a chunks_per_worker chunks per worker so stealing has
+    something to balance, but never makes a chunk so small that it moves
+    less than \c MR_MIN_CHUNK_BYTES.  Small inputs end up as a single chunk
+    and run serially on the caller.
+
+    \param bytesof_elem Bytes read and written per element.
+ */
+static size_t auto_grain(size_t n, size_t bytesof_elem, unsigned nworkers, unsigned chunks_per_worker)
+{ size_t g,least;
+  least = MR_MIN_CHUNK_BYTES/(bytesof_elem?bytesof_elem:1);
+  g     = n/((size_t)chunks_per_worker*nworkers);
+  if(g<least) g=least;
+  return g?g:1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Calibration  /////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+/* A calibration entry runs a short series of trials, one per call:
+   first each power-of-two worker count with the default chunking, then
+   coarser and finer chunking at the best count.  Trials are handed out in
+   order; calls that arrive while the last trials are still running just
+   use the defaults.
+*/
+#define MR_CALIB_MAX_TRIALS 16
+
+typedef struct _calib_entry
+{ MRCalibration pub;
+  unsigned      workers[MR_CALIB_MAX_TRIALS];
+  unsigned      chunks [MR_CALIB_MAX_TRIALS]; ///< per worker
+  double        bps    [MR_CALIB_MAX_TRIALS]; ///< bytes per second, 0 until measured
+  unsigned      ntrials,issued,measured;
+  int           phase;                        ///< 1: worker counts, 2: chunking, 3: done
+} calib_entry_t;
+
+static calib_entry_t _calib[MR_CALIB_ENTRIES];
+static size_t        _ncalib = 0;
+static unsigned      _calib_generation = 0; // bumped by MRResetCalibration() to orphan running trials
+
+void MRSetCalibration(int enable)
+{ Mutex_Lock(&_lock);
+  _calibrate = enable;
+  Mutex_Unlock(&_lock);
+}
+
+void MRResetCalibration(void)
+{ Mutex_Lock(&_lock);
+  _ncalib = 0;
+  ++_calib_generation;
+  Mutex_Unlock(&_lock);
+}
+
+size_t MRGetCalibration(MRCalibration *out, size_t max)
+{ size_t i,n;
+  Mutex_Lock(&_lock);
+  n = _ncalib;
+  for(i=0;i<n && i<max;++i)
+    out[i] = _calib[i].pub;
+  Mutex_Unlock(&_lock);
+  return n;
+}
+
+static unsigned size_class(size_t bytes)
+{ unsigned c=0;
+  while(bytes>>=1) ++c;
+  return c;
+}
+
+/** Finds or starts the entry for \a key.  Call with _lock held. */
+static calib_entry_t *calib_entry(const void *key, unsigned sc, unsigned max_workers)
+{ calib_entry_t *e;
+  size_t i;
+  unsigned w;
+  for(i=0;i<_ncalib;++i)
+    if(_calib[i].pub.f==key && _calib[i].pub.size_class==sc)
+      return _calib+i;
+  if(_ncalib==MR_CALIB_ENTRIES)
+    return NULL;
+  e = _calib+_ncalib++;
+  memset(e,0,sizeof(*e));
+  e->pub.f          = key;
+  e->pub.size_class = sc;
+  e->phase          = 1;
+  for(w=1;;w*=2)
+  { if(w>max_workers) w=max_workers;
+    e->workers[e->ntrials] = w;
+    e->chunks [e->ntrials] = MR_CHUNKS_PER_WORKER;
+    ++e->ntrials;
+    if(w==max_workers) break;
+  }
+  return e;
+}
+
+/** Index of the fastest measured trial.  A trial only beats a faster one
+    with fewer workers by at least MR_CALIB_MARGIN.
+ */
+static unsigned calib_best(const calib_entry_t *e)
+{ unsigned i,best=0;
+  for(i=1;i<e->ntrials;++i)
+  { double need = (e->workers[i]>e->workers[best])?MR_CALIB_MARGIN:1.0;
+    if(e->bps[i]>need*e->bps[best])
+      best=i;
+  }
+  return best;
+}
+
+/** Advances \a e once all of its issued trials are measured. */
+static void calib_advance(calib_entry_t *e, int fixed_grain)
+{ unsigned best;
+  if(e->measured<e->ntrials)
+    return;
+  best = calib_best(e);
+  if(e->phase==1 && !fixed_grain && e->ntrials+2<=MR_CALIB_MAX_TRIALS)
+  { e->workers[e->ntrials] = e->workers[best]; e->chunks[e->ntrials++] = 1;
+    e->workers[e->ntrials] = e->workers[best]; e->chunks[e->ntrials++] = 4*MR_CHUNKS_PER_WORKER;
+    e->phase = 2;
+    return;
+  }
+  e->phase                = 3;
+  e->pub.nworkers         = e->workers[best];
+  e->pub.chunks_per_worker= e->chunks[best];
+  e->pub.bytes_per_second = e->bps[best];
+  e->pub.speedup          = e->bps[0]>0?e->bps[best]/e->bps[0]:1.0; // trial 0 is a single worker
+}
+
+/** How one call will be run. */
+typedef struct _plan
+{ unsigned       nworkers;
+  size_t         grain;
+  calib_entry_t *entry;   ///< set while a calibration trial is running
+  unsigned       trial;
+  unsigned       generation;
+  double         bytes;
+  double         t0;
+} plan_t;
+
+/** Picks the worker count and grain size for a call over \a n elements.
+
+    Uses the grain set by MRSetGrainSize() if there is one, otherwise
+    auto_grain().  Without calibration, uses every worker.  With
+    calibration, looks up the choice for (\a key, size class).  If there
+    isn't one yet, the call runs the next trial and plan_end() records how
+    long it took.
+
+    \param key          Identifies the function being applied.
+    \param bytesof_elem Bytes read and written per element.
+    \param nworkers     Workers available, from acquire_pool().
+ */
+static void plan_begin(plan_t *p, const void *key, size_t n, size_t bytesof_elem, unsigned nworkers)
+{ calib_entry_t *e;
+  unsigned cpw = MR_CHUNKS_PER_WORKER;
+  size_t fixed;
+  memset(p,0,sizeof(*p));
+  p->nworkers = nworkers;
+  Mutex_Lock(&_lock);
+  fixed = _grain;
+  if(_calibrate && key && n
+     && (e=calib_entry(key,size_class(n*bytesof_elem),nworkers)))
+  { if(e->phase==3)
+    { p->nworkers = e->pub.nworkers;
+      cpw         = e->pub.chunks_per_worker;
+    } else if(e->issued<e->ntrials)
+    { p->entry    = e;
+      p->trial    = e->issued++;
+      p->generation = _calib_generation;
+      p->nworkers = e->workers[p->trial];
+      cpw         = e->chunks [p->trial];
+      p->bytes    = (double)n*bytesof_elem;
+    }
+    if(p->nworkers>nworkers) p->nworkers=nworkers;
+  }
+  Mutex_Unlock(&_lock);
+  p->grain = fixed?fixed:auto_grain(n,bytesof_elem,p->nworkers,cpw);
+  p->t0    = Thread_Time();
+}
+
+static void plan_end(plan_t *p, int ok)
+{ double dt = Thread_Time()-p->t0;
+  calib_entry_t *e = p->entry;
+  if(!e) return;
+  Mutex_Lock(&_lock);
+  if(p->generation==_calib_generation)
+  { e->bps[p->trial] = (ok && dt>0)?p->bytes/dt:0.0;
+    e->measured++;
+    e->pub.trials++;
+    calib_advance(e,_grain!=0);
+  }
+  Mutex_Unlock(&_lock);
+}
+
+typedef struct _map_args
+{ MRData         *dst;
+  MRData         *src;
+  MRFunction      f;
+  MRSpanFunction  span;
+  void           *ctx;
+} MapArgs;
+
+/** Applies the function to one contiguous chunk. */
+static int map_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ MapArgs *args = (MapArgs*)args_;
+  const size_t se = args->src->bytesof_elem,
+               de = args->dst->bytesof_elem;
+  MRFunction f = args->f;
+  char *s = args->src->data+beg*se,
+       *d = args->dst->data+beg*de,
+       *e = args->src->data+end*se;
+  for(;s<e;s+=se,d+=de)
+    if(f(d,s))
+      return 1;
+  return 0;
+}
+
+/** Hands one contiguous chunk to a span function. */
+static int map_span_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ MapArgs *args = (MapArgs*)args_;
+  return args->span(args->dst->data+beg*args->dst->bytesof_elem,
+                    args->src->data+beg*args->src->bytesof_elem,
+                    end-beg,args->ctx);
 }
 
 /** Allocates \a dst data if necessary, otherwise shrinks \a src to fit.
+    Use free_dst() to undo the allocation on failure.
 
     There are four cases:
     \li \a dst is ill defined (\c bytesof_elem is 0)
@@ -155,47 +698,1429 @@ ErrorFailedRead:
 static int maybe_alloc_dst(MRData *dst, MRData *src)
 { size_t bytes_required;
   TRY(dst->bytesof_elem>0,Error);
-  bytes_required = dst->bytesof_data * src->bytesof_data/src->bytesof_elem;
+  bytes_required = dst->bytesof_elem * (src->bytesof_data/src->bytesof_elem);
   if(dst->data)
     TRY(dst->bytesof_data>=bytes_required,Error);
   else  
-    TRY(dst->data=malloc(bytes_required),Error);
+  { TRY(dst->data=malloc(bytes_required),Error);
+    dst->bytesof_data = bytes_required;
+  }
   return 1;
 Error:
   return 0;
 }
 
-MRData map(MRData dst, MRData src, MRFunction f)
-{ Thread **ts;
-  int nthreads;
-  MapConsumerArgs args;
+/** Releases \a dst if it was allocated by maybe_alloc_dst(). */
+static void free_dst(MRData *dst, const void *caller_buffer)
+{ if(dst->data && dst->data!=caller_buffer)
+    MRRelease(dst);
+}
+
+/** Runs \a leaf over every chunk of \a src, allocating \a dst if needed.
+    \a args supplies the function; its \c dst and \c src are filled in here.
+ */
+static MRData map_chunks(MRData dst, MRData src, SchedRangeProc leaf, MapArgs *args)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  size_t n;
+  void *given = dst.data;
   MRData result = {NULL,0,0};
 
   TRY( maybe_alloc_dst(&dst,&src), ErrorMemory );
+  n = src.bytesof_data/src.bytesof_elem;
+  args->dst = &dst;
+  args->src = &src;
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,args->f?(const void*)args->f:(const void*)args->span,
+             n,src.bytesof_elem+dst.bytesof_elem,nworkers);
+  TRY(0==Sched_For(pool,plan.nworkers,n,plan.grain,leaf,args),ErrorApply);
+  plan_end(&plan,1);
+  result = dst;
+  release_pool(pool);
+  return result;
+ErrorApply:
+  plan_end(&plan,0);
+  release_pool(pool);
+  free_dst(&dst,given);
+ErrorMemory:
+  return result;
+}
 
-  TRY(args.q = Chan_Alloc(_nthreads,sizeof(Payload)),ErrorMemory);
+MRData map(MRData dst, MRData src, MRFunction f)
+{ MapArgs args = {0};
   args.f = f;
-  TRY(ts = alloc_threads(map_consumer,&args,&nthreads),ErrorAllocThreads);
-
-  { char *s,*d;
-    Payload *data;
-    Chan    *writer;
-    TRY( data  =(Payload*)Chan_Token_Buffer_Alloc(args.q), ErrorChanData);
-    TRY( writer=Chan_Open(args.q,CHAN_WRITE),ErrorChanOpen);
-    for(s=src.data,d=dst.data;s<src.data+src.bytesof_data;s+=src.bytesof_elem,d+=dst.bytesof_elem)
-    { data->s = s;
-      data->d = d;
-      TRY(CHAN_SUCCESS(Chan_Next(writer,(void**)&data,sizeof(void*))),ErrorChanWrite);
-    }
-ErrorChanWrite:
-    Chan_Close(writer);
-ErrorChanOpen:
-    Chan_Token_Buffer_Free(data);
-  }
-ErrorChanData:
-  free_threads(ts,nthreads);
-ErrorAllocThreads:
-  Chan_Close(args.q);
+  return map_chunks(dst,src,map_range,&args);
+}
+
+MRData map_span(MRData dst, MRData src, MRSpanFunction f, void *ctx)
+{ MapArgs args = {0};
+  args.span = f;
+  args.ctx  = ctx;
+  return map_chunks(dst,src,map_span_range,&args);
+}
+
+//////////////////////////////////////////////////////////////////////
+//  N-ary map  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _map_n_args
+{ MRStrided          *dst;
+  const MRStrided    *src;
+  unsigned            nsrc;
+  MRStridedFunction   f;
+  void               *ctx;
+} MapNArgs;
+
+static int map_n_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ MapNArgs *a = (MapNArgs*)args_;
+  const void *s[MR_MAX_MAP_INPUTS];
+  size_t strides[MR_MAX_MAP_INPUTS];
+  unsigned k;
+  for(k=0;k<a->nsrc;++k)
+  { s[k]       = a->src[k].data+beg*a->src[k].stride;
+    strides[k] = a->src[k].stride;
+  }
+  return a->f(a->dst->data+beg*a->dst->stride,a->dst->stride,s,strides,end-beg,a->ctx);
+}
+
+MRStrided map_n(MRStrided dst, const MRStrided *src, unsigned nsrc, MRStridedFunction f, void *ctx)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers,k;
+  size_t n,bytes;
+  void *given = dst.data;
+  MapNArgs args;
+  MRStrided result = {NULL,0,0,0};
+
+  TRY(f && src && nsrc>0 && nsrc<=MR_MAX_MAP_INPUTS,ErrorMemory);
+  n     = src[0].count;
+  bytes = dst.bytesof_elem;
+  for(k=0;k<nsrc;++k)
+  { TRY(src[k].count==n,ErrorMemory);
+    bytes += src[k].bytesof_elem;
+  }
+  if(dst.data)
+    TRY(dst.count>=n,ErrorMemory);
+  else
+  { TRY(dst.data=(char*)malloc(n?n*dst.bytesof_elem:1),ErrorMemory);
+    dst.stride = dst.bytesof_elem;
+  }
+  dst.count = n;
+  args.dst  = &dst;
+  args.src  = src;
+  args.nsrc = nsrc;
+  args.f    = f;
+  args.ctx  = ctx;
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,(const void*)f,n,bytes,nworkers);
+  TRY(0==Sched_For(pool,plan.nworkers,n,plan.grain,map_n_range,&args),ErrorApply);
+  plan_end(&plan,1);
+  release_pool(pool);
+  return dst;
+ErrorApply:
+  plan_end(&plan,0);
+  release_pool(pool);
+  if(dst.data!=given)
+    free(dst.data);
 ErrorMemory:
   return result;
 }
+
+//////////////////////////////////////////////////////////////////////
+//  Streaming map  ///////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+/* Stream workers are plain threads rather than pool tasks: they spend
+   much of their time blocked in Chan_Next(), which would starve the pool
+   of threads for other calls.
+
+   After a failure, of f or of a write to the output channel, the workers
+   keep reading to the end of the stream but drop every token, so writers
+   upstream don't block on a full channel.
+*/
+typedef struct _stream_args
+{ Chan            *in,*out;
+  size_t           bytesof_elem;
+  MRSpanFunction   f;
+  void            *ctx;
+  int              ordered;
+  Mutex            read_lock; ///< serializes reads when ordered
+  Mutex            lock;      ///< guards next_out
+  Condition        turn;      ///< signalled when next_out advances
+  size_t           next_in;   ///< sequence number of the next token read
+  size_t           next_out;  ///< sequence number of the next token to write
+  volatile long    err;
+} StreamArgs;
+
+static void* stream_worker(void *args_)
+{ StreamArgs *a = (StreamArgs*)args_;
+  void  *ibuf = Chan_Token_Buffer_Alloc(a->in),
+        *obuf = Chan_Token_Buffer_Alloc(a->out);
+  size_t isz  = Chan_Buffer_Size_Bytes(a->in),
+         osz  = Chan_Buffer_Size_Bytes(a->out);
+  for(;;)
+  { size_t seq=0;
+    int ok;
+    if(a->ordered)
+    { // reading and numbering must happen together to keep the order
+      Mutex_Lock(&a->read_lock);
+      ok = CHAN_SUCCESS(Chan_Next(a->in,&ibuf,isz));
+      seq = a->next_in++;
+      Mutex_Unlock(&a->read_lock);
+    } else
+      ok = CHAN_SUCCESS(Chan_Next(a->in,&ibuf,isz));
+    if(!ok)
+      break;
+    if(!a->err && a->f(obuf,ibuf,isz/a->bytesof_elem,a->ctx))
+      InterlockedCompareExchange(&a->err,1,0);
+    if(a->ordered)
+    { Mutex_Lock(&a->lock);
+      while(a->next_out!=seq)
+        Condition_Wait(&a->turn,&a->lock);
+      if(!a->err && CHAN_FAILURE(Chan_Next(a->out,&obuf,osz)))
+        InterlockedCompareExchange(&a->err,1,0);
+      a->next_out++;
+      Condition_Notify_All(&a->turn);
+      Mutex_Unlock(&a->lock);
+    } else if(!a->err && CHAN_FAILURE(Chan_Next(a->out,&obuf,osz)))
+      InterlockedCompareExchange(&a->err,1,0);
+  }
+  Chan_Token_Buffer_Free(ibuf);
+  Chan_Token_Buffer_Free(obuf);
+  return NULL;
+}
+
+int map_stream(Chan *in, Chan *out, size_t bytesof_elem, MRSpanFunction f, void *ctx, unsigned nworkers, int ordered)
+{ StreamArgs args;
+  Thread **ts;
+  unsigned i,n=0;
+  TRY(in && out && f && bytesof_elem>0,Error);
+  // f writes as many elements as it reads
+  TRY(Chan_Buffer_Size_Bytes(out)>=Chan_Buffer_Size_Bytes(in)/bytesof_elem*bytesof_elem,Error);
+  if(!nworkers)
+    nworkers=Thread_Processor_Count();
+  memset(&args,0,sizeof(args));
+  args.in           = in;
+  args.out          = out;
+  args.bytesof_elem = bytesof_elem;
+  args.f            = f;
+  args.ctx          = ctx;
+  args.ordered      = ordered;
+  args.read_lock    = MUTEX_INITIALIZER;
+  args.lock         = MUTEX_INITIALIZER;
+  args.turn         = CONDITION_INITIALIZER;
+  TRY(ts=(Thread**)malloc(nworkers*sizeof(Thread*)),Error);
+  for(n=0;n+1<nworkers;++n)
+  { ThreadAttr a;
+    char name[16];
+    const ThreadAttr *pa;
+    Mutex_Lock(&_lock);
+    pa = worker_attr(n,&a,name);
+    Mutex_Unlock(&_lock);
+    if(!(ts[n]=Thread_Alloc_Ex(stream_worker,&args,pa)))
+      break; // run with the workers we got
+  }
+  stream_worker(&args); // the caller is a worker too
+  for(i=0;i<n;++i)
+  { Thread_Join(ts[i]);
+    Thread_Free(ts[i]);
+  }
+  free(ts);
+  return args.err!=0;
+Error:
+  return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Lazy maps  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _lazy_stage
+{ MRFunction      f;
+  MRSpanFunction  span;   ///< used instead of \c f when set
+  void           *ctx;
+  size_t          bytesof_elem;
+} lazy_stage_t;
+
+struct _mr_lazy
+{ MRData        src;
+  lazy_stage_t *stages;
+  size_t        nstages;
+  size_t        capacity;
+};
+
+typedef struct _lazy_args
+{ MRLazy *self;
+  MRData *dst;
+  char   *scratch;         ///< two blocks per worker
+  size_t  block;           ///< elements per block
+  size_t  bytesof_block;
+} LazyArgs;
+
+MRLazy *MRLazy_Alloc(MRData src)
+{ MRLazy *self;
+  TRY(src.bytesof_elem>0,Error);
+  TRY(self=(MRLazy*)calloc(1,sizeof(MRLazy)),Error);
+  self->src = src;
+  return self;
+Error:
+  return NULL;
+}
+
+void MRLazy_Free(MRLazy *self)
+{ if(!self) return;
+  free(self->stages);
+  free(self);
+}
+
+static int lazy_push(MRLazy *self, lazy_stage_t stage)
+{ TRY(self && stage.bytesof_elem>0,Error);
+  if(self->nstages==self->capacity)
+  { size_t c = self->capacity?2*self->capacity:4;
+    lazy_stage_t *s;
+    TRY(s=(lazy_stage_t*)realloc(self->stages,c*sizeof(lazy_stage_t)),Error);
+    self->stages   = s;
+    self->capacity = c;
+  }
+  self->stages[self->nstages++] = stage;
+  return 0;
+Error:
+  return 1;
+}
+
+int MRLazy_Map(MRLazy *self, MRFunction f, size_t bytesof_elem)
+{ lazy_stage_t s = {f,NULL,NULL,bytesof_elem};
+  return lazy_push(self,s);
+}
+
+int MRLazy_Map_Span(MRLazy *self, MRSpanFunction f, size_t bytesof_elem, void *ctx)
+{ lazy_stage_t s = {NULL,f,ctx,bytesof_elem};
+  return lazy_push(self,s);
+}
+
+/** Runs every stage over a chunk, one L1-sized block at a time.
+    Intermediate results ping-pong between the worker's two blocks; the
+    last stage writes straight to the output.
+ */
+static int lazy_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ LazyArgs *a = (LazyArgs*)args_;
+  const MRLazy *self = a->self;
+  char *buf[2];
+  size_t b;
+  buf[0] = a->scratch+2*worker*a->bytesof_block;
+  buf[1] = buf[0]+a->bytesof_block;
+  for(b=beg;b<end;b+=a->block)
+  { const size_t n = (b+a->block<end)?a->block:end-b;
+    const char *in = self->src.data+b*self->src.bytesof_elem;
+    size_t ie = self->src.bytesof_elem,i;
+    for(i=0;i<self->nstages;++i)
+    { const lazy_stage_t *s = self->stages+i;
+      char *out = (i+1==self->nstages)?a->dst->data+b*a->dst->bytesof_elem:buf[i&1];
+      if(s->span)
+      { if(s->span(out,in,n,s->ctx))
+          return 1;
+      } else
+      { size_t k;
+        for(k=0;k<n;++k)
+          if(s->f(out+k*s->bytesof_elem,(void*)(in+k*ie)))
+            return 1;
+      }
+      in = out;
+      ie = s->bytesof_elem;
+    }
+  }
+  return 0;
+}
+
+/** Evaluates the chain in one parallel pass.
+
+    Each worker streams its chunks through all of the stages in blocks
+    small enough to stay in L1, so no full-size intermediate arrays are
+    made.  The chain is left intact and can be evaluated again.
+
+    \param dst Receives the output of the last stage.  Its \c bytesof_elem
+               must match that stage's.  Allocated if \c data is NULL.
+    \return \a dst on success, otherwise an MRData with \c data set to NULL.
+ */
+MRData MRLazy_Eval(MRLazy *self, MRData dst)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  size_t n,widest,i;
+  void *given = dst.data;
+  LazyArgs args;
+  MRData result = {NULL,0,0};
+
+  TRY(self && self->nstages,ErrorMemory);
+  TRY(dst.bytesof_elem==self->stages[self->nstages-1].bytesof_elem,ErrorMemory);
+  TRY(maybe_alloc_dst(&dst,&self->src),ErrorMemory);
+  n = self->src.bytesof_data/self->src.bytesof_elem;
+  widest = 1;
+  for(i=0;i+1<self->nstages;++i)
+    if(self->stages[i].bytesof_elem>widest)
+      widest=self->stages[i].bytesof_elem;
+  memset(&args,0,sizeof(args));
+  args.self          = self;
+  args.dst           = &dst;
+  args.block         = MR_FUSE_BLOCK_BYTES/widest;
+  if(!args.block) args.block=1;
+  args.bytesof_block = args.block*widest;
+
+  pool = acquire_pool(&nworkers);
+  TRY(args.scratch=(char*)malloc(2*nworkers*args.bytesof_block),ErrorScratch);
+  plan_begin(&plan,self,n,self->src.bytesof_elem+dst.bytesof_elem,nworkers);
+  if(0==Sched_For(pool,plan.nworkers,n,plan.grain,lazy_range,&args))
+    result = dst;
+  plan_end(&plan,result.data!=NULL);
+  free(args.scratch);
+ErrorScratch:
+  release_pool(pool);
+  if(!result.data)
+    free_dst(&dst,given);
+ErrorMemory:
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Tiled map  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _tile_args
+{ MRData2D       *dst;
+  MRData2D       *src;
+  MRTileFunction  f;
+  void           *ctx;
+  size_t          halo;
+  size_t          tw,th;     ///< tile size
+  size_t          ntx;       ///< tiles per row of tiles
+  char           *scratch;   ///< per-worker copy of a tile and its halo
+  size_t          bytesof_scratch;
+} TileArgs;
+
+/** Picks a tile size so that a tile of input plus its halo and a tile of
+    output fit in \c MR_TILE_BYTES.  Tiles are kept wide, since rows are
+    contiguous in memory, but not wider than \c MR_TILE_ROW_BYTES so that
+    tall narrow images still yield several tiles.
+ */
+static void tile_size(TileArgs *a)
+{ const size_t se = a->src->bytesof_elem,
+               de = a->dst->bytesof_elem,
+               h2 = 2*a->halo;
+  size_t tw,th;
+  Mutex_Lock(&_lock);
+  tw = _tile_w;
+  th = _tile_h;
+  Mutex_Unlock(&_lock);
+  if(!tw)
+  { tw = MR_TILE_ROW_BYTES/(se>de?se:de);
+    if(tw<8) tw=8;
+  }
+  if(tw>a->src->width) tw=a->src->width;
+  if(!th)
+  { size_t row = (tw+h2)*se+tw*de;
+    th = MR_TILE_BYTES/row;
+    th = (th>h2)?th-h2:1;
+  }
+  if(th>a->src->height) th=a->src->height;
+  a->tw  = tw?tw:1;
+  a->th  = th?th:1;
+  a->ntx = (a->src->width+a->tw-1)/a->tw;
+}
+
+static size_t clampi(long v, size_t n)
+{ return v<0?0:((size_t)v>=n?n-1:(size_t)v);
+}
+
+/** Copies the tile at (x,y) and its halo into \a buf, replicating edge
+    elements outside the image.
+ */
+static void gather_tile(const MRData2D *src, size_t x, size_t y, size_t w, size_t h, size_t halo, char *buf)
+{ const size_t se = src->bytesof_elem,
+               bw = w+2*halo;
+  long r,c;
+  for(r=-(long)halo;r<(long)(h+halo);++r)
+  { const char *row = src->data+clampi((long)y+r,src->height)*src->stride;
+    char *out = buf+(r+halo)*bw*se;
+    long c0 = -(long)halo, c1 = (long)(w+halo);
+    // interior run in one copy, edges element by element
+    long lo = (long)x+c0<0?-(long)x:c0,
+         hi = (long)x+c1>(long)src->width?(long)(src->width-x):c1;
+    for(c=c0;c<lo;++c)
+      memcpy(out+(c-c0)*se,row+clampi((long)x+c,src->width)*se,se);
+    memcpy(out+(lo-c0)*se,row+(x+lo)*se,(hi-lo)*se);
+    for(c=hi;c<c1;++c)
+      memcpy(out+(c-c0)*se,row+clampi((long)x+c,src->width)*se,se);
+  }
+}
+
+/** Runs tiles [beg,end) in row-major tile order. */
+static int tile_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ TileArgs *a = (TileArgs*)args_;
+  size_t i;
+  for(i=beg;i<end;++i)
+  { MRTile t;
+    t.x = (i%a->ntx)*a->tw;
+    t.y = (i/a->ntx)*a->th;
+    t.w = (t.x+a->tw<=a->src->width )?a->tw:a->src->width -t.x;
+    t.h = (t.y+a->th<=a->src->height)?a->th:a->src->height-t.y;
+    t.halo       = a->halo;
+    t.dst        = a->dst->data+t.y*a->dst->stride+t.x*a->dst->bytesof_elem;
+    t.dst_stride = a->dst->stride;
+    t.worker     = worker;
+    if(a->halo)
+    { char *buf = a->scratch+worker*a->bytesof_scratch;
+      gather_tile(a->src,t.x,t.y,t.w,t.h,a->halo,buf);
+      t.src_stride = (t.w+2*a->halo)*a->src->bytesof_elem;
+      t.src        = buf+a->halo*t.src_stride+a->halo*a->src->bytesof_elem;
+    } else
+    { t.src_stride = a->src->stride;
+      t.src        = a->src->data+t.y*a->src->stride+t.x*a->src->bytesof_elem;
+    }
+    if(a->f(&t,a->ctx))
+      return 1;
+  }
+  return 0;
+}
+
+/** Applies \a f to \a src one tile at a time.
+
+    Tiles are sized to stay resident in L2 (see MRSetTileSize()) and are
+    scheduled like the chunks of map().
+
+    \param dst  The output.  If \c data is NULL, a packed array the size of
+                \a src is allocated.  Otherwise it must be at least as large
+                as \a src.
+    \param halo Number of neighbouring elements \a f may read around each
+                tile.  When non-zero, each tile is first copied with its
+                halo into a per-worker buffer, replicating the image edges.
+    \return \a dst on success, otherwise an MRData2D with \c data set to NULL.
+ */
+MRData2D map_tiled(MRData2D dst, MRData2D src, MRTileFunction f, size_t halo, void *ctx)
+{ ThreadPool *pool;
+  unsigned nworkers;
+  size_t ntiles;
+  void *given = dst.data;
+  TileArgs args;
+  MRData2D result = {NULL,0,0,0,0};
+
+  TRY(dst.bytesof_elem>0 && src.bytesof_elem>0,ErrorMemory);
+  if(dst.data)
+    TRY(dst.width>=src.width && dst.height>=src.height,ErrorMemory);
+  else
+  { dst.width  = src.width;
+    dst.height = src.height;
+    dst.stride = dst.width*dst.bytesof_elem;
+    TRY(dst.data=(char*)malloc(dst.stride*dst.height),ErrorMemory);
+  }
+  if(!src.width || !src.height)
+    return dst;
+  memset(&args,0,sizeof(args));
+  args.dst  = &dst;
+  args.src  = &src;
+  args.f    = f;
+  args.ctx  = ctx;
+  args.halo = halo;
+  tile_size(&args);
+  ntiles = args.ntx*((src.height+args.th-1)/args.th);
+
+  pool = acquire_pool(&nworkers);
+  if(halo)
+  { args.bytesof_scratch = (args.tw+2*halo)*(args.th+2*halo)*src.bytesof_elem;
+    TRY(args.scratch=(char*)malloc(nworkers*args.bytesof_scratch),ErrorScratch);
+  }
+  TRY(0==Sched_For(pool,nworkers,ntiles,1,tile_range,&args),ErrorApply);
+  result = dst;
+ErrorApply:
+  free(args.scratch);
+ErrorScratch:
+  release_pool(pool);
+  if(!result.data && dst.data!=given)
+    MRRelease2D(&dst);
+ErrorMemory:
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Fold       ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _fold_args
+{ MRData             *src;
+  MRFunction          f;
+  MRSpanFoldFunction  span;          ///< used instead of \c f when set
+  void               *ctx;
+  MRFunction          combine;
+  char               *partials;      ///< one accumulator per chunk or per worker
+  size_t              bytesof_acc;
+  size_t              grain;
+  size_t              stride;        ///< tree level: partial i absorbs partial i+stride
+  int                 per_worker;    ///< index partials by worker instead of by chunk
+} FoldArgs;
+
+static int fold_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ FoldArgs *args = (FoldArgs*)args_;
+  const size_t se = args->src->bytesof_elem;
+  MRFunction f = args->f;
+  char *acc = args->partials+args->bytesof_acc*(args->per_worker?worker:beg/args->grain),
+       *s   = args->src->data+beg*se,
+       *e   = args->src->data+end*se;
+  if(args->span)
+    return args->span(acc,s,end-beg,args->ctx);
+  for(;s<e;s+=se)
+    if(f(acc,s))
+      return 1;
+  return 0;
+}
+
+/** Pair \a i of a tree level: partial 2*i*stride absorbs 2*i*stride+stride. */
+static int fold_combine(size_t beg, size_t end, unsigned worker, void *args_)
+{ FoldArgs *args = (FoldArgs*)args_;
+  size_t i;
+  for(i=beg;i<end;++i)
+  { size_t a = 2*i*args->stride;
+    if(args->combine(args->partials+ a             *args->bytesof_acc,
+                     args->partials+(a+args->stride)*args->bytesof_acc))
+      return 1;
+  }
+  return 0;
+}
+
+/** Combines \a n partial results in a log-depth tree, preserving order.
+    The result ends up in the first partial.
+ */
+static int fold_tree(ThreadPool *pool, unsigned nworkers, FoldArgs *args, size_t n)
+{ for(args->stride=1;args->stride<n;args->stride*=2)
+  { size_t npairs = (n-args->stride+2*args->stride-1)/(2*args->stride);
+    if(Sched_For(pool,nworkers,npairs,1,fold_combine,args))
+      return 1;
+  }
+  return 0;
+}
+
+MRData foldl(MRData dst, MRData src, MRFunction f)
+{ return foldl_ex(dst,src,f,NULL,MR_FOLD_ASSOCIATIVE);
+}
+
+/** Folds \a src into \a dst using the functions set in \a args.
+    \a args supplies the fold and combine functions; everything else is
+    filled in here.
+ */
+static MRData fold_chunks(MRData dst, MRData src, FoldArgs *args, MRFoldMode mode)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  size_t n,nparts;
+  void *given = dst.data;
+  MRData result = {NULL,0,0};
+
+  TRY(dst.bytesof_elem>0,ErrorMemory);
+  if(!dst.data)
+  { TRY(dst.data=(char*)calloc(1,dst.bytesof_elem),ErrorMemory);
+    dst.bytesof_data=dst.bytesof_elem;
+  }
+  n = src.bytesof_data/src.bytesof_elem;
+  args->src         = &src;
+  args->bytesof_acc = dst.bytesof_elem;
+
+  if(mode==MR_FOLD_STRICT)
+  { args->partials = dst.data;
+    args->grain    = n?n:1;
+    TRY(0==fold_range(0,n,0,args),ErrorApply);
+    return dst;
+  }
+
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,args->f?(const void*)args->f:(const void*)args->span,
+             n,src.bytesof_elem,nworkers);
+  nworkers    = plan.nworkers;
+  args->grain = plan.grain;
+  if(mode==MR_FOLD_COMMUTATIVE)
+  { args->per_worker = 1;
+    nparts = nworkers;
+  } else
+  { nparts = (n+args->grain-1)/args->grain;
+    if(nparts>MR_MAX_FOLD_PARTIALS)
+    { args->grain = (n+MR_MAX_FOLD_PARTIALS-1)/MR_MAX_FOLD_PARTIALS;
+      nparts      = (n+args->grain-1)/args->grain;
+    }
+  }
+  if(nparts<1) nparts=1;
+  TRY(args->partials=(char*)malloc(nparts*args->bytesof_acc),ErrorPartials);
+  { size_t i;
+    for(i=0;i<nparts;++i)
+      memcpy(args->partials+i*args->bytesof_acc,dst.data,args->bytesof_acc);
+  }
+  TRY(0==Sched_For(pool,nworkers,n,args->grain,fold_range,args),ErrorFold);
+  TRY(0==fold_tree(pool,nworkers,args,nparts),ErrorFold);
+  memcpy(dst.data,args->partials,args->bytesof_acc);
+  result = dst;
+ErrorFold:
+  free(args->partials);
+ErrorPartials:
+  plan_end(&plan,result.data!=NULL);
+  release_pool(pool);
+  if(!result.data)
+    free_dst(&dst,given);
+  return result;
+ErrorApply:
+  free_dst(&dst,given);
+ErrorMemory:
+  return result;
+}
+
+/** Folds \a src into the single accumulator described by \a dst.
+
+    \param dst     The accumulator.  \c bytesof_elem is its size.  It must
+                   hold an identity for \a f unless \a mode is
+                   \ref MR_FOLD_STRICT.  If \c data is NULL, a zero-filled
+                   accumulator is allocated.
+    \param src     The elements to fold.
+    \param f       Folds one element into an accumulator.
+    \param combine Folds one accumulator into another.  If NULL, \a f is
+                   used, which requires elements and accumulators to have the
+                   same type.
+    \param mode    See \ref MRFoldMode.
+    \return \a dst on success, otherwise an MRData with \c data set to NULL.
+ */
+MRData foldl_ex(MRData dst, MRData src, MRFunction f, MRFunction combine, MRFoldMode mode)
+{ FoldArgs args;
+  memset(&args,0,sizeof(args));
+  args.f       = f;
+  args.combine = combine?combine:f;
+  return fold_chunks(dst,src,&args,mode);
+}
+
+MRData foldl_span(MRData dst, MRData src, MRSpanFoldFunction f, MRFunction combine, MRFoldMode mode, void *ctx)
+{ FoldArgs args;
+  MRData result = {NULL,0,0};
+  TRY(combine || mode==MR_FOLD_STRICT,Error);
+  memset(&args,0,sizeof(args));
+  args.span    = f;
+  args.ctx     = ctx;
+  args.combine = combine;
+  return fold_chunks(dst,src,&args,mode);
+Error:
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Scan       ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+int MRAdd_I32(void *acc, void *x) { *(int      *)acc += *(int      *)x; return 0; }
+int MRAdd_I64(void *acc, void *x) { *(long long*)acc += *(long long*)x; return 0; }
+int MRAdd_F32(void *acc, void *x) { *(float    *)acc += *(float    *)x; return 0; }
+int MRAdd_F64(void *acc, void *x) { *(double   *)acc += *(double   *)x; return 0; }
+
+typedef struct _scan_args
+{ MRData     *dst;
+  MRData     *src;
+  MRFunction  op;
+  MRScanMode  mode;
+  char       *partials;  ///< per chunk: its total after pass 1, its prefix after the middle scan
+  char       *tmp;       ///< one element per worker for in-place exclusive scans
+  size_t      grain;
+} ScanArgs;
+
+/* Typed addition loops used when op is one of the MRAdd functions.  They
+   avoid an indirect call per element and let the compiler keep the
+   accumulator in a register.
+*/
+#define SCAN_TYPED(T,fn)                                              \
+  if(a->op==fn)                                                       \
+  { const T *s = (const T*)a->src->data+beg;                          \
+    T       *d = (T*)a->dst->data+beg;                                \
+    T acc = *(T*)p;                                                   \
+    size_t i;                                                         \
+    if(!apply)             for(i=0;i<end-beg;++i) acc+=s[i];          \
+    else if(inclusive)     for(i=0;i<end-beg;++i) d[i]=(acc+=s[i]);   \
+    else                   for(i=0;i<end-beg;++i) { T x=s[i]; d[i]=acc; acc+=x; } \
+    if(!apply) *(T*)p = acc;                                          \
+    return 0;                                                         \
+  }
+
+/** Pass 1 (\a apply is 0) totals a chunk into its partial.  Pass 2 scans
+    the chunk starting from its prefix.
+ */
+static int scan_chunk(ScanArgs *a, size_t beg, size_t end, unsigned worker, int apply)
+{ const size_t se = a->src->bytesof_elem;
+  const int inclusive = (a->mode==MR_SCAN_INCLUSIVE);
+  char *p = a->partials+(beg/a->grain)*se;
+  SCAN_TYPED(int,      MRAdd_I32)
+  SCAN_TYPED(long long,MRAdd_I64)
+  SCAN_TYPED(float,    MRAdd_F32)
+  SCAN_TYPED(double,   MRAdd_F64)
+  { char *s = a->src->data+beg*se,
+         *e = a->src->data+end*se,
+         *d = a->dst->data+beg*se,
+         *x = a->tmp+worker*se;
+    if(!apply)
+    { for(;s<e;s+=se)
+        if(a->op(p,s)) return 1;
+      return 0;
+    }
+    // p is the running total from here on; this chunk doesn't need it again
+    for(;s<e;s+=se,d+=se)
+    { if(inclusive)
+      { if(a->op(p,s)) return 1;
+        memcpy(d,p,se);
+      } else
+      { memcpy(x,s,se);  // s may be d
+        memcpy(d,p,se);
+        if(a->op(p,x)) return 1;
+      }
+    }
+  }
+  return 0;
+}
+#undef SCAN_TYPED
+
+static int scan_reduce_range(size_t beg, size_t end, unsigned worker, void *args)
+{ return scan_chunk((ScanArgs*)args,beg,end,worker,0);
+}
+
+static int scan_apply_range(size_t beg, size_t end, unsigned worker, void *args)
+{ return scan_chunk((ScanArgs*)args,beg,end,worker,1);
+}
+
+/** Classic two-pass blocked scan.
+
+    Every chunk but the last is totalled in parallel.  The chunk totals are
+    then scanned serially, leaving each chunk's prefix in its partial, and
+    finally every chunk is scanned in parallel starting from its prefix.
+    The number of chunks is capped like an associative fold's, so the
+    serial middle step stays small.
+ */
+MRData scan(MRData dst, MRData src, MRFunction op, const void *identity, MRScanMode mode)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  size_t n,nchunks,se,i;
+  void *given = dst.data;
+  ScanArgs args;
+  MRData result = {NULL,0,0};
+
+  TRY(op && src.bytesof_elem>0 && dst.bytesof_elem==src.bytesof_elem,ErrorMemory);
+  TRY(maybe_alloc_dst(&dst,&src),ErrorMemory);
+  se = src.bytesof_elem;
+  n  = src.bytesof_data/se;
+  memset(&args,0,sizeof(args));
+  args.dst  = &dst;
+  args.src  = &src;
+  args.op   = op;
+  args.mode = mode;
+
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,(const void*)op,n,2*se,nworkers);
+  args.grain = plan.grain;
+  nchunks    = n?(n+args.grain-1)/args.grain:1;
+  if(nchunks>MR_MAX_FOLD_PARTIALS)
+  { args.grain = (n+MR_MAX_FOLD_PARTIALS-1)/MR_MAX_FOLD_PARTIALS;
+    nchunks    = (n+args.grain-1)/args.grain;
+  }
+  TRY(args.partials=(char*)malloc((nchunks+1)*se),ErrorPartials);
+  TRY(args.tmp=(char*)malloc(plan.nworkers*se),ErrorTmp);
+  for(i=0;i<=nchunks;++i)
+    if(identity) memcpy(args.partials+i*se,identity,se);
+    else         memset(args.partials+i*se,0,se);
+  // pass 1: the last chunk's total is never needed
+  if(nchunks>1)
+    TRY(0==Sched_For(pool,plan.nworkers,(nchunks-1)*args.grain,args.grain,scan_reduce_range,&args),ErrorApply);
+  // exclusive scan of the totals: partial[i] <- identity+total[0..i)
+  { char *carry = args.partials+nchunks*se; // spare slot, holds the identity
+    for(i=0;i<nchunks;++i)
+    { char *p = args.partials+i*se;
+      memcpy(args.tmp,p,se);
+      memcpy(p,carry,se);
+      TRY(0==op(carry,args.tmp),ErrorApply);
+    }
+  }
+  // pass 2
+  TRY(0==Sched_For(pool,plan.nworkers,n,args.grain,scan_apply_range,&args),ErrorApply);
+  result = dst;
+ErrorApply:
+  free(args.tmp);
+ErrorTmp:
+  free(args.partials);
+ErrorPartials:
+  plan_end(&plan,result.data!=NULL);
+  release_pool(pool);
+  if(!result.data)
+    free_dst(&dst,given);
+ErrorMemory:
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Sort       ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+#define MR_RADIX_MAX_CHUNKS 256 // bounds the per-chunk histograms
+
+typedef struct _sort_args
+{ char      *src;     ///< runs being merged
+  char      *dst;
+  size_t     n;
+  size_t     se;
+  size_t     run;     ///< width of the sorted runs in src
+  size_t     grain;
+  MRCompare  cmp;
+} SortArgs;
+
+static int sort_runs(size_t beg, size_t end, unsigned worker, void *args_)
+{ SortArgs *a = (SortArgs*)args_;
+  qsort(a->src+beg*a->se,end-beg,a->se,a->cmp);
+  return 0;
+}
+
+/** Number of elements of the first run that come before output position
+    \a k when runs \a A (length \a m) and \a B (length \a nb) are merged.
+    Ties go to \a A.
+ */
+static size_t co_rank(const SortArgs *a, size_t k, const char *A, size_t m, const char *B, size_t nb)
+{ size_t lo = (k>nb)?k-nb:0,
+         hi = (k<m)?k:m;
+  while(lo<hi)
+  { size_t i = lo+(hi-lo)/2,
+           j = k-i;
+    if(j>0 && a->cmp(A+i*a->se,B+(j-1)*a->se)<=0)
+      lo=i+1;
+    else
+      hi=i;
+  }
+  return lo;
+}
+
+/** Writes output positions [beg,end) of one round of pairwise merges. */
+static int merge_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ SortArgs *a = (SortArgs*)args_;
+  const size_t se = a->se, w = a->run;
+  while(beg<end)
+  { size_t p0 = beg-beg%(2*w),                     // the pair holding beg
+           m  = (p0+w<a->n)?w:a->n-p0,             // left run length
+           nb = (p0+2*w<a->n)?w:a->n-p0-m,         // right run length
+           o0 = beg-p0,
+           o1 = ((end<p0+m+nb)?end:p0+m+nb)-p0,
+           i,j,ie,je;
+    const char *A = a->src+p0*se,
+               *B = A+m*se;
+    char *d = a->dst+beg*se;
+    i  = co_rank(a,o0,A,m,B,nb); j  = o0-i;
+    ie = co_rank(a,o1,A,m,B,nb); je = o1-ie;
+    while(i<ie && j<je)
+    { if(a->cmp(A+i*se,B+j*se)<=0) { memcpy(d,A+i*se,se); ++i; }
+      else                         { memcpy(d,B+j*se,se); ++j; }
+      d+=se;
+    }
+    memcpy(d,A+i*se,(ie-i)*se); d+=(ie-i)*se;
+    memcpy(d,B+j*se,(je-j)*se);
+    beg = p0+o1;
+  }
+  return 0;
+}
+
+int mr_sort(MRData data, MRCompare cmp)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  SortArgs args;
+  char *tmp;
+  int err=1;
+  TRY(cmp && data.bytesof_elem>0,ErrorArgs);
+  memset(&args,0,sizeof(args));
+  args.se  = data.bytesof_elem;
+  args.n   = data.bytesof_data/args.se;
+  args.cmp = cmp;
+  if(args.n<2) return 0;
+  TRY(tmp=(char*)malloc(args.n*args.se),ErrorArgs);
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,(const void*)cmp,args.n,2*args.se,nworkers);
+  args.grain = plan.grain;
+  args.src   = data.data;
+  args.dst   = tmp;
+  TRY(0==Sched_For(pool,plan.nworkers,args.n,args.grain,sort_runs,&args),Error);
+  for(args.run=args.grain;args.run<args.n;args.run*=2)
+  { char *t;
+    TRY(0==Sched_For(pool,plan.nworkers,args.n,args.grain,merge_range,&args),Error);
+    t=args.src; args.src=args.dst; args.dst=t;
+  }
+  if(args.src!=data.data)
+    memcpy(data.data,args.src,args.n*args.se);
+  err=0;
+Error:
+  plan_end(&plan,!err);
+  release_pool(pool);
+  free(tmp);
+ErrorArgs:
+  return err;
+}
+
+/* Radix sort works on (key,index) pairs so that large records are only
+   moved once, by a final gather.
+*/
+typedef struct _radix_item
+{ unsigned long long key;
+  size_t             index;
+} radix_item_t;
+
+typedef struct _radix_args
+{ MRData        *data;
+  MRKeyFunction  key;
+  radix_item_t  *items[2];
+  int            cur;        ///< items[cur] holds the current order
+  size_t         grain;
+  size_t        *counts;     ///< 256 per chunk; offsets after the scan
+  unsigned       shift;
+  char          *out;
+} RadixArgs;
+
+static int radix_keys(size_t beg, size_t end, unsigned worker, void *args_)
+{ RadixArgs *a = (RadixArgs*)args_;
+  const size_t se = a->data->bytesof_elem;
+  radix_item_t *it = a->items[0];
+  size_t i;
+  for(i=beg;i<end;++i)
+  { it[i].key   = a->key(a->data->data+i*se);
+    it[i].index = i;
+  }
+  return 0;
+}
+
+static int radix_count(size_t beg, size_t end, unsigned worker, void *args_)
+{ RadixArgs *a = (RadixArgs*)args_;
+  const radix_item_t *it = a->items[a->cur];
+  size_t *c = a->counts+256*(beg/a->grain),i;
+  memset(c,0,256*sizeof(size_t));
+  for(i=beg;i<end;++i)
+    ++c[(it[i].key>>a->shift)&0xff];
+  return 0;
+}
+
+static int radix_scatter(size_t beg, size_t end, unsigned worker, void *args_)
+{ RadixArgs *a = (RadixArgs*)args_;
+  const radix_item_t *in = a->items[a->cur];
+  radix_item_t *out = a->items[!a->cur];
+  size_t *c = a->counts+256*(beg/a->grain),i;
+  for(i=beg;i<end;++i)
+    out[c[(in[i].key>>a->shift)&0xff]++] = in[i];
+  return 0;
+}
+
+static int radix_gather(size_t beg, size_t end, unsigned worker, void *args_)
+{ RadixArgs *a = (RadixArgs*)args_;
+  const size_t se = a->data->bytesof_elem;
+  const radix_item_t *it = a->items[a->cur];
+  size_t i;
+  for(i=beg;i<end;++i)
+    memcpy(a->out+i*se,a->data->data+it[i].index*se,se);
+  return 0;
+}
+
+int mr_sort_by_key(MRData data, MRKeyFunction key)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  RadixArgs args;
+  size_t n,nchunks;
+  int err=1;
+  TRY(key && data.bytesof_elem>0,ErrorArgs);
+  n = data.bytesof_data/data.bytesof_elem;
+  if(n<2) return 0;
+  memset(&args,0,sizeof(args));
+  args.data = &data;
+  args.key  = key;
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,(const void*)key,n,2*sizeof(radix_item_t),nworkers);
+  args.grain = plan.grain;
+  nchunks    = (n+args.grain-1)/args.grain;
+  if(nchunks>MR_RADIX_MAX_CHUNKS)
+  { args.grain = (n+MR_RADIX_MAX_CHUNKS-1)/MR_RADIX_MAX_CHUNKS;
+    nchunks    = (n+args.grain-1)/args.grain;
+  }
+  TRY(args.items[0]=(radix_item_t*)malloc(n*sizeof(radix_item_t)),Error);
+  TRY(args.items[1]=(radix_item_t*)malloc(n*sizeof(radix_item_t)),Error);
+  TRY(args.counts=(size_t*)malloc(nchunks*256*sizeof(size_t)),Error);
+  TRY(args.out=(char*)malloc(data.bytesof_data),Error);
+  TRY(0==Sched_For(pool,plan.nworkers,n,args.grain,radix_keys,&args),Error);
+  for(args.shift=0;args.shift<64;args.shift+=8)
+  { size_t d,c,total=0;
+    TRY(0==Sched_For(pool,plan.nworkers,n,args.grain,radix_count,&args),Error);
+    // digit-major exclusive scan: chunk c's bucket d starts after every
+    // smaller digit and after bucket d of earlier chunks
+    for(d=0;d<256;++d)
+      for(c=0;c<nchunks;++c)
+      { size_t k = args.counts[256*c+d];
+        args.counts[256*c+d] = total;
+        total += k;
+      }
+    { size_t first = (args.items[args.cur][0].key>>args.shift)&0xff;
+      if(args.counts[first]==0 && (first==255 || args.counts[first+1]==n))
+        continue; // every key has the same digit here
+    }
+    TRY(0==Sched_For(pool,plan.nworkers,n,args.grain,radix_scatter,&args),Error);
+    args.cur = !args.cur;
+  }
+  TRY(0==Sched_For(pool,plan.nworkers,n,args.grain,radix_gather,&args),Error);
+  memcpy(data.data,args.out,data.bytesof_data);
+  err=0;
+Error:
+  plan_end(&plan,!err);
+  release_pool(pool);
+  free(args.items[0]);
+  free(args.items[1]);
+  free(args.counts);
+  free(args.out);
+ErrorArgs:
+  return err;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Map-reduce by key  ///////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+#define MR_KV_MAX_PARTITIONS 1024
+#define MR_KV_PARTITION_BYTES MR_TILE_BYTES // target pairs per partition, in bytes
+
+typedef unsigned long long mr_key_t;
+
+typedef struct _kv_buffer
+{ char   *data;
+  size_t  n,cap;   // in records
+} kv_buffer_t;
+
+struct _mr_emitter
+{ kv_buffer_t *parts;       // this worker's buffer for each partition
+  size_t       bytesof_rec;
+  size_t       bytesof_value;
+  unsigned     bits;        // log2 of the partition count
+};
+
+typedef struct _kv_args
+{ MRData          *src;
+  MRMapKVFunction  map;
+  MRFunction       combine;
+  void            *ctx;
+  MREmitter       *emitters;  // one per worker
+  unsigned         nworkers;
+  unsigned         nparts;
+  kv_buffer_t     *reduced;   // one per partition
+} KVArgs;
+
+static mr_key_t kv_hash(mr_key_t k)
+{ k ^= k>>33; k *= 0xff51afd7ed558ccdULL;
+  k ^= k>>33; k *= 0xc4ceb9fe1a85ec53ULL;
+  return k^(k>>33);
+}
+
+int MREmit(MREmitter *e, mr_key_t key, const void *value)
+{ kv_buffer_t *b = e->parts+(e->bits?kv_hash(key)>>(64-e->bits):0); // top bits pick the partition
+  char *r;
+  if(b->n==b->cap)
+  { size_t c = b->cap?2*b->cap:64;
+    char *d;
+    TRY(d=(char*)realloc(b->data,c*e->bytesof_rec),Error);
+    b->data = d;
+    b->cap  = c;
+  }
+  r = b->data+b->n++*e->bytesof_rec;
+  *(mr_key_t*)r = key;
+  memcpy(r+sizeof(mr_key_t),value,e->bytesof_value);
+  return 0;
+Error:
+  return 1;
+}
+
+static int kv_map_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ KVArgs *a = (KVArgs*)args_;
+  const size_t se = a->src->bytesof_elem;
+  MREmitter *e = a->emitters+worker;
+  size_t i;
+  for(i=beg;i<end;++i)
+    if(a->map(e,a->src->data+i*se,a->ctx))
+      return 1;
+  return 0;
+}
+
+/** Reduces partitions [beg,end).  Pairs from every worker's buffer for the
+    partition go through an open-addressed table keyed on the low hash
+    bits, and the distinct records are left packed in \c reduced.
+ */
+static int kv_reduce_range(size_t beg, size_t end, unsigned worker, void *args_)
+{ KVArgs *a = (KVArgs*)args_;
+  const size_t rs = a->emitters[0].bytesof_rec;
+  size_t p;
+  for(p=beg;p<end;++p)
+  { kv_buffer_t *out = a->reduced+p;
+    size_t total=0,cap=16,mask,*slot,w,i;
+    for(w=0;w<a->nworkers;++w)
+      total += a->emitters[w].parts[p].n;
+    if(!total) continue;
+    while(cap<2*total) cap*=2;
+    mask = cap-1;
+    TRY(slot=(size_t*)malloc(cap*sizeof(size_t)),Error); // record index+1, 0 is empty
+    memset(slot,0,cap*sizeof(size_t));
+    if(!(out->data=(char*)malloc(total*rs)))
+    { free(slot);
+      goto Error;
+    }
+    for(w=0;w<a->nworkers;++w)
+    { const kv_buffer_t *b = a->emitters[w].parts+p;
+      for(i=0;i<b->n;++i)
+      { const char *r = b->data+i*rs;
+        mr_key_t k = *(const mr_key_t*)r;
+        size_t h = (size_t)kv_hash(k)&mask;
+        while(slot[h] && *(mr_key_t*)(out->data+(slot[h]-1)*rs)!=k)
+          h=(h+1)&mask;
+        if(slot[h])
+        { if(a->combine(out->data+(slot[h]-1)*rs+sizeof(mr_key_t),(void*)(r+sizeof(mr_key_t))))
+          { free(slot);
+            return 1;
+          }
+        } else
+        { memcpy(out->data+out->n*rs,r,rs);
+          slot[h] = ++out->n;
+        }
+      }
+    }
+    free(slot);
+  }
+  return 0;
+Error:
+  return 1;
+}
+
+MRData map_reduce_by_key(MRData src, size_t bytesof_value, MRMapKVFunction map, MRFunction combine, void *ctx)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers,bits=0,w;
+  size_t n,p,total;
+  KVArgs args;
+  MRData result = {NULL,0,0};
+
+  TRY(map && combine && src.bytesof_elem>0,ErrorArgs);
+  n = src.bytesof_data/src.bytesof_elem;
+  memset(&args,0,sizeof(args));
+  args.src     = &src;
+  args.map     = map;
+  args.combine = combine;
+  args.ctx     = ctx;
+
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,(const void*)map,n,src.bytesof_elem+MRKeyValueBytes(bytesof_value),nworkers);
+  args.nworkers = plan.nworkers;
+  // enough partitions to balance the reducers and, assuming about one pair
+  // per element, to keep each partition's table in cache
+  while((1u<<bits)<4*args.nworkers
+        || ((1u<<bits)<MR_KV_MAX_PARTITIONS
+            && n*MRKeyValueBytes(bytesof_value)/(1u<<bits)>MR_KV_PARTITION_BYTES))
+    ++bits;
+  args.nparts = 1u<<bits;
+  TRY(args.emitters=(MREmitter*)calloc(args.nworkers,sizeof(MREmitter)),Error);
+  TRY(args.reduced=(kv_buffer_t*)calloc(args.nparts,sizeof(kv_buffer_t)),Error);
+  for(w=0;w<args.nworkers;++w)
+  { MREmitter *e = args.emitters+w;
+    e->bytesof_rec   = MRKeyValueBytes(bytesof_value);
+    e->bytesof_value = bytesof_value;
+    e->bits          = bits;
+    TRY(e->parts=(kv_buffer_t*)calloc(args.nparts,sizeof(kv_buffer_t)),Error);
+  }
+  TRY(0==Sched_For(pool,plan.nworkers,n,plan.grain,kv_map_range,&args),Error);
+  TRY(0==Sched_For(pool,plan.nworkers,args.nparts,1,kv_reduce_range,&args),Error);
+
+  total = 0;
+  for(p=0;p<args.nparts;++p)
+    total += args.reduced[p].n;
+  result.bytesof_elem = MRKeyValueBytes(bytesof_value);
+  result.bytesof_data = total*result.bytesof_elem;
+  TRY(result.data=(char*)malloc(result.bytesof_data?result.bytesof_data:1),Error);
+  { char *d = result.data;
+    for(p=0;p<args.nparts;++p)
+    { size_t bytes = args.reduced[p].n*result.bytesof_elem;
+      memcpy(d,args.reduced[p].data,bytes);
+      d += bytes;
+    }
+  }
+Error:
+  plan_end(&plan,result.data!=NULL);
+  release_pool(pool);
+  if(args.emitters)
+    for(w=0;w<args.nworkers;++w)
+    { if(args.emitters[w].parts)
+        for(p=0;p<args.nparts;++p)
+          free(args.emitters[w].parts[p].data);
+      free(args.emitters[w].parts);
+    }
+  if(args.reduced)
+    for(p=0;p<args.nparts;++p)
+      free(args.reduced[p].data);
+  free(args.emitters);
+  free(args.reduced);
+  if(!result.data)
+    memset(&result,0,sizeof(result));
+ErrorArgs:
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Filter and flat map  /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+/* Both work in two parallel passes around a scan.  Pass 1 processes each
+   chunk and counts its outputs.  An exclusive scan of the counts gives
+   each chunk's offset in the packed result, and pass 2 writes each chunk's
+   outputs there.  The filter keeps a flag per element so the predicate
+   runs once; the flat map keeps each chunk's outputs in a buffer of its
+   own.
+*/
+typedef struct _compact_args
+{ MRData            *dst;
+  MRData            *src;
+  MRPredicate        keep;
+  MRFlatMapFunction  f;
+  void              *ctx;
+  size_t             max_per_elem;
+  size_t             grain;
+  long long         *counts;   ///< outputs per chunk, then offsets
+  unsigned char     *flags;    ///< filter: one per element
+  kv_buffer_t       *bufs;     ///< flat map: outputs per chunk
+} CompactArgs;
+
+static int filter_count(size_t beg, size_t end, unsigned worker, void *args_)
+{ CompactArgs *a = (CompactArgs*)args_;
+  const size_t se = a->src->bytesof_elem;
+  long long c=0;
+  size_t i;
+  for(i=beg;i<end;++i)
+    c += (a->flags[i] = (a->keep(a->src->data+i*se,a->ctx)!=0));
+  a->counts[beg/a->grain] = c;
+  return 0;
+}
+
+static int filter_write(size_t beg, size_t end, unsigned worker, void *args_)
+{ CompactArgs *a = (CompactArgs*)args_;
+  const size_t se = a->src->bytesof_elem;
+  char *d = a->dst->data+a->counts[beg/a->grain]*se;
+  size_t i;
+  for(i=beg;i<end;++i)
+    if(a->flags[i])
+    { memcpy(d,a->src->data+i*se,se);
+      d+=se;
+    }
+  return 0;
+}
+
+static int flat_map_run(size_t beg, size_t end, unsigned worker, void *args_)
+{ CompactArgs *a = (CompactArgs*)args_;
+  const size_t se = a->src->bytesof_elem,
+               de = a->dst->bytesof_elem;
+  kv_buffer_t *b = a->bufs+beg/a->grain;
+  size_t i;
+  for(i=beg;i<end;++i)
+  { long k;
+    if(b->cap-b->n<a->max_per_elem)
+    { size_t c = 2*b->cap+a->max_per_elem;
+      char *d;
+      if(!(d=(char*)realloc(b->data,c*de)))
+        return 1;
+      b->data = d;
+      b->cap  = c;
+    }
+    k = a->f(b->data+b->n*de,a->src->data+i*se,a->ctx);
+    if(k<0 || (size_t)k>a->max_per_elem)
+      return 1;
+    b->n += k;
+  }
+  a->counts[beg/a->grain] = (long long)b->n;
+  return 0;
+}
+
+static int flat_map_write(size_t beg, size_t end, unsigned worker, void *args_)
+{ CompactArgs *a = (CompactArgs*)args_;
+  const size_t de = a->dst->bytesof_elem,
+               c  = beg/a->grain;
+  memcpy(a->dst->data+a->counts[c]*de,a->bufs[c].data,a->bufs[c].n*de);
+  return 0;
+}
+
+/** Runs pass 1, turns the counts into offsets and sizes \a dst, then runs
+    pass 2.  \a args must have everything but \c grain and \c counts set.
+ */
+static MRData compact(MRData dst, MRData src, CompactArgs *a, SchedRangeProc count, SchedRangeProc write, const void *key)
+{ ThreadPool *pool;
+  plan_t plan;
+  unsigned nworkers;
+  size_t n,nchunks,total;
+  void *given = dst.data;
+  MRData result = {NULL,0,0};
+
+  n = src.bytesof_data/src.bytesof_elem;
+  a->dst = &dst;
+  a->src = &src;
+  pool = acquire_pool(&nworkers);
+  plan_begin(&plan,key,n,src.bytesof_elem+dst.bytesof_elem,nworkers);
+  a->grain = plan.grain;
+  nchunks  = n?(n+a->grain-1)/a->grain:1;
+  if(nchunks>MR_MAX_FOLD_PARTIALS)
+  { a->grain = (n+MR_MAX_FOLD_PARTIALS-1)/MR_MAX_FOLD_PARTIALS;
+    nchunks  = (n+a->grain-1)/a->grain;
+  }
+  TRY(a->counts=(long long*)calloc(nchunks+1,sizeof(long long)),Error);
+  if(a->f)
+    TRY(a->bufs=(kv_buffer_t*)calloc(nchunks,sizeof(kv_buffer_t)),Error);
+  else
+    TRY(a->flags=(unsigned char*)malloc(n?n:1),Error);
+  TRY(0==Sched_For(pool,plan.nworkers,n,a->grain,count,a),Error);
+  { MRData c = MRPackage(a->counts,sizeof(long long),(nchunks+1)*sizeof(long long));
+    TRY(scan(c,c,MRAdd_I64,NULL,MR_SCAN_EXCLUSIVE).data,Error);
+  }
+  total = (size_t)a->counts[nchunks];
+  if(dst.data)
+    TRY(dst.bytesof_data>=total*dst.bytesof_elem,Error);
+  else
+    TRY(dst.data=(char*)malloc(total?total*dst.bytesof_elem:1),Error);
+  dst.bytesof_data = total*dst.bytesof_elem;
+  TRY(0==Sched_For(pool,plan.nworkers,n,a->grain,write,a),Error);
+  result = dst;
+Error:
+  plan_end(&plan,result.data!=NULL);
+  release_pool(pool);
+  if(a->bufs)
+  { size_t i;
+    for(i=0;i<nchunks;++i)
+      free(a->bufs[i].data);
+    free(a->bufs);
+  }
+  free(a->flags);
+  free(a->counts);
+  if(!result.data && dst.data && dst.data!=given)
+    free(dst.data);
+  return result;
+}
+
+MRData mr_filter(MRData dst, MRData src, MRPredicate keep, void *ctx)
+{ CompactArgs args;
+  MRData result = {NULL,0,0};
+  TRY(keep && src.bytesof_elem>0 && dst.bytesof_elem==src.bytesof_elem,Error);
+  if(dst.data)
+    TRY(dst.bytesof_data>=src.bytesof_data,Error);
+  memset(&args,0,sizeof(args));
+  args.keep = keep;
+  args.ctx  = ctx;
+  return compact(dst,src,&args,filter_count,filter_write,(const void*)keep);
+Error:
+  return result;
+}
+
+MRData mr_flat_map(MRData dst, MRData src, size_t max_per_elem, MRFlatMapFunction f, void *ctx)
+{ CompactArgs args;
+  MRData result = {NULL,0,0};
+  TRY(f && src.bytesof_elem>0 && dst.bytesof_elem>0,Error);
+  memset(&args,0,sizeof(args));
+  args.f            = f;
+  args.ctx          = ctx;
+  args.max_per_elem = max_per_elem;
+  return compact(dst,src,&args,flat_map_run,flat_map_write,(const void*)f);
+Error:
+  return result;
+}
@@ -6,19 +6,296 @@
     \todo Add a function type that accomidates "generic" types a bit
           better.  By "generic" type, I mean that the function is
           defined for variable width types.
-    \todo Add a function type that allows parameters to be passed 
-          in, etc...
  */
+#pragma once
+#include <stdlib.h>
+#include "chan.h"
+#include "thread.h"
 
-typedef struct _map_reduce_data MRData;
-typedef int (*MRFunction)(void *dst, void *src);
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+typedef struct _map_reduce_data
+{ char   *data;
+  size_t  bytesof_elem;
+  size_t  bytesof_data;
+} MRData;
+typedef int (*MRFunction)(void *dst, void *src); ///< Return 0 on success.
+
+/** Describes a 2D array, such as an image, for map_tiled(). */
+typedef struct _map_reduce_data_2d
+{ char   *data;
+  size_t  bytesof_elem;
+  size_t  width;        ///< in elements
+  size_t  height;       ///< in rows
+  size_t  stride;       ///< bytes from one row to the next
+} MRData2D;
+
+/** One operand of map_n(): \c count elements, \c stride bytes apart. */
+typedef struct _map_reduce_strided
+{ char   *data;
+  size_t  bytesof_elem;
+  size_t  stride;       ///< bytes from one element to the next
+  size_t  count;        ///< in elements
+} MRStrided;
+
+/** Maps \a n elements from each of the map_n() operands \a src[k], whose
+    elements are \a src_strides[k] bytes apart, to \a dst.  Return 0 on
+    success.
+ */
+typedef int (*MRStridedFunction)(void *dst, size_t dst_stride, const void *const *src, const size_t *src_strides, size_t n, void *ctx);
+
+/** One tile of a map_tiled() call.
+
+    \c src and \c dst point at element (x,y) of their arrays.  If a halo was
+    requested, \c src may also be read up to \c halo elements beyond each
+    edge of the tile: <tt>src[-halo..w+halo)</tt> along a row and rows
+    <tt>-halo..h+halo)</tt>.  Outside the image the nearest edge element is
+    replicated, so stencils need no special border handling.
+ */
+typedef struct _mr_tile
+{ size_t      x,y,w,h;     ///< region of the output covered by the tile
+  size_t      halo;
+  const char *src;
+  size_t      src_stride;  ///< bytes
+  char       *dst;
+  size_t      dst_stride;  ///< bytes
+  unsigned    worker;      ///< in [0,number of workers), for per-worker state
+} MRTile;
+typedef int (*MRTileFunction)(const MRTile *tile, void *ctx); ///< Return 0 on success.
+
+/** Maps \a n consecutive elements from \a src to \a dst.  Called once per
+    chunk, so the loop over elements is the function's own and can be
+    vectorized.  \a ctx is passed through from map_span().  Return 0 on
+    success.
+ */
+typedef int (*MRSpanFunction)(void *dst, const void *src, size_t n, void *ctx);
+
+/** Folds \a n consecutive elements from \a src into the accumulator
+    \a acc.  The span counterpart of an MRFunction for foldl_span().
+    Return 0 on success.
+ */
+typedef int (*MRSpanFoldFunction)(void *acc, const void *src, size_t n, void *ctx);
+
+/** How foldl_ex() may rearrange a reduction. */
+typedef enum _mr_fold_mode
+{ MR_FOLD_ASSOCIATIVE=0, ///< Regroup freely but keep the element order.  Chunks are folded in parallel and combined in order.
+  MR_FOLD_COMMUTATIVE,   ///< Also reorder.  Each worker folds into its own accumulator.
+  MR_FOLD_STRICT,        ///< Strict left fold on the calling thread.  For operators that aren't associative.
+} MRFoldMode;
+
+/** Whether scan() includes each element in its own output. */
+typedef enum _mr_scan_mode
+{ MR_SCAN_INCLUSIVE=0, ///< out[i] = x[0]+...+x[i]
+  MR_SCAN_EXCLUSIVE,   ///< out[i] = x[0]+...+x[i-1], and out[0] is the identity
+} MRScanMode;
+
+/** What calibration chose for one function and input size.
+    See MRSetCalibration().
+ */
+typedef struct _mr_calibration
+{ const void *f;                 ///< the function applied, or the MRLazy for MRLazy_Eval()
+  unsigned    size_class;        ///< floor(log2(bytes moved per call))
+  unsigned    nworkers;          ///< chosen worker count, or 0 while still measuring
+  unsigned    chunks_per_worker; ///< chosen chunking; the grain is n/(chunks_per_worker*nworkers)
+  unsigned    trials;            ///< calls measured so far
+  double      bytes_per_second;  ///< throughput with the chosen settings
+  double      speedup;           ///< throughput relative to a single worker
+} MRCalibration;
 
 MRData MRPackage(void *buf, size_t bytesof_elem, size_t bytesof_data);
 MRData MREmpty(size_t bytesof_elem);
 void   MRRelease(MRData *mrdata);
 
-void MRSetWorkerThreadCount(int nthreads);
+MRStrided MRPackageStrided(void *buf, size_t bytesof_elem, size_t stride, size_t count); ///< A \a stride of 0 means elements are packed.
+
+MRData2D MRPackage2D(void *buf, size_t bytesof_elem, size_t width, size_t height, size_t stride); ///< A \a stride of 0 means rows are packed.
+MRData2D MREmpty2D(size_t bytesof_elem);
+void     MRRelease2D(MRData2D *mrdata);
+
+void MRSetWorkerThreadCount(int nthreads); ///< Number of threads working on each call, including the caller.  0 (the default) uses one per processor.
+void MRSetGrainSize(size_t nelem);         ///< Elements per scheduled chunk.  0 (the default) picks a size automatically.
+void MRSetTileSize(size_t w, size_t h);    ///< Tile size for map_tiled().  0 (the default) sizes tiles to fit in L2.
+
+/** Starts worker threads with \a attr: affinity, stack size, scheduling
+    policy and name.  Applies to the pool, which is restarted when next
+    idle, and to map_stream() workers.  The calling thread, which always
+    does a share of the work, isn't changed.  NULL restores the defaults.
+ */
+void MRSetWorkerAttributes(const ThreadAttr *attr);
+
+/** Turns automatic worker-count and grain calibration on or off.
+
+    While on, the first few calls of map(), map_span(), the folds and
+    MRLazy_Eval() for a given function and input size class are timed with
+    different worker counts and chunk sizes.  The fastest settings are then
+    used for later calls with that function and size class.  Memory-bound
+    functions typically settle on fewer workers than there are processors.
+    The pool is still sized by MRSetWorkerThreadCount(), which bounds the
+    search.  A grain set with MRSetGrainSize() is kept fixed.  Off by default.
+ */
+void   MRSetCalibration(int enable);
+void   MRResetCalibration(void);                          ///< Forgets all calibration results.
+size_t MRGetCalibration(MRCalibration *out, size_t max); ///< Copies up to \a max entries to \a out.  Returns the total number of entries.
+
+MRData map     (MRData dst, MRData src, MRFunction f); ///< Returns the result
+MRData map_span(MRData dst, MRData src, MRSpanFunction f, void *ctx); ///< Like map(), but \a f is applied to whole chunks.
+MRData2D map_tiled(MRData2D dst, MRData2D src, MRTileFunction f, size_t halo, void *ctx);
+
+/** Maps \a nsrc operands, all with the same number of elements, to \a dst
+    in one pass.  See \ref secMapNEx.
+
+    \param dst  If \c data is NULL a packed result is allocated.
+                Otherwise it must have room for \c count elements and may
+                be one of the operands.
+    \param nsrc At most 8.
+    \return \a dst on success, otherwise an MRStrided with \c data set to
+            NULL.
+ */
+MRStrided map_n(MRStrided dst, const MRStrided *src, unsigned nsrc, MRStridedFunction f, void *ctx);
+
+/** Applies \a f to every token read from \a in and writes the results to
+    \a out.  See \ref secStreamEx.
+
+    \param in           A handle opened for reading.
+    \param out          A handle opened for writing.  Its tokens must be big
+                        enough for the output of one input token, as many
+                        elements of \a bytesof_elem as the input token holds.
+    \param bytesof_elem Size of an input element.  \a f is called once per
+                        token with the number of elements in the token.
+    \param nworkers     Threads processing tokens, including the caller.  0
+                        uses one per processor.
+    \param ordered      If non-zero, results are written in the order their
+                        inputs were read.
+    \return 0 once \a in is exhausted, or 1 if \a f or a write to \a out
+            failed.  After a failure nothing more is written to \a out:
+            the failed token, tokens other workers are still holding and
+            the rest of \a in are read and dropped, so upstream writers
+            never block.  The call returns only at the end of the stream.
+            If \a out's tokens are too small, returns 1 at once without
+            reading.
+ */
+int map_stream(Chan *in, Chan *out, size_t bytesof_elem, MRSpanFunction f, void *ctx, unsigned nworkers, int ordered);
+
+/** A chain of element-wise maps evaluated in a single pass.
+    See \ref secLazyEx.
+ */
+typedef struct _mr_lazy MRLazy;
+
+MRLazy *MRLazy_Alloc   (MRData src);
+void    MRLazy_Free    (MRLazy *self);
+int     MRLazy_Map     (MRLazy *self, MRFunction f, size_t bytesof_elem);                ///< Appends a stage producing \a bytesof_elem byte elements.  Returns 0 on success.
+int     MRLazy_Map_Span(MRLazy *self, MRSpanFunction f, size_t bytesof_elem, void *ctx); ///< Appends a span stage.  Returns 0 on success.
+MRData  MRLazy_Eval    (MRLazy *self, MRData dst);                                        ///< Runs the chain into \a dst.  Same conventions as map().
+MRData foldl   (MRData dst, MRData src, MRFunction f); ///< Same as foldl_ex(dst,src,f,NULL,MR_FOLD_ASSOCIATIVE)
+MRData foldl_ex(MRData dst, MRData src, MRFunction f, MRFunction combine, MRFoldMode mode);
+MRData foldl_span(MRData dst, MRData src, MRSpanFoldFunction f, MRFunction combine, MRFoldMode mode, void *ctx); ///< Like foldl_ex(), but \a f folds whole chunks.  \a combine is required.
+
+/** Parallel prefix scan of \a src with the associative operator \a op.
+
+    \param dst      Same element size as \a src.  Allocated if \c data is
+                    NULL.  May be \a src for an in-place scan.
+    \param op       Folds the element \a src into the accumulator \a dst.
+                    Pass one of the MRAdd functions for a faster typed loop.
+    \param identity The identity of \a op.  NULL means all bytes zero.
+    \return \a dst on success, otherwise an MRData with \c data set to NULL.
+ */
+MRData scan(MRData dst, MRData src, MRFunction op, const void *identity, MRScanMode mode);
+
+typedef int                (*MRCompare)    (const void *a, const void *b); ///< Like qsort(): negative, zero or positive.
+typedef unsigned long long (*MRKeyFunction)(const void *elem);              ///< An unsigned integer sort key.
+
+/** Sorts \a data in place with \a cmp.  Not stable.  Returns 0 on success.
+
+    Chunks are sorted in parallel, then merged pairwise.  Each merge is
+    split into equal pieces of output by binary search, so every round
+    keeps all workers busy and streams through memory sequentially.
+ */
+int mr_sort(MRData data, MRCompare cmp);
+
+/** Stable LSD radix sort of \a data in place by the keys \a key returns.
+    Byte positions where every key agrees are skipped, so narrow keys cost
+    fewer passes.  For signed keys, flip the sign bit.  Returns 0 on success.
+ */
+int mr_sort_by_key(MRData data, MRKeyFunction key);
+
+/** Collects the (key,value) pairs emitted by a map_reduce_by_key() mapper. */
+typedef struct _mr_emitter MREmitter;
+
+/** Maps one element to any number of pairs with MREmit().  Return 0 on success. */
+typedef int (*MRMapKVFunction)(MREmitter *out, const void *elem, void *ctx);
+
+int MREmit(MREmitter *out, unsigned long long key, const void *value); ///< Returns 0 on success.
+
+/** Bytes per record in the result of map_reduce_by_key(): the key, then
+    the value at offset <tt>sizeof(unsigned long long)</tt>, padded to
+    8-byte alignment.
+ */
+#define MRKeyValueBytes(bytesof_value) (sizeof(unsigned long long)+(((bytesof_value)+7)&~(size_t)7))
+
+/** Groups the pairs emitted by \a map over \a src by key and combines the
+    values for each key.
+
+    Mappers append pairs to per-worker buffers, one per hash partition.
+    Each partition is then reduced by one worker with a hash table, so
+    there's no locking, and partitions are numerous enough to keep each
+    table cache-resident.
+
+    \param combine Folds the second value into the first, like an
+                   MRFunction for foldl().  Must be associative and
+                   commutative.
+    \return One record per distinct key (see MRKeyValueBytes()), in no
+            particular order, or an MRData with \c data set to NULL on
+            failure.  Release with MRRelease().
+ */
+MRData map_reduce_by_key(MRData src, size_t bytesof_value, MRMapKVFunction map, MRFunction combine, void *ctx);
+
+typedef int  (*MRPredicate)      (const void *elem, void *ctx);            ///< Non-zero keeps \a elem.
+typedef long (*MRFlatMapFunction)(void *out, const void *elem, void *ctx); ///< Writes outputs to \a out and returns how many, or -1 on failure.
+
+/** Copies the elements of \a src that satisfy \a keep to \a dst, densely
+    packed and in their original order.
+
+    \param dst Same element size as \a src.  If \c data is NULL it's
+               allocated to fit the result exactly; otherwise it must be big
+               enough for every element of \a src.
+    \return \a dst with \c bytesof_data set to the size of the result, or an
+            MRData with \c data set to NULL on failure.
+ */
+MRData mr_filter(MRData dst, MRData src, MRPredicate keep, void *ctx);
+
+/** Maps each element of \a src to between 0 and \a max_per_elem elements
+    of \a dst, packed in order.  \a dst works as for mr_filter(), except
+    its element size is its own, and a preallocated \a dst must hold the
+    actual result.
+ */
+MRData mr_flat_map(MRData dst, MRData src, size_t max_per_elem, MRFlatMapFunction f, void *ctx);
+
+/** A file mapped for out-of-core processing.  See \ref secFileEx. */
+typedef struct _mr_file MRFile;
+
+MRFile *MRPackageFile      (const char *path, size_t bytesof_elem); ///< Maps an existing file for reading.  Returns NULL on failure.
+MRFile *MRPackageFileOut   (const char *path, size_t bytesof_elem); ///< Creates or truncates \a path for writing.  map_file() sizes it.
+void    MRReleaseFile      (MRFile *file);                          ///< Unmaps and closes \a file.
+MRData  MRFileData         (MRFile *file);                          ///< The whole mapping, for use with the in-memory calls.
+void    MRSetFileWindowSize(size_t bytes);                          ///< Input bytes per map_file() window.  0 (the default) uses 64 MB.
+
+/** Like map_span(), but streams through files too big to fit in memory.
+
+    The input is processed a window at a time.  The next window is read
+    ahead on another thread while the current one is mapped, and finished
+    windows are released from memory.
+    \param dst Opened with MRPackageFileOut().  Resized to hold the result.
+    \return 0 on success.
+ */
+int map_file(MRFile *dst, MRFile *src, MRSpanFunction f, void *ctx);
 
-MRData map  (MRData dst, MRData src, MRFunction f); ///< Returns the result
-MRData foldl(MRData dst, MRData src, MRFunction f); ///< \todo implement foldl()
+int MRAdd_I32(void *acc, void *x); ///< Adds <tt>int</tt>s.  Recognized by scan().
+int MRAdd_I64(void *acc, void *x); ///< Adds <tt>long long</tt>s.  Recognized by scan().
+int MRAdd_F32(void *acc, void *x); ///< Adds <tt>float</tt>s.  Recognized by scan().
+int MRAdd_F64(void *acc, void *x); ///< Adds <tt>double</tt>s.  Recognized by scan().
 
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,302 @@
+/** \file
+    Out-of-core map-reduce over memory-mapped files.
+
+    Files are mapped whole, which costs only address space, and map_file()
+    walks them a window at a time.  While the workers run map_span() over
+    one window, a prefetch thread pulls the next window of the input into
+    the page cache.  Once a window is done its pages are released, so the
+    resident set stays near two windows no matter how big the files are.
+    Released output pages aren't lost: they're dirty pages of a shared file
+    mapping and are written back by the OS.
+ */
+#include <string.h>
+#include <stdio.h>
+#include "config.h"
+#include "mapreduce.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define LOG(...) fprintf(stderr,__VA_ARGS__)
+#define TRY(e,lbl) do { if(!(e)) \
+    {LOG("*** Error [%s]: %s(%d)"ENDL \
+         "Expression evaluated as false."ENDL \
+         "%s"ENDL,#lbl,__FILE__,__LINE__,#e); goto lbl;} } while(0)
+
+#define MR_FILE_WINDOW_BYTES (64*1024*1024) // default input processed per window
+
+static size_t _window = 0;                 // 0: MR_FILE_WINDOW_BYTES
+static Mutex  _lock   = {0};               // protects _window
+
+struct _mr_file
+{ char   *data;
+  size_t  bytes;
+  size_t  bytesof_elem;
+  int     writable;
+#ifdef _WIN32
+  HANDLE  file,mapping;
+#else
+  int     fd;
+#endif
+};
+
+void MRSetFileWindowSize(size_t bytes)
+{
+  Mutex_Lock(&_lock);
+  _window = bytes;
+  Mutex_Unlock(&_lock);
+}
+
+static size_t page_size(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Mapping  /////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static void unmap(MRFile *self)
+{ if(!self->data) return;
+#ifdef _WIN32
+  UnmapViewOfFile(self->data);
+  CloseHandle(self->mapping);
+  self->mapping = NULL;
+#else
+  munmap(self->data,self->bytes);
+#endif
+  self->data = NULL;
+}
+
+/** Maps the first \a bytes of the file, resizing it first if it's
+    writable.  Returns 0 on success.
+ */
+static int remap(MRFile *self, size_t bytes)
+{ unmap(self);
+  self->bytes = bytes;
+#ifdef _WIN32
+  if(self->writable)
+  { LARGE_INTEGER sz;
+    sz.QuadPart = (LONGLONG)bytes;
+    TRY(SetFilePointerEx(self->file,sz,NULL,FILE_BEGIN),Error);
+    TRY(SetEndOfFile(self->file),Error);
+  }
+  if(!bytes) return 0;
+  TRY(self->mapping=CreateFileMappingA(self->file,NULL,self->writable?PAGE_READWRITE:PAGE_READONLY,0,0,NULL),Error);
+  TRY(self->data=(char*)MapViewOfFile(self->mapping,self->writable?FILE_MAP_WRITE:FILE_MAP_READ,0,0,bytes),Error);
+#else
+  if(self->writable)
+    TRY(0==ftruncate(self->fd,(off_t)bytes),Error);
+  if(!bytes) return 0;
+  { void *p = mmap(NULL,bytes,PROT_READ|(self->writable?PROT_WRITE:0),MAP_SHARED,self->fd,0);
+    TRY(p!=MAP_FAILED,Error);
+    self->data = (char*)p;
+  }
+  madvise(self->data,bytes,MADV_SEQUENTIAL);
+#endif
+  return 0;
+Error:
+  return 1;
+}
+
+static MRFile *open_file(const char *path, size_t bytesof_elem, int writable)
+{ MRFile *self = NULL;
+  size_t bytes = 0;
+  TRY(path && bytesof_elem>0,Error);
+  TRY(self=(MRFile*)calloc(1,sizeof(MRFile)),Error);
+  self->bytesof_elem = bytesof_elem;
+  self->writable     = writable;
+#ifdef _WIN32
+  self->file = CreateFileA(path,
+                           writable?GENERIC_READ|GENERIC_WRITE:GENERIC_READ,
+                           FILE_SHARE_READ,NULL,
+                           writable?CREATE_ALWAYS:OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+  TRY(self->file!=INVALID_HANDLE_VALUE,ErrorOpen);
+  if(!writable)
+  { LARGE_INTEGER sz;
+    TRY(GetFileSizeEx(self->file,&sz),Error);
+    bytes = (size_t)sz.QuadPart;
+  }
+#else
+  self->fd = open(path,writable?(O_RDWR|O_CREAT|O_TRUNC):O_RDONLY,0644);
+  TRY(self->fd>=0,ErrorOpen);
+  if(!writable)
+  { struct stat st;
+    TRY(0==fstat(self->fd,&st),Error);
+    bytes = (size_t)st.st_size;
+  }
+#endif
+  TRY(0==remap(self,bytes),Error);
+  return self;
+Error:
+  MRReleaseFile(self);
+  return NULL;
+ErrorOpen:
+  free(self);
+  return NULL;
+}
+
+MRFile *MRPackageFile(const char *path, size_t bytesof_elem)
+{ return open_file(path,bytesof_elem,0);
+}
+
+MRFile *MRPackageFileOut(const char *path, size_t bytesof_elem)
+{ return open_file(path,bytesof_elem,1);
+}
+
+void MRReleaseFile(MRFile *self)
+{ if(!self) return;
+  unmap(self);
+#ifdef _WIN32
+  CloseHandle(self->file);
+#else
+  close(self->fd);
+#endif
+  free(self);
+}
+
+MRData MRFileData(MRFile *self)
+{ return MRPackage(self->data,self->bytesof_elem,self->bytes);
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Windows  /////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+/** Asks for [beg,end) of a mapping to be read in ahead of use. */
+static void will_need(const char *beg, const char *end, size_t page)
+{ const char *b = beg-((size_t)beg%page);
+  if(end<=b) return;
+#ifdef _WIN32
+  { WIN32_MEMORY_RANGE_ENTRY r;
+    r.VirtualAddress = (PVOID)b;
+    r.NumberOfBytes  = end-b;
+    PrefetchVirtualMemory(GetCurrentProcess(),1,&r,0);
+  }
+#else
+  madvise((void*)b,end-b,MADV_WILLNEED);
+#endif
+}
+
+/** Drops the whole pages inside [beg,end) from the resident set. */
+static void release(const char *beg, const char *end, size_t page)
+{ const char *b = beg+(page-(size_t)beg%page)%page,
+             *e = end-((size_t)end%page);
+  if(e<=b) return;
+#ifdef _WIN32
+  VirtualUnlock((LPVOID)b,e-b); // unlocking unlocked pages trims them from the working set
+#else
+  madvise((void*)b,e-b,MADV_DONTNEED);
+#endif
+}
+
+/* The prefetch thread takes one request at a time.  A new request
+   replaces one that hasn't started yet.  Touching a byte per page makes
+   sure the reads happen here rather than as faults in the workers;
+   WILLNEED alone is only a hint.
+*/
+typedef struct _prefetch
+{ Mutex         lock;
+  Condition     cv;
+  const char   *beg,*end;   ///< pending request, or beg==NULL
+  size_t        page;
+  int           stop;
+} Prefetch;
+
+static void* prefetch_worker(void *args_)
+{ Prefetch *p = (Prefetch*)args_;
+  Mutex_Lock(&p->lock);
+  for(;;)
+  { const char *beg,*end,*c;
+    volatile char sink=0;
+    while(!p->beg && !p->stop)
+      Condition_Wait(&p->cv,&p->lock);
+    if(p->stop) break;
+    beg = p->beg;
+    end = p->end;
+    p->beg = NULL;
+    Mutex_Unlock(&p->lock);
+    will_need(beg,end,p->page);
+    for(c=beg;c<end;c+=p->page)
+      sink += *c;
+    Mutex_Lock(&p->lock);
+  }
+  Mutex_Unlock(&p->lock);
+  return NULL;
+}
+
+static void prefetch(Prefetch *p, const char *beg, const char *end)
+{ Mutex_Lock(&p->lock);
+  p->beg = beg;
+  p->end = end;
+  Condition_Notify(&p->cv);
+  Mutex_Unlock(&p->lock);
+}
+
+static void stop(Prefetch *p, Thread *t)
+{ if(!t) return;
+  Mutex_Lock(&p->lock);
+  p->stop = 1;
+  Condition_Notify(&p->cv);
+  Mutex_Unlock(&p->lock);
+  Thread_Join(t);
+  Thread_Free(t);
+}
+
+int map_file(MRFile *dst, MRFile *src, MRSpanFunction f, void *ctx)
+{ Prefetch p;
+  Thread *t = NULL;
+  size_t n,w,i,window;
+  const size_t si = src->bytesof_elem,
+               di = dst->bytesof_elem;
+  TRY(dst->writable,Error);
+  n = src->bytes/si;
+  TRY(0==remap(dst,n*di),Error);
+  Mutex_Lock(&_lock);
+  window = _window?_window:MR_FILE_WINDOW_BYTES;
+  Mutex_Unlock(&_lock);
+  w = window/si;
+  if(!w) w=1;
+
+  memset(&p,0,sizeof(p));
+  p.lock = MUTEX_INITIALIZER;
+  Condition_Initialize(&p.cv);
+  p.page = page_size();
+  t = Thread_Alloc(prefetch_worker,&p); // without it, windows just fault in
+  if(n)
+    will_need(src->data,src->data+(w<n?w:n)*si,p.page);
+  for(i=0;i<n;i+=w)
+  { const size_t m = (n-i<w)?n-i:w;
+    char *s = src->data+i*si,
+         *d = dst->data+i*di;
+    if(t && i+m<n)
+      prefetch(&p,s+m*si,src->data+((i+m+w<n)?i+m+w:n)*si);
+    TRY(map_span(MRPackage(d,di,m*di),MRPackage(s,si,m*si),f,ctx).data,ErrorStop);
+    release(s,s+m*si,p.page);
+    release(d,d+m*di,p.page);
+  }
+  stop(&p,t);
+  // pages straddling two windows
+  release(src->data,src->data+src->bytes,p.page);
+  release(dst->data,dst->data+dst->bytes,p.page);
+  return 0;
+ErrorStop:
+  stop(&p,t);
+Error:
+  return 1;
+}
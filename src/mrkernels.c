@@ -0,0 +1,679 @@
+/** \file
+    Vectorized kernels for map-reduce.
+
+    Kernels are written as a scalar loop plus SSE4.1 and AVX2 variants.
+    With gcc and clang the variants are compiled with per-function
+    \c target attributes, so the rest of the library doesn't need any
+    special flags.  MRCpuFeatures() is queried on every call; it's cached,
+    so dispatch costs a load and a branch per span.
+
+    The reductions behind foldl_reduce() are span folds for foldl_span().
+    Integer kernels accumulate in narrow lanes for blocks short enough that
+    they can't overflow, then widen into 64-bit lanes.
+ */
+#include <string.h>
+#include <math.h>
+#include "config.h"
+#include "mrkernels.h"
+
+#if defined(HAVE_X86_TARGET_ATTRIBUTE)
+#include <immintrin.h>
+#define MR_SIMD
+#define MR_TARGET(e) __attribute__((target(e)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define MR_SIMD
+#define MR_TARGET(e)
+#endif
+
+//////////////////////////////////////////////////////////////////////
+//  CPU features  ////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static volatile unsigned _features = (unsigned)-1; // -1: not detected yet
+static volatile unsigned _mask     = (unsigned)-1;
+
+static unsigned detect(void)
+{ unsigned f=0;
+#if defined(HAVE_X86_TARGET_ATTRIBUTE)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.1")) f|=MR_CPU_SSE41;
+  if(__builtin_cpu_supports("avx2"))   f|=MR_CPU_AVX2;
+#elif defined(MR_SIMD)
+  { int r[4];
+    __cpuid(r,1);
+    if(r[2]&(1<<19)) f|=MR_CPU_SSE41;
+    if((r[2]&(1<<27)) && (r[2]&(1<<28))      // osxsave and avx
+       && (_xgetbv(0)&6)==6)                 // os saves ymm state
+    { __cpuidex(r,7,0);
+      if(r[1]&(1<<5)) f|=MR_CPU_AVX2;
+    }
+  }
+#endif
+  return f;
+}
+
+unsigned MRCpuFeatures(void)
+{ if(_features==(unsigned)-1)
+    _features=detect(); // benign race: every thread computes the same value
+  return _features&_mask;
+}
+
+void MRSetCpuFeatureMask(unsigned mask)
+{ _mask=mask;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Grayscale  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static const MRGrayWeights REC601 = {0.299,0.587,0.114};
+
+static void gray_scalar(double *dst, const unsigned char *src, size_t n, const MRGrayWeights *w)
+{ size_t i;
+  for(i=0;i<n;++i,src+=3)
+    dst[i] = w->r*src[0] + w->g*src[1] + w->b*src[2];
+}
+
+#ifdef MR_SIMD
+MR_TARGET("sse4.1")
+static size_t gray_sse41(double *dst, const unsigned char *src, size_t n, const MRGrayWeights *w)
+{ const __m128i R = _mm_setr_epi8(0,-1,-1,-1, 3,-1,-1,-1, 6,-1,-1,-1,  9,-1,-1,-1),
+                G = _mm_setr_epi8(1,-1,-1,-1, 4,-1,-1,-1, 7,-1,-1,-1, 10,-1,-1,-1),
+                B = _mm_setr_epi8(2,-1,-1,-1, 5,-1,-1,-1, 8,-1,-1,-1, 11,-1,-1,-1);
+  const __m128d wr = _mm_set1_pd(w->r),
+                wg = _mm_set1_pd(w->g),
+                wb = _mm_set1_pd(w->b);
+  size_t i;
+  for(i=0;i+6<=n;i+=4) // 16 byte loads reach into the 6th pixel
+  { __m128i v = _mm_loadu_si128((const __m128i*)(src+3*i)),
+            r = _mm_shuffle_epi8(v,R),
+            g = _mm_shuffle_epi8(v,G),
+            b = _mm_shuffle_epi8(v,B);
+    __m128d lo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(wr,_mm_cvtepi32_pd(r)),
+                                       _mm_mul_pd(wg,_mm_cvtepi32_pd(g))),
+                                       _mm_mul_pd(wb,_mm_cvtepi32_pd(b))),
+            hi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(wr,_mm_cvtepi32_pd(_mm_srli_si128(r,8))),
+                                       _mm_mul_pd(wg,_mm_cvtepi32_pd(_mm_srli_si128(g,8)))),
+                                       _mm_mul_pd(wb,_mm_cvtepi32_pd(_mm_srli_si128(b,8))));
+    _mm_storeu_pd(dst+i  ,lo);
+    _mm_storeu_pd(dst+i+2,hi);
+  }
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t gray_avx2(double *dst, const unsigned char *src, size_t n, const MRGrayWeights *w)
+{ const __m256i idx  = _mm256_setr_epi32(0,3,6,9,12,15,18,21),
+                mask = _mm256_set1_epi32(0xff);
+  const __m256d wr = _mm256_set1_pd(w->r),
+                wg = _mm256_set1_pd(w->g),
+                wb = _mm256_set1_pd(w->b);
+  size_t i;
+  for(i=0;i+9<=n;i+=8) // each gather reads 4 bytes, one into the 9th pixel
+  { __m256i v = _mm256_i32gather_epi32((const int*)(src+3*i),idx,1),
+            r = _mm256_and_si256(v,mask),
+            g = _mm256_and_si256(_mm256_srli_epi32(v, 8),mask),
+            b = _mm256_and_si256(_mm256_srli_epi32(v,16),mask);
+    __m256d lo = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(wr,_mm256_cvtepi32_pd(_mm256_castsi256_si128(r))),
+                                             _mm256_mul_pd(wg,_mm256_cvtepi32_pd(_mm256_castsi256_si128(g)))),
+                                             _mm256_mul_pd(wb,_mm256_cvtepi32_pd(_mm256_castsi256_si128(b)))),
+            hi = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(wr,_mm256_cvtepi32_pd(_mm256_extracti128_si256(r,1))),
+                                             _mm256_mul_pd(wg,_mm256_cvtepi32_pd(_mm256_extracti128_si256(g,1)))),
+                                             _mm256_mul_pd(wb,_mm256_cvtepi32_pd(_mm256_extracti128_si256(b,1))));
+    _mm256_storeu_pd(dst+i  ,lo);
+    _mm256_storeu_pd(dst+i+4,hi);
+  }
+  return i;
+}
+#endif
+
+int MRKernel_Gray_RGB8_F64(void *dst_, const void *src_, size_t n, void *ctx)
+{ double *dst = (double*)dst_;
+  const unsigned char *src = (const unsigned char*)src_;
+  const MRGrayWeights *w = ctx?(const MRGrayWeights*)ctx:&REC601;
+  size_t done=0;
+#ifdef MR_SIMD
+  unsigned f = MRCpuFeatures();
+  if     (f&MR_CPU_AVX2)  done=gray_avx2 (dst,src,n,w);
+  else if(f&MR_CPU_SSE41) done=gray_sse41(dst,src,n,w);
+#endif
+  gray_scalar(dst+done,src+3*done,n-done,w);
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Reductions  //////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef unsigned char      u8;
+typedef unsigned short     u16;
+typedef unsigned long long u64;
+typedef float              f32;
+typedef double             f64;
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+#ifdef MR_SIMD
+static u64 hsum_epi64_128(__m128i v)
+{ u64 t[2];
+  _mm_storeu_si128((__m128i*)t,v);
+  return t[0]+t[1];
+}
+
+MR_TARGET("avx2")
+static u64 hsum_epi64_256(__m256i v)
+{ u64 t[4];
+  _mm256_storeu_si256((__m256i*)t,v);
+  return t[0]+t[1]+t[2]+t[3];
+}
+
+static f64 hsum_pd_128(__m128d v)
+{ f64 t[2];
+  _mm_storeu_pd(t,v);
+  return t[0]+t[1];
+}
+
+MR_TARGET("avx2")
+static f64 hsum_pd_256(__m256d v)
+{ f64 t[4];
+  _mm256_storeu_pd(t,v);
+  return (t[0]+t[1])+(t[2]+t[3]);
+}
+#endif
+
+/* Dispatches one span to the best available variant.  The SIMD variants
+   return the number of elements they handled; the scalar loop finishes the
+   rest.  \a T is the element type.
+*/
+#ifdef MR_SIMD
+#define DISPATCH(T,avx2,sse41,scalar,acc,src,n) \
+  { const T *s_ = (const T*)(src);              \
+    unsigned f_ = MRCpuFeatures();              \
+    size_t i_ = 0;                              \
+    if     (f_&MR_CPU_AVX2)  i_=avx2 (acc,s_,n); \
+    else if(f_&MR_CPU_SSE41) i_=sse41(acc,s_,n); \
+    scalar(acc,s_+i_,(n)-i_);                   \
+  }
+#else
+#define DISPATCH(T,avx2,sse41,scalar,acc,src,n) scalar(acc,(const T*)(src),n)
+#endif
+
+//
+// Sum
+//
+
+static void sum_u8_scalar (u64 *acc, const u8  *s, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=s[i]; }
+static void sum_u16_scalar(u64 *acc, const u16 *s, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=s[i]; }
+static void sum_f32_scalar(f64 *acc, const f32 *s, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=s[i]; }
+static void sum_f64_scalar(f64 *acc, const f64 *s, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=s[i]; }
+
+#define SUM_U16_BLOCK 32768 // iterations before 32-bit lanes could overflow
+
+#ifdef MR_SIMD
+MR_TARGET("sse4.1")
+static size_t sum_u8_sse41(u64 *acc, const u8 *s, size_t n)
+{ __m128i a = _mm_setzero_si128(), z = _mm_setzero_si128();
+  size_t i;
+  for(i=0;i+16<=n;i+=16)
+    a = _mm_add_epi64(a,_mm_sad_epu8(_mm_loadu_si128((const __m128i*)(s+i)),z));
+  *acc += hsum_epi64_128(a);
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t sum_u8_avx2(u64 *acc, const u8 *s, size_t n)
+{ __m256i a = _mm256_setzero_si256(), z = _mm256_setzero_si256();
+  size_t i;
+  for(i=0;i+32<=n;i+=32)
+    a = _mm256_add_epi64(a,_mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(s+i)),z));
+  *acc += hsum_epi64_256(a);
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t sum_u16_sse41(u64 *acc, const u16 *s, size_t n)
+{ __m128i a64 = _mm_setzero_si128(), z = _mm_setzero_si128();
+  size_t i=0;
+  while(i+8<=n)
+  { __m128i a32 = _mm_setzero_si128();
+    size_t k;
+    for(k=0;k<SUM_U16_BLOCK && i+8<=n;++k,i+=8)
+    { __m128i v = _mm_loadu_si128((const __m128i*)(s+i));
+      a32 = _mm_add_epi32(a32,_mm_add_epi32(_mm_unpacklo_epi16(v,z),_mm_unpackhi_epi16(v,z)));
+    }
+    a64 = _mm_add_epi64(a64,_mm_add_epi64(_mm_unpacklo_epi32(a32,z),_mm_unpackhi_epi32(a32,z)));
+  }
+  *acc += hsum_epi64_128(a64);
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t sum_u16_avx2(u64 *acc, const u16 *s, size_t n)
+{ __m256i a64 = _mm256_setzero_si256(), z = _mm256_setzero_si256();
+  size_t i=0;
+  while(i+16<=n)
+  { __m256i a32 = _mm256_setzero_si256();
+    size_t k;
+    for(k=0;k<SUM_U16_BLOCK && i+16<=n;++k,i+=16)
+    { __m256i v = _mm256_loadu_si256((const __m256i*)(s+i));
+      a32 = _mm256_add_epi32(a32,_mm256_add_epi32(_mm256_unpacklo_epi16(v,z),_mm256_unpackhi_epi16(v,z)));
+    }
+    a64 = _mm256_add_epi64(a64,_mm256_add_epi64(_mm256_unpacklo_epi32(a32,z),_mm256_unpackhi_epi32(a32,z)));
+  }
+  *acc += hsum_epi64_256(a64);
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t sum_f32_sse41(f64 *acc, const f32 *s, size_t n)
+{ __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  size_t i;
+  for(i=0;i+4<=n;i+=4)
+  { __m128 v = _mm_loadu_ps(s+i);
+    a = _mm_add_pd(a,_mm_cvtps_pd(v));
+    b = _mm_add_pd(b,_mm_cvtps_pd(_mm_movehl_ps(v,v)));
+  }
+  *acc += hsum_pd_128(_mm_add_pd(a,b));
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t sum_f32_avx2(f64 *acc, const f32 *s, size_t n)
+{ __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  size_t i;
+  for(i=0;i+8<=n;i+=8)
+  { a = _mm256_add_pd(a,_mm256_cvtps_pd(_mm_loadu_ps(s+i)));
+    b = _mm256_add_pd(b,_mm256_cvtps_pd(_mm_loadu_ps(s+i+4)));
+  }
+  *acc += hsum_pd_256(_mm256_add_pd(a,b));
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t sum_f64_sse41(f64 *acc, const f64 *s, size_t n)
+{ __m128d a = _mm_setzero_pd(), b = _mm_setzero_pd();
+  size_t i;
+  for(i=0;i+4<=n;i+=4)
+  { a = _mm_add_pd(a,_mm_loadu_pd(s+i));
+    b = _mm_add_pd(b,_mm_loadu_pd(s+i+2));
+  }
+  *acc += hsum_pd_128(_mm_add_pd(a,b));
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t sum_f64_avx2(f64 *acc, const f64 *s, size_t n)
+{ __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+  size_t i;
+  for(i=0;i+8<=n;i+=8)
+  { a = _mm256_add_pd(a,_mm256_loadu_pd(s+i));
+    b = _mm256_add_pd(b,_mm256_loadu_pd(s+i+4));
+  }
+  *acc += hsum_pd_256(_mm256_add_pd(a,b));
+  return i;
+}
+#endif
+
+static int sum_u8 (void *acc, const void *src, size_t n, void *ctx) { DISPATCH(u8 ,sum_u8_avx2 ,sum_u8_sse41 ,sum_u8_scalar ,(u64*)acc,src,n); return 0; }
+static int sum_u16(void *acc, const void *src, size_t n, void *ctx) { DISPATCH(u16,sum_u16_avx2,sum_u16_sse41,sum_u16_scalar,(u64*)acc,src,n); return 0; }
+static int sum_f32(void *acc, const void *src, size_t n, void *ctx) { DISPATCH(f32,sum_f32_avx2,sum_f32_sse41,sum_f32_scalar,(f64*)acc,src,n); return 0; }
+static int sum_f64(void *acc, const void *src, size_t n, void *ctx) { DISPATCH(f64,sum_f64_avx2,sum_f64_sse41,sum_f64_scalar,(f64*)acc,src,n); return 0; }
+
+static int add_u64(void *dst, void *src) { *(u64*)dst += *(u64*)src; return 0; }
+static int add_f64(void *dst, void *src) { *(f64*)dst += *(f64*)src; return 0; }
+
+//
+// Min and max
+//
+
+/* Defines the scalar loop, the vector loops and the span function for
+   one extremum over one element type.  The vector loops keep a running
+   extremum per lane and fold the lanes at the end.
+*/
+#define SCALAR_EXTREMUM(name,T,op) \
+  static void name(T *acc, const T *s, size_t n) \
+  { size_t i; for(i=0;i<n;++i) *acc=op(*acc,s[i]); }
+
+#define VECTOR_EXTREMUM(name,isa,T,V,lanes,set1,load,store,vop,op) \
+  MR_TARGET(isa)                                                    \
+  static size_t name(T *acc, const T *s, size_t n)                  \
+  { V a = set1(*acc);                                               \
+    T t[lanes];                                                     \
+    size_t i,j;                                                     \
+    for(i=0;i+lanes<=n;i+=lanes)                                    \
+      a = vop(a,load((const void*)(s+i)));                          \
+    store((void*)t,a);                                              \
+    for(j=0;j<lanes;++j)                                            \
+      *acc=op(*acc,t[j]);                                           \
+    return i;                                                       \
+  }
+
+#define SPAN_EXTREMUM(name,T)                                        \
+  static int name(void *acc, const void *src, size_t n, void *ctx)  \
+  { DISPATCH(T,name##_avx2,name##_sse41,name##_scalar,(T*)acc,src,n); \
+    return 0;                                                       \
+  }                                                                 \
+  static int name##_combine(void *dst, void *src)                   \
+  { name##_scalar((T*)dst,(const T*)src,1);                         \
+    return 0;                                                       \
+  }
+
+#define LOAD128(p)    _mm_loadu_si128((const __m128i*)(p))
+#define STORE128(p,v) _mm_storeu_si128((__m128i*)(p),v)
+#define LOAD256(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define STORE256(p,v) _mm256_storeu_si256((__m256i*)(p),v)
+#define SET1_U8_128(x)  _mm_set1_epi8((char)(x))
+#define SET1_U16_128(x) _mm_set1_epi16((short)(x))
+#define SET1_U8_256(x)  _mm256_set1_epi8((char)(x))
+#define SET1_U16_256(x) _mm256_set1_epi16((short)(x))
+
+SCALAR_EXTREMUM(min_u8_scalar ,u8 ,MIN)
+SCALAR_EXTREMUM(min_u16_scalar,u16,MIN)
+SCALAR_EXTREMUM(min_f32_scalar,f32,MIN)
+SCALAR_EXTREMUM(min_f64_scalar,f64,MIN)
+SCALAR_EXTREMUM(max_u8_scalar ,u8 ,MAX)
+SCALAR_EXTREMUM(max_u16_scalar,u16,MAX)
+SCALAR_EXTREMUM(max_f32_scalar,f32,MAX)
+SCALAR_EXTREMUM(max_f64_scalar,f64,MAX)
+
+#ifdef MR_SIMD
+VECTOR_EXTREMUM(min_u8_sse41 ,"sse4.1",u8 ,__m128i, 16,SET1_U8_128  ,LOAD128       ,STORE128       ,_mm_min_epu8    ,MIN)
+VECTOR_EXTREMUM(min_u16_sse41,"sse4.1",u16,__m128i,  8,SET1_U16_128 ,LOAD128       ,STORE128       ,_mm_min_epu16   ,MIN)
+VECTOR_EXTREMUM(min_f32_sse41,"sse4.1",f32,__m128 ,  4,_mm_set1_ps  ,_mm_loadu_ps  ,_mm_storeu_ps  ,_mm_min_ps      ,MIN)
+VECTOR_EXTREMUM(min_f64_sse41,"sse4.1",f64,__m128d,  2,_mm_set1_pd  ,_mm_loadu_pd  ,_mm_storeu_pd  ,_mm_min_pd      ,MIN)
+VECTOR_EXTREMUM(max_u8_sse41 ,"sse4.1",u8 ,__m128i, 16,SET1_U8_128  ,LOAD128       ,STORE128       ,_mm_max_epu8    ,MAX)
+VECTOR_EXTREMUM(max_u16_sse41,"sse4.1",u16,__m128i,  8,SET1_U16_128 ,LOAD128       ,STORE128       ,_mm_max_epu16   ,MAX)
+VECTOR_EXTREMUM(max_f32_sse41,"sse4.1",f32,__m128 ,  4,_mm_set1_ps  ,_mm_loadu_ps  ,_mm_storeu_ps  ,_mm_max_ps      ,MAX)
+VECTOR_EXTREMUM(max_f64_sse41,"sse4.1",f64,__m128d,  2,_mm_set1_pd  ,_mm_loadu_pd  ,_mm_storeu_pd  ,_mm_max_pd      ,MAX)
+VECTOR_EXTREMUM(min_u8_avx2  ,"avx2"  ,u8 ,__m256i, 32,SET1_U8_256  ,LOAD256       ,STORE256       ,_mm256_min_epu8 ,MIN)
+VECTOR_EXTREMUM(min_u16_avx2 ,"avx2"  ,u16,__m256i, 16,SET1_U16_256 ,LOAD256       ,STORE256       ,_mm256_min_epu16,MIN)
+VECTOR_EXTREMUM(min_f32_avx2 ,"avx2"  ,f32,__m256 ,  8,_mm256_set1_ps,_mm256_loadu_ps,_mm256_storeu_ps,_mm256_min_ps  ,MIN)
+VECTOR_EXTREMUM(min_f64_avx2 ,"avx2"  ,f64,__m256d,  4,_mm256_set1_pd,_mm256_loadu_pd,_mm256_storeu_pd,_mm256_min_pd  ,MIN)
+VECTOR_EXTREMUM(max_u8_avx2  ,"avx2"  ,u8 ,__m256i, 32,SET1_U8_256  ,LOAD256       ,STORE256       ,_mm256_max_epu8 ,MAX)
+VECTOR_EXTREMUM(max_u16_avx2 ,"avx2"  ,u16,__m256i, 16,SET1_U16_256 ,LOAD256       ,STORE256       ,_mm256_max_epu16,MAX)
+VECTOR_EXTREMUM(max_f32_avx2 ,"avx2"  ,f32,__m256 ,  8,_mm256_set1_ps,_mm256_loadu_ps,_mm256_storeu_ps,_mm256_max_ps  ,MAX)
+VECTOR_EXTREMUM(max_f64_avx2 ,"avx2"  ,f64,__m256d,  4,_mm256_set1_pd,_mm256_loadu_pd,_mm256_storeu_pd,_mm256_max_pd  ,MAX)
+#endif
+
+SPAN_EXTREMUM(min_u8 ,u8 )
+SPAN_EXTREMUM(min_u16,u16)
+SPAN_EXTREMUM(min_f32,f32)
+SPAN_EXTREMUM(min_f64,f64)
+SPAN_EXTREMUM(max_u8 ,u8 )
+SPAN_EXTREMUM(max_u16,u16)
+SPAN_EXTREMUM(max_f32,f32)
+SPAN_EXTREMUM(max_f64,f64)
+
+//
+// Histogram
+//
+
+/* Counting doesn't vectorize without conflict detection, so the u8 version
+   spreads consecutive elements over four banks instead.  That breaks the
+   store-to-load dependency when neighbouring pixels have the same value,
+   which is the common case in images.
+*/
+#define HIST_BLOCK (1u<<30) // elements per flush, keeps the 32-bit banks from overflowing
+
+static int hist_u8(void *acc_, const void *src, size_t n, void *ctx)
+{ u64 *acc = (u64*)acc_;
+  const u8 *s = (const u8*)src;
+  while(n)
+  { unsigned bank[4][256] = {{0}};
+    size_t i,m = MIN(n,(size_t)HIST_BLOCK);
+    for(i=0;i+4<=m;i+=4)
+    { ++bank[0][s[i  ]];
+      ++bank[1][s[i+1]];
+      ++bank[2][s[i+2]];
+      ++bank[3][s[i+3]];
+    }
+    for(;i<m;++i)
+      ++bank[0][s[i]];
+    for(i=0;i<256;++i)
+      acc[i] += (u64)bank[0][i]+bank[1][i]+bank[2][i]+bank[3][i];
+    s+=m;
+    n-=m;
+  }
+  return 0;
+}
+
+static int hist_u16(void *acc_, const void *src, size_t n, void *ctx)
+{ u64 *acc = (u64*)acc_;
+  const u16 *s = (const u16*)src;
+  size_t i;
+  for(i=0;i<n;++i)
+    ++acc[s[i]];
+  return 0;
+}
+
+static int hist_u8_combine (void *dst, void *src) { size_t i; for(i=0;i<  256;++i) ((u64*)dst)[i]+=((u64*)src)[i]; return 0; }
+static int hist_u16_combine(void *dst, void *src) { size_t i; for(i=0;i<65536;++i) ((u64*)dst)[i]+=((u64*)src)[i]; return 0; }
+
+//
+// Dot product
+//
+
+/* A span fold only sees the first operand, so the second is found at the
+   same offset from its base.
+*/
+typedef struct _dot_ctx
+{ const char *base;
+  const char *other;
+} dot_ctx_t;
+
+#define OTHER(T,ctx,src) ((const T*)(((const dot_ctx_t*)(ctx))->other+((const char*)(src)-((const dot_ctx_t*)(ctx))->base)))
+
+static void dot_u8_scalar (u64 *acc, const u8  *a, const u8  *b, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=(u64)a[i]*b[i]; }
+static void dot_u16_scalar(u64 *acc, const u16 *a, const u16 *b, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=(u64)a[i]*b[i]; }
+static void dot_f32_scalar(f64 *acc, const f32 *a, const f32 *b, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=(f64)a[i]*b[i]; }
+static void dot_f64_scalar(f64 *acc, const f64 *a, const f64 *b, size_t n) { size_t i; for(i=0;i<n;++i) *acc+=a[i]*b[i]; }
+
+#define DOT_U8_BLOCK 16384 // iterations before 32-bit lanes could overflow
+
+#ifdef MR_SIMD
+MR_TARGET("sse4.1")
+static size_t dot_u8_sse41(u64 *acc, const u8 *a, const u8 *b, size_t n)
+{ __m128i a64 = _mm_setzero_si128(), z = _mm_setzero_si128();
+  size_t i=0;
+  while(i+8<=n)
+  { __m128i a32 = _mm_setzero_si128();
+    size_t k;
+    for(k=0;k<DOT_U8_BLOCK && i+8<=n;++k,i+=8)
+      a32 = _mm_add_epi32(a32,_mm_madd_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(a+i))),
+                                             _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(b+i)))));
+    a64 = _mm_add_epi64(a64,_mm_add_epi64(_mm_unpacklo_epi32(a32,z),_mm_unpackhi_epi32(a32,z)));
+  }
+  *acc += hsum_epi64_128(a64);
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t dot_u8_avx2(u64 *acc, const u8 *a, const u8 *b, size_t n)
+{ __m256i a64 = _mm256_setzero_si256(), z = _mm256_setzero_si256();
+  size_t i=0;
+  while(i+16<=n)
+  { __m256i a32 = _mm256_setzero_si256();
+    size_t k;
+    for(k=0;k<DOT_U8_BLOCK && i+16<=n;++k,i+=16)
+      a32 = _mm256_add_epi32(a32,_mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a+i))),
+                                                   _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b+i)))));
+    a64 = _mm256_add_epi64(a64,_mm256_add_epi64(_mm256_unpacklo_epi32(a32,z),_mm256_unpackhi_epi32(a32,z)));
+  }
+  *acc += hsum_epi64_256(a64);
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t dot_u16_sse41(u64 *acc, const u16 *a, const u16 *b, size_t n)
+{ __m128i s = _mm_setzero_si128();
+  size_t i;
+  for(i=0;i+4<=n;i+=4)
+  { __m128i x = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(a+i))),
+            y = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(b+i)));
+    s = _mm_add_epi64(s,_mm_mul_epu32(x,y));
+    s = _mm_add_epi64(s,_mm_mul_epu32(_mm_srli_epi64(x,32),_mm_srli_epi64(y,32)));
+  }
+  *acc += hsum_epi64_128(s);
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t dot_u16_avx2(u64 *acc, const u16 *a, const u16 *b, size_t n)
+{ __m256i s = _mm256_setzero_si256();
+  size_t i;
+  for(i=0;i+8<=n;i+=8)
+  { __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a+i))),
+            y = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b+i)));
+    s = _mm256_add_epi64(s,_mm256_mul_epu32(x,y));
+    s = _mm256_add_epi64(s,_mm256_mul_epu32(_mm256_srli_epi64(x,32),_mm256_srli_epi64(y,32)));
+  }
+  *acc += hsum_epi64_256(s);
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t dot_f32_sse41(f64 *acc, const f32 *a, const f32 *b, size_t n)
+{ __m128d s = _mm_setzero_pd(), t = _mm_setzero_pd();
+  size_t i;
+  for(i=0;i+4<=n;i+=4)
+  { __m128 x = _mm_loadu_ps(a+i),
+           y = _mm_loadu_ps(b+i);
+    s = _mm_add_pd(s,_mm_mul_pd(_mm_cvtps_pd(x),_mm_cvtps_pd(y)));
+    t = _mm_add_pd(t,_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x,x)),_mm_cvtps_pd(_mm_movehl_ps(y,y))));
+  }
+  *acc += hsum_pd_128(_mm_add_pd(s,t));
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t dot_f32_avx2(f64 *acc, const f32 *a, const f32 *b, size_t n)
+{ __m256d s = _mm256_setzero_pd(), t = _mm256_setzero_pd();
+  size_t i;
+  for(i=0;i+8<=n;i+=8)
+  { s = _mm256_add_pd(s,_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+i  )),_mm256_cvtps_pd(_mm_loadu_ps(b+i  ))));
+    t = _mm256_add_pd(t,_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(a+i+4)),_mm256_cvtps_pd(_mm_loadu_ps(b+i+4))));
+  }
+  *acc += hsum_pd_256(_mm256_add_pd(s,t));
+  return i;
+}
+
+MR_TARGET("sse4.1")
+static size_t dot_f64_sse41(f64 *acc, const f64 *a, const f64 *b, size_t n)
+{ __m128d s = _mm_setzero_pd(), t = _mm_setzero_pd();
+  size_t i;
+  for(i=0;i+4<=n;i+=4)
+  { s = _mm_add_pd(s,_mm_mul_pd(_mm_loadu_pd(a+i  ),_mm_loadu_pd(b+i  )));
+    t = _mm_add_pd(t,_mm_mul_pd(_mm_loadu_pd(a+i+2),_mm_loadu_pd(b+i+2)));
+  }
+  *acc += hsum_pd_128(_mm_add_pd(s,t));
+  return i;
+}
+
+MR_TARGET("avx2")
+static size_t dot_f64_avx2(f64 *acc, const f64 *a, const f64 *b, size_t n)
+{ __m256d s = _mm256_setzero_pd(), t = _mm256_setzero_pd();
+  size_t i;
+  for(i=0;i+8<=n;i+=8)
+  { s = _mm256_add_pd(s,_mm256_mul_pd(_mm256_loadu_pd(a+i  ),_mm256_loadu_pd(b+i  )));
+    t = _mm256_add_pd(t,_mm256_mul_pd(_mm256_loadu_pd(a+i+4),_mm256_loadu_pd(b+i+4)));
+  }
+  *acc += hsum_pd_256(_mm256_add_pd(s,t));
+  return i;
+}
+#endif
+
+#ifdef MR_SIMD
+#define DISPATCH2(T,avx2,sse41,scalar,acc,a,b,n) \
+  { unsigned f_ = MRCpuFeatures();                \
+    size_t i_ = 0;                                \
+    if     (f_&MR_CPU_AVX2)  i_=avx2 (acc,a,b,n); \
+    else if(f_&MR_CPU_SSE41) i_=sse41(acc,a,b,n); \
+    scalar(acc,a+i_,b+i_,(n)-i_);                 \
+  }
+#else
+#define DISPATCH2(T,avx2,sse41,scalar,acc,a,b,n) scalar(acc,a,b,n)
+#endif
+
+static int dot_u8 (void *acc, const void *src, size_t n, void *ctx) { DISPATCH2(u8 ,dot_u8_avx2 ,dot_u8_sse41 ,dot_u8_scalar ,(u64*)acc,(const u8 *)src,OTHER(u8 ,ctx,src),n); return 0; }
+static int dot_u16(void *acc, const void *src, size_t n, void *ctx) { DISPATCH2(u16,dot_u16_avx2,dot_u16_sse41,dot_u16_scalar,(u64*)acc,(const u16*)src,OTHER(u16,ctx,src),n); return 0; }
+static int dot_f32(void *acc, const void *src, size_t n, void *ctx) { DISPATCH2(f32,dot_f32_avx2,dot_f32_sse41,dot_f32_scalar,(f64*)acc,(const f32*)src,OTHER(f32,ctx,src),n); return 0; }
+static int dot_f64(void *acc, const void *src, size_t n, void *ctx) { DISPATCH2(f64,dot_f64_avx2,dot_f64_sse41,dot_f64_scalar,(f64*)acc,(const f64*)src,OTHER(f64,ctx,src),n); return 0; }
+
+//
+// Interface
+//
+
+typedef struct _reducer
+{ MRSpanFoldFunction f;
+  MRFunction         combine;
+  size_t             bytes;
+} reducer_t;
+
+static const reducer_t REDUCERS[5][4] =
+{ /* MR_SUM       */ {{sum_u8 ,add_u64        ,sizeof(u64)},{sum_u16,add_u64         ,sizeof(u64)      },{sum_f32,add_f64        ,sizeof(f64)},{sum_f64,add_f64        ,sizeof(f64)}},
+  /* MR_MIN       */ {{min_u8 ,min_u8_combine ,sizeof(u8) },{min_u16,min_u16_combine ,sizeof(u16)      },{min_f32,min_f32_combine,sizeof(f32)},{min_f64,min_f64_combine,sizeof(f64)}},
+  /* MR_MAX       */ {{max_u8 ,max_u8_combine ,sizeof(u8) },{max_u16,max_u16_combine ,sizeof(u16)      },{max_f32,max_f32_combine,sizeof(f32)},{max_f64,max_f64_combine,sizeof(f64)}},
+  /* MR_HISTOGRAM */ {{hist_u8,hist_u8_combine,256*sizeof(u64)},{hist_u16,hist_u16_combine,65536*sizeof(u64)},{0},{0}},
+  /* MR_DOT       */ {{dot_u8 ,add_u64        ,sizeof(u64)},{dot_u16,add_u64         ,sizeof(u64)      },{dot_f32,add_f64        ,sizeof(f64)},{dot_f64,add_f64        ,sizeof(f64)}},
+};
+
+static const reducer_t *reducer(MRType type, MRReduceOp op)
+{ if((unsigned)type>MR_F64 || (unsigned)op>MR_DOT)
+    return NULL;
+  return REDUCERS[op][type].f?&REDUCERS[op][type]:NULL;
+}
+
+static size_t elem_bytes(MRType type)
+{ static const size_t bytes[] = {sizeof(u8),sizeof(u16),sizeof(f32),sizeof(f64)};
+  return bytes[type];
+}
+
+size_t MRReduceBytes(MRType type, MRReduceOp op)
+{ const reducer_t *r = reducer(type,op);
+  return r?r->bytes:0;
+}
+
+/** Writes the identity of \a op into \a acc. */
+static void identity(void *acc, MRType type, MRReduceOp op, size_t bytes)
+{ static const u8  U8[2]  = {0xff,0};
+  static const u16 U16[2] = {0xffff,0};
+  const f32 F32[2] = {HUGE_VALF,-HUGE_VALF};
+  const f64 F64[2] = {HUGE_VAL ,-HUGE_VAL };
+  int i = (op==MR_MAX);
+  if(op!=MR_MIN && op!=MR_MAX)
+  { memset(acc,0,bytes);
+    return;
+  }
+  switch(type)
+  { case MR_U8:  *(u8 *)acc = U8[i];  break;
+    case MR_U16: *(u16*)acc = U16[i]; break;
+    case MR_F32: *(f32*)acc = F32[i]; break;
+    case MR_F64: *(f64*)acc = F64[i]; break;
+  }
+}
+
+MRData foldl_reduce(MRData dst, MRData src, MRType type, MRReduceOp op, const void *other)
+{ const reducer_t *r = reducer(type,op);
+  MRData result = {NULL,0,0};
+  void *given = dst.data;
+  dot_ctx_t ctx = {src.data,(const char*)other};
+  // float sums are combined in chunk order so they're reproducible
+  MRFoldMode mode = ((op==MR_SUM || op==MR_DOT) && (type==MR_F32 || type==MR_F64))
+                    ?MR_FOLD_ASSOCIATIVE:MR_FOLD_COMMUTATIVE;
+  if(!r || dst.bytesof_elem!=r->bytes || src.bytesof_elem!=elem_bytes(type)
+     || (op==MR_DOT && !other))
+    return result;
+  if(!dst.data)
+  { if(!(dst.data=(char*)malloc(r->bytes)))
+      return result;
+    dst.bytesof_data=r->bytes;
+  }
+  identity(dst.data,type,op,r->bytes);
+  result = foldl_span(dst,src,r->f,r->combine,mode,&ctx);
+  if(!result.data && dst.data!=given)
+    free(dst.data);
+  return result;
+}
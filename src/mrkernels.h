@@ -0,0 +1,86 @@
+/** \file
+    Vectorized kernels for use with the \ref mapreduce.h span interface.
+    \author Nathan Clack
+    \date   2012
+
+    Each kernel has SSE4.1 and AVX2 implementations along with a portable
+    scalar fallback.  The best one the CPU supports is chosen at run time.
+ */
+#pragma once
+#include <stdlib.h>
+#include "mapreduce.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+enum
+{ MR_CPU_SSE41 = 1,
+  MR_CPU_AVX2  = 2,
+};
+
+unsigned MRCpuFeatures(void);                 ///< MR_CPU_* flags supported by this machine, after masking.
+void     MRSetCpuFeatureMask(unsigned mask);  ///< Restricts which MR_CPU_* paths kernels may use.  Useful for testing fallbacks.
+
+/** Weights for MRKernel_Gray_RGB8_F64().  Pass NULL as the context to use
+    the Rec. 601 luma weights.
+ */
+typedef struct _mr_gray_weights
+{ double r,g,b;
+} MRGrayWeights;
+
+/** Converts \a n packed 8-bit RGB pixels to doubles: r*w.r + g*w.g + b*w.b.
+    An MRSpanFunction.  \a ctx is an MRGrayWeights* or NULL.
+ */
+int MRKernel_Gray_RGB8_F64(void *dst, const void *src, size_t n, void *ctx);
+
+/** Element types understood by foldl_reduce(). */
+typedef enum _mr_type
+{ MR_U8=0,
+  MR_U16,
+  MR_F32,
+  MR_F64,
+} MRType;
+
+/** Built-in reductions for foldl_reduce().
+
+    The accumulator type depends on the element type:
+    \li \ref MR_SUM and \ref MR_DOT accumulate integers in an
+        <tt>unsigned long long</tt> and floats in a \c double.
+    \li \ref MR_MIN and \ref MR_MAX produce the element type.  NaN handling
+        is unspecified.
+    \li \ref MR_HISTOGRAM counts into an array of <tt>unsigned long
+        long</tt> with one bin per value: 256 for \ref MR_U8 and 65536 for
+        \ref MR_U16.  It isn't defined for floats.
+ */
+typedef enum _mr_reduce_op
+{ MR_SUM=0,
+  MR_MIN,
+  MR_MAX,
+  MR_HISTOGRAM,
+  MR_DOT,      ///< Sum of products with a second array of the same type and length.
+} MRReduceOp;
+
+size_t MRReduceBytes(MRType type, MRReduceOp op); ///< Size of the accumulator for \a op over \a type, or 0 if unsupported.
+
+/** Reduces \a src with one of the built-in operators.
+
+    The fold runs in parallel with vectorized kernels, and per-worker results
+    are combined with foldl_span()'s tree reduction.  Floating point sums
+    and dot products are combined in chunk order, so they're reproducible for
+    a fixed grain size, but may differ in the last bits from a serial sum.
+
+    \param dst   Receives the result.  \c bytesof_elem must be
+                 MRReduceBytes(type,op).  If \c data is NULL the result is
+                 allocated.  Any previous contents are overwritten.
+    \param src   Elements of type \a type.  \c bytesof_elem must be the
+                 size of that type.
+    \param other The second operand for \ref MR_DOT, otherwise ignored.
+                 Must hold as many elements of type \a type as \a src.
+    \return \a dst on success, otherwise an MRData with \c data set to NULL.
+ */
+MRData foldl_reduce(MRData dst, MRData src, MRType type, MRReduceOp op, const void *other);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,150 @@
+/** \file
+    NUMA memory placement.  See \ref numaplace.h.
+
+    The system calls are made directly, so there's no dependency on
+    libnuma.  Node topology is read from sysfs.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "numaplace.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#define MPOL_DEFAULT        0
+#define MPOL_BIND           2
+#define MPOL_INTERLEAVE     3
+#define MPOL_F_NODE     (1<<0)
+#define MPOL_F_ADDR     (1<<1)
+#define MPOL_MF_MOVE    (1<<1)
+#define NUMA_MAX_NODES   1024
+#endif
+
+static size_t page_size(void)
+{
+#ifdef __linux__
+  return (size_t)sysconf(_SC_PAGESIZE);
+#else
+  return 4096;
+#endif
+}
+
+unsigned Numa_Node_Count(void)
+{
+#ifdef __linux__
+  // "0", "0-1" or "0-3,8-11": the count is one more than the last number
+  char line[256];
+  unsigned n=0;
+  FILE *fp = fopen("/sys/devices/system/node/online","r");
+  if(fp)
+  { if(fgets(line,sizeof(line),fp))
+    { char *c = line+strlen(line);
+      while(c>line && (c[-1]<'0' || c[-1]>'9')) --c; // skip the newline
+      while(c>line && c[-1]>='0' && c[-1]<='9') --c;
+      n = (unsigned)atoi(c)+1;
+    }
+    fclose(fp);
+  }
+  return n?n:1;
+#else
+  return 1;
+#endif
+}
+
+int Numa_Node_Of_Processor(unsigned cpu)
+{
+#ifdef __linux__
+  unsigned node,n=Numa_Node_Count();
+  for(node=0;node<n;++node)
+  { char path[96];
+    snprintf(path,sizeof(path),"/sys/devices/system/cpu/cpu%u/node%u",cpu,node);
+    if(access(path,F_OK)==0)
+      return (int)node;
+  }
+  return n==1?0:-1;
+#else
+  return 0;
+#endif
+}
+
+int Numa_Current_Node(void)
+{
+#ifdef __linux__
+  unsigned cpu,node;
+  if(syscall(SYS_getcpu,&cpu,&node,NULL))
+    return -1;
+  return (int)node;
+#else
+  return 0;
+#endif
+}
+
+int Numa_Node_Of_Address(const void *p)
+{
+#ifdef __linux__
+  int node=-1;
+  if(syscall(SYS_get_mempolicy,&node,NULL,0,p,MPOL_F_NODE|MPOL_F_ADDR))
+    return -1;
+  return node;
+#else
+  return 0;
+#endif
+}
+
+int Numa_Place(void *buf, size_t bytes, NumaPolicy policy, int node)
+{
+#ifdef __linux__
+  unsigned long mask[NUMA_MAX_NODES/(8*sizeof(unsigned long))];
+  unsigned n = Numa_Node_Count(),i;
+  size_t page = page_size();
+  char *beg = (char*)buf-((size_t)buf%page),
+       *end = (char*)buf+bytes;
+  int mode = MPOL_DEFAULT;
+  if(!buf || !bytes || n==1)
+    return 0;
+  memset(mask,0,sizeof(mask));
+  switch(policy)
+  { case NUMA_POLICY_BIND:
+      if(node<0 || (unsigned)node>=n || (unsigned)node>=NUMA_MAX_NODES)
+        return 1;
+      mask[node/(8*sizeof(unsigned long))] |= 1UL<<(node%(8*sizeof(unsigned long)));
+      mode = MPOL_BIND;
+      break;
+    case NUMA_POLICY_INTERLEAVE:
+      for(i=0;i<n && i<NUMA_MAX_NODES;++i)
+        mask[i/(8*sizeof(unsigned long))] |= 1UL<<(i%(8*sizeof(unsigned long)));
+      mode = MPOL_INTERLEAVE;
+      break;
+    default:
+      break;
+  }
+  return syscall(SYS_mbind,beg,(size_t)(end-beg),mode,
+                 mode==MPOL_DEFAULT?NULL:mask,
+                 mode==MPOL_DEFAULT?0:(unsigned long)NUMA_MAX_NODES+1,
+                 mode==MPOL_DEFAULT?0:MPOL_MF_MOVE)!=0;
+#else
+  return 0;
+#endif
+}
+
+void *Numa_Alloc(size_t bytes, NumaPolicy policy, int node)
+{ void *p;
+  size_t page = page_size(),
+         n    = ((bytes?bytes:1)+page-1)/page*page;
+#ifdef _WIN32
+  if(!(p=malloc(n)))
+    return NULL;
+#else
+  if(posix_memalign(&p,page,n))
+    return NULL;
+#endif
+  if(policy!=NUMA_POLICY_DEFAULT && Numa_Place(p,n,policy,node))
+  { free(p);
+    return NULL;
+  }
+  return p;
+}
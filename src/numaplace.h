@@ -0,0 +1,42 @@
+/** \file
+    NUMA memory placement without libnuma.
+    \author Nathan Clack
+    \date   2012
+
+    Thin wrappers over the Linux \c mbind and \c get_mempolicy system
+    calls.  Everywhere else, and on machines with a single node, placement
+    requests succeed and do nothing.
+ */
+#pragma once
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+typedef enum _numa_policy
+{ NUMA_POLICY_DEFAULT=0, ///< the calling thread's policy, usually first touch
+  NUMA_POLICY_BIND,      ///< pages on the given node only
+  NUMA_POLICY_INTERLEAVE,///< pages spread round-robin over every node
+} NumaPolicy;
+
+unsigned Numa_Node_Count       (void);          ///< Number of memory nodes.  At least 1.
+int      Numa_Node_Of_Processor(unsigned cpu);  ///< Node of processor \a cpu, or -1 if unknown.
+int      Numa_Current_Node     (void);          ///< Node of the processor running the caller, or -1 if unknown.
+int      Numa_Node_Of_Address  (const void *p); ///< Node holding the page at \a p, or -1 if unknown or not yet touched.
+
+/** Applies \a policy to the pages covering [\a buf,\a buf+\a bytes),
+    moving pages already in memory.  \a buf should be page aligned; pages
+    shared with other data move too.  \a node is ignored unless the policy
+    is \ref NUMA_POLICY_BIND.  Returns 0 on success.
+ */
+int   Numa_Place(void *buf, size_t bytes, NumaPolicy policy, int node);
+
+/** Allocates \a bytes of page-aligned memory placed by \a policy.
+    Release with free().  Returns NULL on failure.
+ */
+void *Numa_Alloc(size_t bytes, NumaPolicy policy, int node);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,213 @@
+/** \file
+    Work-stealing scheduler implementation.
+
+    See \ref scheduler.h for an overview.
+
+    Deques follow Chase and Lev, "Dynamic Circular Work-Stealing Deque"
+    (SPAA 2005), with full fences standing in for the sequentially
+    consistent operations.  The deques never need to grow: a worker only
+    pushes the halves of the range it's splitting, each smaller than
+    anything already on its deque, so depth is bounded by log2 of the
+    chunk count.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "config.h"
+#include "scheduler.h"
+
+#define LOG(...) fprintf(stderr,__VA_ARGS__)
+#define sched_error(...)   do{LOG(__VA_ARGS__);exit(-1);}while(0)
+#define sched_assert(e)    if(!(e)) sched_error("Assert failed in scheduler module" ENDL \
+                                                "\tFailed: %s" ENDL \
+                                                "\tAt %s:%d" ENDL,#e,__FILE__,__LINE__ )
+
+#define SCHED_DEQUE_CAPACITY 128 // must be a power of 2 >= 65
+#define SCHED_CACHE_LINE      64
+
+//////////////////////////////////////////////////////////////////////
+//  Deque      ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _sched_range
+{ size_t beg,end;  // in chunks
+} sched_range_t;
+
+typedef struct _sched_deque
+{ volatile long top;    // steal end
+  char          pad0[SCHED_CACHE_LINE-sizeof(long)];
+  volatile long bottom; // owner end
+  char          pad1[SCHED_CACHE_LINE-sizeof(long)];
+  sched_range_t items[SCHED_DEQUE_CAPACITY];
+} sched_deque_t;
+
+#define ITEM(d,i) ((d)->items[(i)&(SCHED_DEQUE_CAPACITY-1)])
+
+static void deque_push(sched_deque_t *d, sched_range_t r)
+{ long b = d->bottom;
+  sched_assert(b-d->top<SCHED_DEQUE_CAPACITY);
+  ITEM(d,b) = r;
+  MemoryBarrier();
+  d->bottom = b+1;
+}
+
+static int deque_pop(sched_deque_t *d, sched_range_t *r)
+{ long b = d->bottom-1,t;
+  d->bottom = b;
+  MemoryBarrier();
+  t = d->top;
+  if(t<=b)
+  { *r = ITEM(d,b);
+    if(t==b) // last item - race thieves for it
+    { int won = InterlockedCompareExchange(&d->top,t+1,t)==t;
+      d->bottom = b+1;
+      return won;
+    }
+    return 1;
+  }
+  d->bottom = b+1;
+  return 0;
+}
+
+static int deque_steal(sched_deque_t *d, sched_range_t *r)
+{ long t = d->top,b;
+  MemoryBarrier();
+  b = d->bottom;
+  if(t<b)
+  { *r = ITEM(d,t);
+    return InterlockedCompareExchange(&d->top,t+1,t)==t;
+  }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Job        ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+/* A job is shared by the caller and the pool tasks that help with it.
+   It's reference counted since helpers may only get scheduled after the
+   caller has already finished all the work and returned.
+*/
+typedef struct _sched_job
+{ sched_deque_t  *deques;      // one per participant
+  SchedRangeProc  f;
+  void           *arg;
+  size_t          n;
+  size_t          grain;
+  unsigned        nworkers;
+  volatile long   remaining;   // chunks not yet finished
+  volatile long   next_worker; // participant slot claimed by the next helper
+  volatile long   refs;
+  volatile long   err;
+  void           *mem;         // unaligned allocation backing deques
+} sched_job_t;
+
+static void job_decref(sched_job_t *job)
+{ if(InterlockedDecrement(&job->refs)==0)
+  { free(job->mem);
+    free(job);
+  }
+}
+
+static void run_range(sched_job_t *job, unsigned w, sched_range_t r)
+{ sched_deque_t *d = job->deques+w;
+  while(r.end-r.beg>1)
+  { sched_range_t hi;
+    hi.beg = r.beg+(r.end-r.beg)/2;
+    hi.end = r.end;
+    deque_push(d,hi);
+    r.end  = hi.beg;
+  }
+  if(!job->err)
+  { size_t beg = r.beg*job->grain,
+           end = beg+job->grain;
+    int e;
+    if(end>job->n) end=job->n;
+    if(e=job->f(beg,end,w,job->arg))
+      InterlockedCompareExchange(&job->err,e,0);
+  }
+  InterlockedDecrement(&job->remaining);
+}
+
+static int steal(sched_job_t *job, unsigned w, unsigned *seed, sched_range_t *r)
+{ unsigned i,n = job->nworkers,
+           start;
+  *seed ^= *seed<<13; *seed ^= *seed>>17; *seed ^= *seed<<5; // xorshift
+  start = *seed%n;
+  for(i=0;i<n;++i)
+  { unsigned v = (start+i)%n;
+    if(v!=w && deque_steal(job->deques+v,r))
+      return 1;
+  }
+  return 0;
+}
+
+static void work(sched_job_t *job, unsigned w)
+{ unsigned seed = 2654435761u*(w+1);
+  while(job->remaining>0)
+  { sched_range_t r;
+    if(deque_pop(job->deques+w,&r) || steal(job,w,&seed,&r))
+      run_range(job,w,r);
+    else
+      Thread_Yield();
+  }
+  MemoryBarrier(); // make the other workers' results visible
+}
+
+static void* helper(void *arg)
+{ sched_job_t *job = (sched_job_t*)arg;
+  long w = InterlockedIncrement(&job->next_worker);
+  if(w<(long)job->nworkers)
+    work(job,(unsigned)w);
+  job_decref(job);
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Interface  ///////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+unsigned Sched_Max_Workers(ThreadPool *pool)
+{ return pool?ThreadPool_Thread_Count(pool)+1:1;
+}
+
+int Sched_For(ThreadPool *pool, unsigned nworkers, size_t n, size_t grain, SchedRangeProc f, void *arg)
+{ sched_job_t *job;
+  size_t nchunks;
+  unsigned i;
+  int err;
+  if(!n) return 0;
+  if(grain<1) grain=1;
+  nchunks = (n+grain-1)/grain;
+  if(nworkers>Sched_Max_Workers(pool)) nworkers=Sched_Max_Workers(pool);
+  if(nworkers>nchunks)                 nworkers=(unsigned)nchunks;
+  if(nworkers<=1)
+  { size_t beg;
+    for(beg=0;beg<n;beg+=grain)
+      if(err=f(beg,(beg+grain<n)?beg+grain:n,0,arg))
+        return err;
+    return 0;
+  }
+
+  sched_assert(job=(sched_job_t*)calloc(1,sizeof(sched_job_t)));
+  sched_assert(job->mem=malloc(nworkers*sizeof(sched_deque_t)+SCHED_CACHE_LINE));
+  job->deques = (sched_deque_t*)(((size_t)job->mem+SCHED_CACHE_LINE-1)&~(size_t)(SCHED_CACHE_LINE-1));
+  memset(job->deques,0,nworkers*sizeof(sched_deque_t));
+  job->f           = f;
+  job->arg         = arg;
+  job->n           = n;
+  job->grain       = grain;
+  job->nworkers    = nworkers;
+  job->remaining   = (long)nchunks;
+  job->next_worker = 0;              // the caller is worker 0
+  job->refs        = nworkers;
+  { sched_range_t all = {0,nchunks};
+    deque_push(job->deques,all);
+  }
+  for(i=1;i<nworkers;++i)
+    if(ThreadPool_Submit(pool,helper,job))
+      job_decref(job);
+  work(job,0);
+  err = (int)job->err;
+  job_decref(job);
+  return err;
+}
@@ -0,0 +1,48 @@
+/** \file
+    Work-stealing scheduler.
+    \author Nathan Clack
+    \date   2012
+
+    Runs a parallel loop over [0,n) on a \ref ThreadPool.  The range is
+    cut into chunks of \a grain elements.  Each participating worker owns a
+    Chase-Lev deque of chunk ranges.  A worker splits its range in half
+    recursively, pushing the upper halves onto its own deque, until a single
+    chunk remains and then runs it.  Idle workers steal the oldest (largest)
+    range from a random victim, so uneven per-element costs balance out
+    while most traffic stays on the owner's end of its own deque.
+
+    The calling thread participates as worker 0, so nested calls from
+    inside a loop body can't deadlock the pool.
+ */
+#pragma once
+#include <stdlib.h>
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Loop body.  Called once per chunk with \a beg and \a end in elements.
+    \a worker identifies the calling participant in [0,nworkers) and can be
+    used to index per-worker state.  Return 0 on success.
+ */
+typedef int (*SchedRangeProc)(size_t beg, size_t end, unsigned worker, void *arg);
+
+/** Calls \a f over every chunk of [0,n) in parallel and waits for
+    completion.
+
+    \param pool     Workers to run on.  May be NULL to run serially.
+    \param nworkers Number of participants, including the caller.  Clamped
+                    to one more than the number of threads in \a pool.
+    \param grain    Chunk size in elements.  Chunk \c k is always
+                    [k*grain,min((k+1)*grain,n)).
+    \return 0 on success, otherwise the first non-zero value returned by
+            \a f.  Chunks that haven't started when an error is seen are
+            skipped.
+ */
+int      Sched_For       ( ThreadPool *pool, unsigned nworkers, size_t n, size_t grain, SchedRangeProc f, void *arg);
+unsigned Sched_Max_Workers( ThreadPool *pool); ///< Number of participants Sched_For() can use with \a pool.
+
+#ifdef __cplusplus
+}
+#endif
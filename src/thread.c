@@ -1,5 +1,9 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread affinity and naming
+#endif
 #include "thread.h"
 #include "stdio.h"
+#include <string.h>
 #include "config.h"
 
 #define thread_error(...)    do{fprintf(stderr,__VA_ARGS__);exit(-1);}while(0)
@@ -7,12 +11,51 @@
 																									 "\tFailed: %s" ENDL \
                                                    "\tAt %s:%d" ENDL,#e,__FILE__,__LINE__ );
 
+typedef struct _thread_record_t thread_record_t;
+
 typedef struct _closure_t 
-{ ThreadProc    proc;
-  ThreadProcArg arg;
-  ThreadProcRet ret;
+{ ThreadProc       proc;
+  ThreadProcArg    arg;
+  ThreadProcRet    ret;
+  thread_record_t *record; // set for tracked threads
 } closure_t;
 
+//////////////////////////////////////////////////////////////////////
+//  Accounting  //////////////////////////////////////////////////////
+//
+//  Named threads get a record in a process-wide registry.  The record is
+//  filled in by the thread itself: it registers when it starts and
+//  stores its final CPU time and context switch counts when its
+//  function returns.  Snapshots of running threads query the OS.
+//
+//  Blocked time is accumulated by the owning thread without the
+//  registry lock; snapshots may be a wait behind.
+//////////////////////////////////////////////////////////////////////
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct _thread_record_t
+{ thread_record_t *next;
+  char    name[16];
+  int     running;
+  double  t0,t1;        // wall clock at start and end
+  double  cpu;          // final, once stopped
+  unsigned long long vcsw,ivcsw; // final, once stopped
+  volatile double blocked;
+  volatile double block_t0; // start of the current wait, or 0
+#ifdef USE_PTHREAD
+  pthread_t handle;
+  long      tid;
+#else
+  void     *handle;     // a real handle, not the pseudo handle
+#endif
+};
+
+static THREAD_LOCAL thread_record_t *_self_record = NULL;
+
 #ifdef USE_PTHREAD
 #include <pthread.h>
 #define _MUTEX_INITIALIZER     {PTHREAD_MUTEX_INITIALIZER,PTHREAD_MUTEX_INITIALIZER,0}
@@ -99,9 +142,14 @@ typedef struct _thread_t
   DWORD           id;
   closure_t       closure;
 } thread_t;
+static void track_begin(thread_record_t *r);
+static void track_end(thread_record_t *r);
+
 DWORD WINAPI win32call(LPVOID lpParam)
 { closure_t* c = (closure_t*)lpParam;
+  if(c->record) track_begin(c->record);
   c->ret = c->proc(c->arg);
+  if(c->record) track_end(c->record);
   return 0;
 }
 
@@ -123,6 +171,61 @@ Thread* Thread_Alloc(ThreadProc function, ThreadProcArg arg)
   return (Thread*)t;        
 }
 
+static int set_affinity(HANDLE h, const unsigned *cpus, unsigned ncpus)
+{ DWORD_PTR mask=0;
+  unsigned i;
+  if(!ncpus)
+  { DWORD_PTR sys;
+    if(!GetProcessAffinityMask(GetCurrentProcess(),&mask,&sys))
+      return 1;
+  }
+  for(i=0;i<ncpus;++i)
+  { if(cpus[i]>=8*sizeof(DWORD_PTR))
+      return 1;
+    mask |= ((DWORD_PTR)1)<<cpus[i];
+  }
+  return SetThreadAffinityMask(h,mask)?0:1;
+}
+
+Thread* Thread_Alloc_Ex(ThreadProc function, ThreadProcArg arg, const ThreadAttr* attr)
+{ thread_t*  t;
+  closure_t* c;
+  if(!attr) return Thread_Alloc(function,arg);
+  thread_assert(t = (thread_t*)calloc(1,sizeof(thread_t)));
+  c=&t->closure;
+  c->proc=function;
+  c->arg=arg;
+  c->ret=NULL;
+  if(attr->name)
+  { thread_assert(c->record=(thread_record_t*)calloc(1,sizeof(thread_record_t)));
+    strncpy(c->record->name,attr->name,sizeof(c->record->name)-1);
+  }
+  if(!(t->handle=CreateThread(NULL,attr->stack_bytes,win32call,(LPVOID)c,CREATE_SUSPENDED,&t->id)))
+    goto ErrorCreate;
+  if(attr->ncpus && set_affinity(t->handle,attr->cpus,attr->ncpus))
+    goto ErrorAttr;
+  if(attr->policy!=THREAD_SCHED_DEFAULT && !SetThreadPriority(t->handle,THREAD_PRIORITY_TIME_CRITICAL))
+    goto ErrorAttr;
+  ResumeThread(t->handle);
+  return (Thread*)t;
+ErrorAttr:
+  ReportLastWindowsError();
+  TerminateThread(t->handle,0); // never ran
+  CloseHandle(t->handle);
+  free(c->record);
+  free(t);
+  return NULL;
+ErrorCreate:
+  ReportLastWindowsError();
+  free(c->record);
+  free(t);
+  return NULL;
+}
+
+int Thread_Set_Affinity(Thread* self_, const unsigned* cpus, unsigned ncpus)
+{ return set_affinity(((thread_t*)self_)->handle,cpus,ncpus);
+}
+
 void Thread_Free(Thread* self_)
 { thread_t *self = (thread_t*)self_;
   if(self)
@@ -153,6 +256,62 @@ void Thread_Self(Thread* out)
   self->id     = GetThreadId(self->handle);
 }
 
+void Thread_Yield()
+{ SwitchToThread();
+}
+
+unsigned Thread_Processor_Count()
+{ SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors?(unsigned)info.dwNumberOfProcessors:1;
+}
+
+double Thread_Time()
+{ LARGE_INTEGER t,f;
+  QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart/(double)f.QuadPart;
+}
+
+// A thread that leaves through Thread_Exit(), or that called
+// Thread_Track_Self() and never untracked, finishes its record from the
+// fiber-local storage callback, while its handle is still good.
+static DWORD _record_fls = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI record_exit(PVOID r)
+{ if(r) track_end((thread_record_t*)r);
+}
+
+static void record_self(thread_record_t *r)
+{ DuplicateHandle(GetCurrentProcess(),GetCurrentThread(),GetCurrentProcess(),
+                  &r->handle,0,FALSE,DUPLICATE_SAME_ACCESS);
+  if(_record_fls==FLS_OUT_OF_INDEXES)
+  { DWORD i;
+    thread_assert_win32((i=FlsAlloc(record_exit))!=FLS_OUT_OF_INDEXES);
+    if(InterlockedCompareExchange((volatile LONG*)&_record_fls,i,FLS_OUT_OF_INDEXES)!=FLS_OUT_OF_INDEXES)
+      FlsFree(i); // another thread got there first
+  }
+  FlsSetValue(_record_fls,r);
+}
+
+static void record_release(thread_record_t *r)
+{ FlsSetValue(_record_fls,NULL);
+  if(r->handle) CloseHandle(r->handle);
+  r->handle = NULL;
+}
+
+static double record_cpu(thread_record_t *r)
+{ FILETIME c,e,k,u;
+  if(!GetThreadTimes(r->handle,&c,&e,&k,&u))
+    return 0.0;
+  return 1e-7*((((unsigned long long)k.dwHighDateTime<<32)|k.dwLowDateTime)
+              +(((unsigned long long)u.dwHighDateTime<<32)|u.dwLowDateTime));
+}
+
+static void record_switches(thread_record_t *r, unsigned long long *v, unsigned long long *iv)
+{ *v=*iv=0; // not available
+}
+
 //////////////////////////////////////////////////////////////////////
 //  Mutex  ///////////////////////////////////////////////////////////
 //
@@ -269,6 +428,14 @@ void Condition_Notify_All(Condition* self)
 
 #ifdef USE_PTHREAD
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #define thread_assert_pthread(e) if(!(e)) {perror("Thread(pthread)"); \
                                            thread_error("Assert failed in thread module" ENDL \
 																									      "\tFailed: %s " ENDL \
@@ -277,8 +444,21 @@ void Condition_Notify_All(Condition* self)
 #define pth_asrt_success(e) thread_assert_pthread(pthread_success(e))
 typedef struct _thread_t
 { native_thread_t handle;
+  closure_t       closure; // for tracked threads
 } thread_t;
 
+static void track_begin(thread_record_t *r);
+static void track_end(thread_record_t *r);
+
+static void* tracked_call(void *arg)
+{ closure_t *c = (closure_t*)arg;
+  void *ret;
+  track_begin(c->record);
+  ret = c->proc(c->arg);
+  track_end(c->record);
+  return ret;
+}
+
 Thread *Thread_Alloc(ThreadProc function, ThreadProcArg arg)
 { thread_t* t;
   thread_assert(t = (thread_t*)calloc(1,sizeof(thread_t)));
@@ -290,6 +470,92 @@ Thread *Thread_Alloc(ThreadProc function, ThreadProcArg arg)
   return (Thread*)t;        
 }
 
+static int set_affinity(pthread_t h, const unsigned *cpus, unsigned ncpus)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  unsigned i;
+  CPU_ZERO(&set);
+  if(!ncpus)
+    for(i=0;i<Thread_Processor_Count() && i<CPU_SETSIZE;++i)
+      CPU_SET(i,&set);
+  for(i=0;i<ncpus;++i)
+  { if(cpus[i]>=CPU_SETSIZE)
+      return 1;
+    CPU_SET(cpus[i],&set);
+  }
+  return pthread_setaffinity_np(h,sizeof(set),&set)!=0;
+#else
+  return ncpus!=0; // no affinity control; only "any processor" succeeds
+#endif
+}
+
+Thread *Thread_Alloc_Ex(ThreadProc function, ThreadProcArg arg, const ThreadAttr* attr)
+{ thread_t* t;
+  pthread_attr_t a;
+  int e;
+  if(!attr) return Thread_Alloc(function,arg);
+  thread_assert(t = (thread_t*)calloc(1,sizeof(thread_t)));
+  pth_asrt_success(pthread_attr_init(&a));
+  if(attr->stack_bytes)
+  { size_t sz = attr->stack_bytes<PTHREAD_STACK_MIN?PTHREAD_STACK_MIN:attr->stack_bytes;
+    if((e=pthread_attr_setstacksize(&a,sz))) goto Error;
+  }
+  if(attr->policy!=THREAD_SCHED_DEFAULT)
+  { struct sched_param p;
+    int policy = (attr->policy==THREAD_SCHED_FIFO)?SCHED_FIFO:SCHED_RR,
+        lo     = sched_get_priority_min(policy),
+        hi     = sched_get_priority_max(policy);
+    p.sched_priority = attr->priority<lo?lo:(attr->priority>hi?hi:attr->priority);
+    if((e=pthread_attr_setinheritsched(&a,PTHREAD_EXPLICIT_SCHED))) goto Error;
+    if((e=pthread_attr_setschedpolicy(&a,policy)))                 goto Error;
+    if((e=pthread_attr_setschedparam(&a,&p)))                      goto Error;
+  }
+#ifdef __linux__
+  if(attr->ncpus)
+  { cpu_set_t set;
+    unsigned i;
+    CPU_ZERO(&set);
+    for(i=0;i<attr->ncpus;++i)
+    { if(attr->cpus[i]>=CPU_SETSIZE) { e=EINVAL; goto Error; }
+      CPU_SET(attr->cpus[i],&set);
+    }
+    if((e=pthread_attr_setaffinity_np(&a,sizeof(set),&set))) goto Error;
+  }
+#else
+  if(attr->ncpus) { e=ENOTSUP; goto Error; }
+#endif
+  if(attr->name)
+  { thread_assert(t->closure.record=(thread_record_t*)calloc(1,sizeof(thread_record_t)));
+    strncpy(t->closure.record->name,attr->name,sizeof(t->closure.record->name)-1);
+    t->closure.proc = function;
+    t->closure.arg  = arg;
+    if((e=pthread_create(&t->handle,&a,tracked_call,&t->closure))) goto Error;
+  } else
+  { if((e=pthread_create(&t->handle,&a,function,arg))) goto Error;
+  }
+  pthread_attr_destroy(&a);
+#ifdef __linux__
+  if(attr->name)
+  { char name[16];
+    strncpy(name,attr->name,sizeof(name)-1);
+    name[sizeof(name)-1]='\0';
+    pthread_setname_np(t->handle,name);
+  }
+#endif
+  return (Thread*)t;
+Error:
+  fprintf(stderr,"Thread(pthread): Thread_Alloc_Ex: %s"ENDL,strerror(e));
+  pthread_attr_destroy(&a);
+  free(t->closure.record);
+  free(t);
+  return NULL;
+}
+
+int Thread_Set_Affinity(Thread* self_, const unsigned* cpus, unsigned ncpus)
+{ return set_affinity(((thread_t*)self_)->handle,cpus,ncpus);
+}
+
 void Thread_Free(Thread* self_)
 { thread_t *self = (thread_t*)self_;
 	if(self)
@@ -315,6 +581,73 @@ void Thread_Self(Thread* out_)
 { thread_t *out= (thread_t*)out_; 
   out->handle = pthread_self();
 }
+
+void Thread_Yield()
+{ sched_yield();
+}
+
+unsigned Thread_Processor_Count()
+{ long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n>0?(unsigned)n:1;
+}
+
+double Thread_Time()
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+// A thread that leaves through Thread_Exit(), or that called
+// Thread_Track_Self() and never untracked, finishes its record from the
+// key's destructor, while its handle is still good.
+static pthread_key_t  _record_key;
+static pthread_once_t _record_once = PTHREAD_ONCE_INIT;
+
+static void record_exit(void *r)
+{ track_end((thread_record_t*)r);
+}
+
+static void record_key_create(void)
+{ pth_asrt_success(pthread_key_create(&_record_key,record_exit));
+}
+
+static void record_self(thread_record_t *r)
+{ r->handle = pthread_self();
+#ifdef __linux__
+  r->tid    = (long)syscall(SYS_gettid);
+#endif
+  pth_asrt_success(pthread_once(&_record_once,record_key_create));
+  pth_asrt_success(pthread_setspecific(_record_key,r));
+}
+
+static void record_release(thread_record_t *r)
+{ pthread_setspecific(_record_key,NULL);
+}
+
+static double record_cpu(thread_record_t *r)
+{ clockid_t id;
+  struct timespec t;
+  if(pthread_getcpuclockid(r->handle,&id) || clock_gettime(id,&t))
+    return 0.0;
+  return t.tv_sec+1e-9*t.tv_nsec;
+}
+
+static void record_switches(thread_record_t *r, unsigned long long *v, unsigned long long *iv)
+{ *v=*iv=0;
+#ifdef __linux__
+  { char path[64],line[128];
+    FILE *fp;
+    snprintf(path,sizeof(path),"/proc/self/task/%ld/status",r->tid);
+    if(!(fp=fopen(path,"r")))
+      return;
+    while(fgets(line,sizeof(line),fp))
+    { sscanf(line,"voluntary_ctxt_switches: %llu",v);
+      sscanf(line,"nonvoluntary_ctxt_switches: %llu",iv);
+    }
+    fclose(fp);
+  }
+#endif
+}
 //////////////////////////////////////////////////////////////////////
 //  Mutex  ///////////////////////////////////////////////////////////
 //
@@ -420,3 +753,254 @@ void Condition_Notify_All(Condition* self)
   pth_asrt_success(pthread_cond_broadcast(self));
 }
 #endif // pthread
+
+//////////////////////////////////////////////////////////////////////
+//  Accounting registry  /////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static Mutex            _registry_lock = _MUTEX_INITIALIZER;
+static thread_record_t *_registry      = NULL;
+
+static void track_begin(thread_record_t *r)
+{ record_self(r);
+  r->t0      = Thread_Time();
+  r->running = 1;
+  _self_record = r;
+  Mutex_Lock(&_registry_lock);
+  r->next   = _registry;
+  _registry = r;
+  Mutex_Unlock(&_registry_lock);
+}
+
+static void track_end(thread_record_t *r)
+{ double cpu = record_cpu(r);
+  unsigned long long v,iv;
+  record_switches(r,&v,&iv);
+  _self_record = NULL;
+  Mutex_Lock(&_registry_lock);
+  r->cpu     = cpu;
+  r->vcsw    = v;
+  r->ivcsw   = iv;
+  r->t1      = Thread_Time();
+  r->running = 0;
+  record_release(r);
+  Mutex_Unlock(&_registry_lock);
+}
+
+void Thread_Track_Self(const char* name)
+{ thread_record_t *r;
+  if(_self_record) return;
+  thread_assert(r=(thread_record_t*)calloc(1,sizeof(thread_record_t)));
+  strncpy(r->name,name?name:"",sizeof(r->name)-1);
+  track_begin(r);
+}
+
+void Thread_Untrack_Self()
+{ if(_self_record)
+    track_end(_self_record);
+}
+
+void Thread_Block_Begin()
+{ if(_self_record)
+    _self_record->block_t0 = Thread_Time();
+}
+
+void Thread_Block_End()
+{ thread_record_t *r = _self_record;
+  if(r && r->block_t0)
+  { r->blocked += Thread_Time()-r->block_t0;
+    r->block_t0 = 0;
+  }
+}
+
+size_t Thread_Stats(ThreadStats* out, size_t max)
+{ thread_record_t *r;
+  size_t n=0;
+  double now = Thread_Time();
+  Mutex_Lock(&_registry_lock);
+  for(r=_registry;r;r=r->next,++n)
+  { ThreadStats *s;
+    double b0;
+    if(n>=max) continue;
+    s = out+n;
+    memset(s,0,sizeof(*s));
+    memcpy(s->name,r->name,sizeof(s->name));
+    s->running = r->running;
+    s->blocked = r->blocked;
+    if(r->running)
+    { s->wall = now-r->t0;
+      s->cpu  = record_cpu(r);
+      record_switches(r,&s->voluntary_switches,&s->involuntary_switches);
+      if((b0=r->block_t0)>0)
+        s->blocked += now-b0;
+    } else
+    { s->wall = r->t1-r->t0;
+      s->cpu  = r->cpu;
+      s->voluntary_switches   = r->vcsw;
+      s->involuntary_switches = r->ivcsw;
+    }
+    if(s->wall>0)
+    { s->utilization      = s->cpu/s->wall;
+      s->blocked_fraction = s->blocked/s->wall;
+    }
+  }
+  Mutex_Unlock(&_registry_lock);
+  return n;
+}
+
+void Thread_Stats_Clear()
+{ thread_record_t **p;
+  Mutex_Lock(&_registry_lock);
+  for(p=&_registry;*p;)
+  { thread_record_t *r = *p;
+    if(r->running)
+    { p=&r->next;
+      continue;
+    }
+    *p = r->next;
+    free(r);
+  }
+  Mutex_Unlock(&_registry_lock);
+}
+
+//////////////////////////////////////////////////////////////////////
+//  Thread Pool  /////////////////////////////////////////////////////
+//
+//  Portable; built from the primitives above.  Queued tasks live in a
+//  ring of closures that doubles in size when it fills.
+//////////////////////////////////////////////////////////////////////
+
+typedef struct _thread_pool_t
+{ Thread   **threads;
+  unsigned   nthreads;
+
+  closure_t *tasks;     // ring of queued tasks
+  size_t     cap;       // ring capacity (power of 2)
+  size_t     head;      // write cursor
+  size_t     tail;      // read  cursor
+  size_t     pending;   // queued + running
+  int        stop;
+
+  Mutex      lock;
+  Condition  work;      // predicate: head!=tail || stop
+  Condition  idle;      // predicate: pending==0
+} thread_pool_t;
+
+static void* thread_pool_worker(void *arg)
+{ thread_pool_t *self = (thread_pool_t*)arg;
+  Mutex_Lock(&self->lock);
+  while(1)
+  { closure_t c;
+    while(self->head==self->tail && !self->stop)
+      Condition_Wait(&self->work,&self->lock);
+    if(self->head==self->tail) // stopping and drained
+      break;
+    c = self->tasks[self->tail++ & (self->cap-1)];
+    Mutex_Unlock(&self->lock);
+    c.proc(c.arg);
+    Mutex_Lock(&self->lock);
+    if(--self->pending==0)
+      Condition_Notify_All(&self->idle);
+  }
+  Mutex_Unlock(&self->lock);
+  return NULL;
+}
+
+ThreadPool* ThreadPool_Alloc(unsigned nthreads)
+{ return ThreadPool_Alloc_Ex(nthreads,NULL);
+}
+
+ThreadPool* ThreadPool_Alloc_Ex(unsigned nthreads, const ThreadAttr* attr)
+{ thread_pool_t *self;
+  unsigned i;
+  if(nthreads<1) nthreads=1;
+  thread_assert(self = (thread_pool_t*)calloc(1,sizeof(thread_pool_t)));
+  thread_assert(self->threads = (Thread**)calloc(nthreads,sizeof(Thread*)));
+  self->cap = 64;
+  thread_assert(self->tasks = (closure_t*)malloc(self->cap*sizeof(closure_t)));
+  self->lock = MUTEX_INITIALIZER;
+  Condition_Initialize(&self->work);
+  Condition_Initialize(&self->idle);
+  for(i=0;i<nthreads;++i)
+  { ThreadAttr a;
+    char name[16];
+    if(attr)
+    { a = *attr;
+      if(attr->one_cpu_each && attr->ncpus)
+      { a.cpus  = attr->cpus+i%attr->ncpus;
+        a.ncpus = 1;
+      }
+      if(attr->name)
+      { snprintf(name,sizeof(name),"%.11s%u",attr->name,i);
+        a.name = name;
+      }
+    }
+    if(!(self->threads[i] = Thread_Alloc_Ex(thread_pool_worker,self,attr?&a:NULL)))
+      break;
+    self->nthreads = i+1;
+  }
+  if(self->nthreads<nthreads)
+  { ThreadPool_Free(self);
+    return NULL;
+  }
+  return (ThreadPool*)self;
+}
+
+void ThreadPool_Free(ThreadPool* self_)
+{ thread_pool_t *self = (thread_pool_t*)self_;
+  unsigned i;
+  if(!self) return;
+  Mutex_Lock(&self->lock);
+  self->stop = 1;
+  Mutex_Unlock(&self->lock);
+  Condition_Notify_All(&self->work);
+  for(i=0;i<self->nthreads;++i)
+  { Thread_Join(self->threads[i]);
+    Thread_Free(self->threads[i]);
+  }
+  free(self->threads);
+  free(self->tasks);
+  free(self);
+}
+
+int ThreadPool_Submit(ThreadPool* self_, ThreadProc function, ThreadProcArg arg)
+{ thread_pool_t *self = (thread_pool_t*)self_;
+  Mutex_Lock(&self->lock);
+  if(self->stop)
+  { Mutex_Unlock(&self->lock);
+    return 1;
+  }
+  if(self->head-self->tail==self->cap) // full - grow and unwrap
+  { closure_t *t;
+    size_t i,n=self->cap;
+    thread_assert(t = (closure_t*)malloc(2*n*sizeof(closure_t)));
+    for(i=0;i<n;++i)
+      t[i] = self->tasks[(self->tail+i)&(n-1)];
+    free(self->tasks);
+    self->tasks = t;
+    self->cap   = 2*n;
+    self->tail  = 0;
+    self->head  = n;
+  }
+  { closure_t *c = self->tasks + (self->head++ & (self->cap-1));
+    c->proc = function;
+    c->arg  = arg;
+    c->ret  = NULL;
+  }
+  ++self->pending;
+  Mutex_Unlock(&self->lock);
+  Condition_Notify(&self->work);
+  return 0;
+}
+
+void ThreadPool_Wait(ThreadPool* self_)
+{ thread_pool_t *self = (thread_pool_t*)self_;
+  Mutex_Lock(&self->lock);
+  while(self->pending)
+    Condition_Wait(&self->idle,&self->lock);
+  Mutex_Unlock(&self->lock);
+}
+
+unsigned ThreadPool_Thread_Count(ThreadPool* self_)
+{ return ((thread_pool_t*)self_)->nthreads;
+}
@@ -83,12 +83,58 @@ typedef void* (*ThreadProc)(void*);
 typedef void* ThreadProcArg;
 typedef void* ThreadProcRet;
 
+//////////////////////////////////////////////////////////////////////
+// Thread attributes
+//
+// Passed to Thread_Alloc_Ex() and ThreadPool_Alloc_Ex().  Zero-fill for
+// the defaults: any processor, the default stack, normal scheduling and
+// no name.
+//
+// cpus/ncpus
+//   - processor numbers the thread may run on.  A pool started with
+//     one_cpu_each pins worker i to cpus[i%ncpus] alone instead.
+// policy/priority
+//   - THREAD_SCHED_FIFO and THREAD_SCHED_RR are real-time policies and
+//     usually need privileges.  On windows both map to time-critical
+//     priority and priority is ignored.
+// name
+//   - shown by debuggers and top.  Truncated to 15 characters.  Pool
+//     workers get the worker index appended.  Ignored on windows.
+//
+// Thread_Alloc_Ex() returns NULL if the attributes can't be applied,
+// for example without permission for a real-time policy.
+// Thread_Set_Affinity() returns 0 on success.  Processor masks are
+// limited to THREAD_MAX_CPUS (64 on windows).
+//////////////////////////////////////////////////////////////////////
+#define THREAD_MAX_CPUS 1024
+
+typedef enum _thread_sched_policy
+{ THREAD_SCHED_DEFAULT=0,
+  THREAD_SCHED_FIFO,
+  THREAD_SCHED_RR,
+} ThreadSchedPolicy;
+
+typedef struct _thread_attr
+{ const unsigned    *cpus;
+  unsigned           ncpus;        // 0: any processor
+  int                one_cpu_each; // pools only
+  size_t             stack_bytes;  // 0: default
+  ThreadSchedPolicy  policy;
+  int                priority;
+  const char        *name;
+} ThreadAttr;
+
 Thread* Thread_Alloc ( ThreadProc function, ThreadProcArg arg);
+Thread* Thread_Alloc_Ex( ThreadProc function, ThreadProcArg arg, const ThreadAttr* attr);
+int     Thread_Set_Affinity( Thread* self, const unsigned* cpus, unsigned ncpus);
 void    Thread_Free  ( Thread* self);
 void*   Thread_Join  ( Thread* self);
 void    Thread_Exit  ( unsigned exitcode);
 extern native_thread_id_t Thread_SelfID( );
 void    Thread_Self  ( Thread* out );
+void    Thread_Yield ( );             ///< Gives up the rest of the time slice.
+unsigned Thread_Processor_Count( );   ///< Number of online logical processors.
+double   Thread_Time( );              ///< Monotonic wall clock in seconds.
 
 Mutex*  Mutex_Alloc ( );
 void    Mutex_Free  ( Mutex* self);
@@ -104,6 +150,70 @@ void       Condition_Wait      ( Condition* self, Mutex* lock);
 void       Condition_Notify    ( Condition* self);
 void       Condition_Notify_All( Condition* self);
 
+//////////////////////////////////////////////////////////////////////
+// Accounting
+//
+// Threads started with a name (see ThreadAttr), and threads that call
+// Thread_Track_Self(), are tracked: CPU time, wall time, time spent
+// blocked waiting in Chan calls and context switches.  Thread_Stats()
+// reports every tracked thread, running or finished, and returns how
+// many there are.  Compare utilization and blocked_fraction across the
+// stages of a pipeline to see which is CPU-bound and which is starved.
+//
+// Thread_Stats_Clear()
+//   - forgets threads that have finished.
+// Thread_Block_Begin()/Thread_Block_End()
+//   - bracket a wait to count it as blocked time.  Chan does this around
+//     its waits.  No-ops for untracked threads.
+//
+// A thread that leaves with Thread_Exit() isn't marked finished.  Context
+// switch counts are only available on linux.
+//////////////////////////////////////////////////////////////////////
+typedef struct _thread_stats
+{ char     name[16];
+  int      running;
+  double   wall;              // seconds since the thread started, or its lifetime
+  double   cpu;               // seconds on a processor
+  double   blocked;           // seconds waiting in Chan calls
+  double   utilization;       // cpu/wall
+  double   blocked_fraction;  // blocked/wall
+  unsigned long long voluntary_switches;
+  unsigned long long involuntary_switches;
+} ThreadStats;
+
+void   Thread_Track_Self  ( const char* name);
+void   Thread_Untrack_Self( );
+size_t Thread_Stats       ( ThreadStats* out, size_t max);
+void   Thread_Stats_Clear ( );
+void   Thread_Block_Begin ( );
+void   Thread_Block_End   ( );
+
+//////////////////////////////////////////////////////////////////////
+// Thread pool
+//
+// A fixed set of worker threads that park on a condition variable between
+// tasks.  Tasks are ThreadProc's; their return values are discarded.
+//
+// ThreadPool_Submit() 
+//   - returns 0 on success.  Fails only if the pool is being freed.
+// ThreadPool_Wait()
+//   - blocks until every task submitted so far has finished.  Must not be
+//     called from inside a task running on the same pool.
+// ThreadPool_Free()
+//   - runs any tasks still queued, then joins the workers.
+// ThreadPool_Alloc_Ex()
+//   - starts the workers with the given attributes.  See "Thread
+//     attributes" above.
+//////////////////////////////////////////////////////////////////////
+typedef void ThreadPool;
+
+ThreadPool* ThreadPool_Alloc       ( unsigned nthreads);
+ThreadPool* ThreadPool_Alloc_Ex    ( unsigned nthreads, const ThreadAttr* attr); ///< Returns NULL if a worker can't be started with \a attr.
+void        ThreadPool_Free        ( ThreadPool* self);
+int         ThreadPool_Submit      ( ThreadPool* self, ThreadProc function, ThreadProcArg arg);
+void        ThreadPool_Wait        ( ThreadPool* self);
+unsigned    ThreadPool_Thread_Count( ThreadPool* self);
+
 #ifdef __cplusplus
 }
 #endif
@@ -120,3 +120,485 @@ TEST_F(ChanTest,PeekFull)
 
 
 
+
+#include "thread.h"
+#include <string.h>
+#include <unistd.h>
+
+static void* write_later(void *a)
+{ Chan *w=Chan_Open((Chan*)a,CHAN_WRITE);
+  void *buf=Chan_Token_Buffer_Alloc(w);
+  usleep(100000);
+  Chan_Next(w,&buf,Chan_Buffer_Size_Bytes(w));
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(w);
+  return NULL;
+}
+
+TEST_F(ChanTest,BlockedTimeIsTracked)
+{ ThreadStats s[64];
+  Chan *r=Chan_Open(empty,CHAN_READ);
+  Thread *t=Thread_Alloc(write_later,empty);
+  Thread_Track_Self("chan-reader");
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(r,&buf,sz)));
+  Thread_Untrack_Self();
+  Thread_Join(t);
+  Thread_Free(t);
+  Chan_Close(r);
+  size_t n=Thread_Stats(s,64);
+  const ThreadStats *p=NULL;
+  for(size_t i=0;i<n;++i)
+    if(!strcmp(s[i].name,"chan-reader")) p=s+i;
+  ASSERT_NE((void*)NULL,p);
+  EXPECT_GT(p->blocked,0.05);
+  EXPECT_GT(p->blocked_fraction,0.5);
+  Thread_Stats_Clear();
+}
+
+#include "numaplace.h"
+
+TEST(ChanNumaTest,PlacedBuffersStayPlaced)
+{ ChanNuma modes[]={CHAN_NUMA_FIRST_READER,CHAN_NUMA_BIND,CHAN_NUMA_INTERLEAVE};
+  const size_t sz=3*4096+10;
+  ASSERT_GE(Numa_Node_Count(),1u);
+  ASSERT_GE(Numa_Node_Of_Processor(0),0);
+  for(int m=0;m<3;++m)
+  { Chan *q=Chan_Alloc_Numa(4,sz,modes[m],0),
+         *w=Chan_Open(q,CHAN_WRITE),
+         *r=Chan_Open(q,CHAN_READ);
+    void *token=Chan_Token_Buffer_Alloc(q);
+    // a foreign buffer is replaced by a placed copy, and freed, when it's
+    // swapped in, even if it's page aligned like placed memory
+    void *buf=Numa_Alloc(sz,NUMA_POLICY_DEFAULT,-1),*foreign=buf;
+    memset(buf,'x',sz);
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(w,&buf,sz)));
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(r,&token,sz)));
+    EXPECT_NE(foreign,token) << "mode " << modes[m];
+    EXPECT_EQ('x',((char*)token)[0]);
+    EXPECT_EQ('x',((char*)token)[sz-1]);
+    if(Numa_Node_Count()==1)
+      EXPECT_EQ(0,Numa_Node_Of_Address(token));
+    Chan_Token_Buffer_Free(buf);
+    Chan_Token_Buffer_Free(token);
+    Chan_Close(r);
+    Chan_Close(w);
+    Chan_Close(q);
+  }
+}
+
+TEST(ChanNumaTest,SamePlacementForwardsWithoutCopying)
+{ Chan *a=Chan_Alloc_Numa(2,64,CHAN_NUMA_BIND,0),
+       *b=Chan_Alloc_Numa(2,64,CHAN_NUMA_BIND,0),
+       *aw=Chan_Open(a,CHAN_WRITE),*ar=Chan_Open(a,CHAN_READ),
+       *bw=Chan_Open(b,CHAN_WRITE),*br=Chan_Open(b,CHAN_READ);
+  void *token=Chan_Token_Buffer_Alloc(a),*sent;
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(aw,&token,64)));
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(ar,&token,64)));
+  sent=token;
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(bw,&token,64)));
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(br,&token,64)));
+  EXPECT_EQ(sent,token);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(br); Chan_Close(bw); Chan_Close(b);
+  Chan_Close(ar); Chan_Close(aw); Chan_Close(a);
+}
+
+#include <set>
+
+struct Arena
+{ std::set<void*> live;
+  int allocs,reallocs,frees,strangers; // strangers: frees of buffers the arena didn't make
+};
+
+static bool arena_made(Arena &a, void *buf) // buffers sit past a header
+{ return a.live.count((char*)buf-CHAN_BUFFER_HEADER_BYTES)==1;
+}
+
+static void *arena_alloc(size_t bytes, void *ctx)
+{ Arena *a=(Arena*)ctx;
+  void *p=malloc(bytes);
+  a->live.insert(p);
+  ++a->allocs;
+  return p;
+}
+
+static void *arena_realloc(void *buf, size_t bytes, void *ctx)
+{ Arena *a=(Arena*)ctx;
+  if(!a->live.erase(buf)) ++a->strangers;
+  void *p=realloc(buf,bytes);
+  a->live.insert(p);
+  ++a->reallocs;
+  return p;
+}
+
+static void arena_free(void *buf, void *ctx)
+{ Arena *a=(Arena*)ctx;
+  if(!a->live.erase(buf)) ++a->strangers;
+  ++a->frees;
+  free(buf);
+}
+
+TEST(ChanAllocatorTest,EveryBufferGoesThroughTheHooks)
+{ Arena arena={std::set<void*>(),0,0,0,0};
+  ChanAllocator hooks={arena_alloc,arena_realloc,arena_free,&arena};
+  Chan *q=Chan_Alloc_With_Allocator(4,sizeof(int),&hooks),
+       *w=Chan_Open(q,CHAN_WRITE),
+       *r=Chan_Open(q,CHAN_READ);
+  ASSERT_TRUE(q!=NULL);
+  EXPECT_GE(arena.allocs,4);
+  void *token=Chan_Token_Buffer_Alloc(q);
+  EXPECT_TRUE(arena_made(arena,token));
+
+  // a foreign buffer is replaced by a copy from the arena on the way in
+  int *foreign=(int*)malloc(sizeof(int));
+  *foreign=42;
+  void *buf=foreign;
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(w,&buf,sizeof(int))));
+  EXPECT_TRUE(arena_made(arena,buf));
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(r,&token,sizeof(int))));
+  EXPECT_EQ(42,*(int*)token);
+  EXPECT_TRUE(arena_made(arena,token));
+
+  // expansion and resizing
+  Chan_Set_Expand_On_Full(w,1);
+  for(int i=0;i<10;++i)
+  { *(int*)buf=i;
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(w,&buf,sizeof(int))));
+  }
+  EXPECT_EQ(16u,Chan_Buffer_Count(q));
+  Chan_Resize(q,64);
+  EXPECT_GT(arena.reallocs,0);
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(r,&token,64)));
+  EXPECT_EQ(0,*(int*)token);
+
+  Chan_Close(r);
+  Chan_Close(w);
+  Chan_Close(q);
+  // received buffers outlive the channel and still go back to the arena
+  EXPECT_EQ(2u,arena.live.size());
+  Chan_Token_Buffer_Free(token);
+  Chan_Token_Buffer_Free(buf);
+  EXPECT_EQ(0u,arena.live.size());
+  EXPECT_EQ(0,arena.strangers);
+  EXPECT_EQ(arena.allocs,arena.frees);
+}
+
+TEST(ChanAllocatorTest,BuffersKnowTheirChannel)
+{ Arena a1,a2;
+  a1.allocs=a1.reallocs=a1.frees=a1.strangers=0;
+  a2=a1;
+  ChanAllocator h1={arena_alloc,arena_realloc,arena_free,&a1},
+                h2={arena_alloc,NULL,arena_free,&a2};
+  Chan *q1=Chan_Alloc_With_Allocator(2,sizeof(int),&h1),
+       *q2=Chan_Alloc_With_Allocator(2,sizeof(int),&h2),
+       *w=Chan_Open(q2,CHAN_WRITE);
+  void *buf=Chan_Token_Buffer_Alloc(q1);
+  *(int*)buf=7;
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Next(w,&buf,sizeof(int)))); // q1's buffer is copied into q2's arena
+  EXPECT_TRUE(arena_made(a2,buf));
+  EXPECT_EQ(1,a1.frees);                                     // and went back to q1's
+  Chan_Close(w);
+  Chan_Close(q2);
+  Chan_Close(q1);
+  Chan_Token_Buffer_Free(buf);
+  EXPECT_EQ(0u,a1.live.size()+a2.live.size());
+  EXPECT_EQ(0,a1.strangers+a2.strangers);
+}
+
+TEST(ChanAllocatorTest,MissingHooks)
+{ ChanAllocator hooks={arena_alloc,arena_realloc,NULL,NULL};
+  EXPECT_TRUE(Chan_Alloc_With_Allocator(4,16,&hooks)==NULL);
+  EXPECT_TRUE(Chan_Alloc_With_Allocator(4,16,NULL)==NULL);
+}
+
+#include "fifo.h"
+
+TEST(ChanRealtimeTest,RejectsInsteadOfAllocating)
+{ Chan *q=Chan_Alloc_Realtime(4,sizeof(int),3,0),
+       *w=Chan_Open(q,CHAN_WRITE),
+       *r=Chan_Open(q,CHAN_READ);
+  ASSERT_TRUE(q && w && r);
+  EXPECT_TRUE(Chan_Open(q,CHAN_READ)==NULL); // only three handles
+  void *token=Chan_Token_Buffer_Alloc(q),
+       *small=NULL;
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Next(w,&small,0)));
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Next(w,&token,2*sizeof(int))));
+  Chan_Set_Expand_On_Full(w,1);
+  for(int i=0;i<4;++i)
+  { *(int*)token=i;
+    EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,sizeof(int))));
+  }
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Next_Try(w,&token,sizeof(int)))); // full, didn't expand
+  EXPECT_EQ(4u,Chan_Buffer_Count(q));
+  Chan_Resize(q,64);
+  EXPECT_EQ(sizeof(int),Chan_Buffer_Size_Bytes(q));
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Next(r,&small,0)));
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(r,&token,sizeof(int))));
+  EXPECT_EQ(0,*(int*)token);
+  int v=0;
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next_Copy(r,&v,sizeof(v))));
+  EXPECT_EQ(1,v);
+  Chan_Close(r); // the handle goes back to the pool
+  EXPECT_TRUE((r=Chan_Open(q,CHAN_READ))!=NULL);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(r);
+  Chan_Close(w);
+  Chan_Close(q);
+}
+
+TEST(ChanRealtimeTest,LockedMemory)
+{ Chan *q=Chan_Alloc_Realtime(2,4096,1,1);
+  if(!q)
+    GTEST_SKIP() << "Can't lock memory here (RLIMIT_MEMLOCK).";
+  void *token=Chan_Token_Buffer_Alloc(q);
+  EXPECT_EQ(0u,(size_t)token%64);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(q);
+}
+
+#ifndef NDEBUG
+TEST(ChanRealtimeTest,AllocationOnHotPathIsFatal)
+{ Fifo *f=Fifo_Alloc(4,16);
+  Fifo_No_Alloc_Begin();
+  ASSERT_DEATH(Fifo_Alloc_Token_Buffer(f),"Allocation on a real-time path.*");
+  Fifo_No_Alloc_End();
+  Fifo_Free(f);
+}
+#endif
+
+static void* reserve_producer(void *arg)
+{ Chan *w=Chan_Open((Chan*)arg,CHAN_WRITE);
+  for(int i=0;i<1000;++i)
+  { void *slot; size_t cap;
+    if(CHAN_FAILURE(Chan_Reserve(w,&slot,&cap))) break;
+    *(int*)slot=i;
+    Chan_Commit(w,sizeof(int));
+  }
+  Chan_Close(w);
+  return NULL;
+}
+
+TEST(ChanInPlaceTest,ReserveCommitAcquireRelease)
+{ size_t sizes[]={sizeof(int),1024}; // inline slots and separate buffers
+  for(int k=0;k<2;++k)
+  { Chan *q=Chan_Alloc_Inline(4,sizes[k]),
+         *r=Chan_Open(q,CHAN_READ);
+    Thread *t=Thread_Alloc(reserve_producer,q);
+    Chan_Wait_For_Writer_Count(q,1);
+    int expect=0;
+    void *slot; size_t n;
+    while(CHAN_SUCCESS(Chan_Acquire(r,&slot,&n)))
+    { EXPECT_EQ(sizeof(int),n);               // what was committed
+      EXPECT_EQ(expect++,*(int*)slot);
+      EXPECT_TRUE(CHAN_SUCCESS(Chan_Release(r)));
+    }
+    EXPECT_EQ(1000,expect);
+    Thread_Join(t);
+    Thread_Free(t);
+    Chan_Close(r);
+    Chan_Close(q);
+  }
+}
+
+TEST(ChanInPlaceTest,MixesWithNextAndChecksOwnership)
+{ Chan *q=Chan_Alloc(4,sizeof(int)),
+       *w=Chan_Open(q,CHAN_WRITE),
+       *r=Chan_Open(q,CHAN_READ);
+  void *slot,*token=Chan_Token_Buffer_Alloc(q);
+  size_t cap;
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Commit(w,sizeof(int))));      // nothing reserved
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Reserve(r,&slot,&cap)));      // readers can't reserve
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Reserve(w,&slot,&cap)));
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Reserve(w,&slot,&cap)));      // one at a time
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Commit(w,cap+1)));
+  *(int*)slot=1;
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Commit(w,cap)));
+  *(int*)token=2;
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,sizeof(int))));
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Acquire(r,&slot,&cap)));
+  EXPECT_EQ(1,*(int*)slot);
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Release(r)));
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Release(r)));
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(r,&token,sizeof(int))));
+  EXPECT_EQ(2,*(int*)token);
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Reserve(w,&slot,&cap)));
+  Chan_Close(w);                                               // drops the reservation
+  EXPECT_TRUE(Chan_Is_Empty(q));
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Acquire(r,&slot,&cap)));
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(r);
+  Chan_Close(q);
+}
+
+TEST(ChanInPlaceTest,AcquireReportsCommittedLength)
+{ Chan *q=Chan_Alloc(4,256),
+       *w=Chan_Open(q,CHAN_WRITE),
+       *r=Chan_Open(q,CHAN_READ);
+  void *slot,*token=Chan_Token_Buffer_Alloc(q);
+  size_t cap,n;
+  for(size_t len=1;len<=10;++len)            // wraps around the ring
+  { ASSERT_TRUE(CHAN_SUCCESS(Chan_Reserve(w,&slot,&cap)));
+    EXPECT_EQ(256u,cap);
+    memset(slot,(int)len,len);
+    EXPECT_TRUE(CHAN_SUCCESS(Chan_Commit(w,len)));
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Acquire(r,&slot,&n)));
+    EXPECT_EQ(len,n);
+    EXPECT_EQ((char)len,((char*)slot)[len-1]);
+    EXPECT_TRUE(CHAN_SUCCESS(Chan_Release(r)));
+  }
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,10)));
+  ASSERT_TRUE(CHAN_SUCCESS(Chan_Acquire(r,&slot,&n)));
+  EXPECT_EQ(10u,n);                          // pushed with Chan_Next()
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Release(r)));
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(w);
+  Chan_Close(r);
+  Chan_Close(q);
+}
+
+static void* int_producer(void *arg)
+{ Chan *q=(Chan*)arg,
+       *w=Chan_Open(q,CHAN_WRITE);
+  int *token=(int*)Chan_Token_Buffer_Alloc(q),*mine=token;
+  for(int i=0;i<1000;++i)
+  { *token=i;
+    if(CHAN_FAILURE(Chan_Next(w,(void**)&token,sizeof(int)))) break;
+    EXPECT_EQ(mine,token);                    // copied in, not swapped
+  }
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(w);
+  return NULL;
+}
+
+TEST(ChanInlineTest,CopiesInsteadOfSwapping)
+{ Chan *q=Chan_Alloc_Inline(4,sizeof(int)),
+       *r=Chan_Open(q,CHAN_READ);
+  int *token=(int*)Chan_Token_Buffer_Alloc(q),*mine=token,expect=0;
+  Thread *t=Thread_Alloc(int_producer,q);
+  Chan_Wait_For_Writer_Count(q,1);
+  while(CHAN_SUCCESS(Chan_Next(r,(void**)&token,sizeof(int))))
+  { EXPECT_EQ(mine,token);
+    EXPECT_EQ(expect++,*token);
+  }
+  EXPECT_EQ(1000,expect);
+  Thread_Join(t);
+  Thread_Free(t);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(r);
+  Chan_Close(q);
+}
+
+TEST(ChanInlineTest,OnlyWhenAskedFor)
+{ Chan *q=Chan_Alloc(4,sizeof(int)),             // small, but swaps
+       *w=Chan_Open(q,CHAN_WRITE);
+  void *token=Chan_Token_Buffer_Alloc(q),*mine=token;
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,sizeof(int))));
+  EXPECT_NE(mine,token);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(w);
+  Chan_Close(q);
+
+  q=Chan_Alloc_Inline(4,sizeof(int));            // copies keep the mode
+  Chan *c=Chan_Alloc_Copy(q);
+  w=Chan_Open(c,CHAN_WRITE);
+  token=mine=Chan_Token_Buffer_Alloc(c);
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,sizeof(int))));
+  EXPECT_EQ(mine,token);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(w);
+  Chan_Close(c);
+  Chan_Close(q);
+
+  q=Chan_Alloc_Inline(4,FIFO_INLINE_MAX_BYTES+1); // too big to keep inline
+  w=Chan_Open(q,CHAN_WRITE);
+  token=mine=Chan_Token_Buffer_Alloc(q);
+  EXPECT_TRUE(CHAN_SUCCESS(Chan_Next(w,&token,FIFO_INLINE_MAX_BYTES+1)));
+  EXPECT_NE(mine,token);
+  Chan_Token_Buffer_Free(token);
+  Chan_Close(w);
+  Chan_Close(q);
+}
+
+static void* vec_producer(void *arg)
+{ Chan *q=(Chan*)arg,
+       *w=Chan_Open(q,CHAN_WRITE);
+  ChanVec *v=Chan_Vec_Alloc(q);
+  for(size_t n=1;n<=40000;n=n*3+1)            // sizes that need more and fewer chunks
+  { EXPECT_TRUE(CHAN_SUCCESS(Chan_Vec_Size(q,v,n)));
+    EXPECT_EQ(n,v->nbytes);
+    for(size_t i=0;i<v->count;++i)
+      memset(v->iov[i].base,(int)(n&0xff),v->iov[i].len);
+    EXPECT_TRUE(CHAN_SUCCESS(Chan_Next_Vec(w,&v)));
+  }
+  Chan_Token_Buffer_Free(v);
+  Chan_Close(w);
+  return NULL;
+}
+
+TEST(ChanVecTest,ChunkedMessages)
+{ Chan *q=Chan_Alloc_Vec(2,40000,1024),
+       *r=Chan_Open(q,CHAN_READ);
+  ChanVec *v=Chan_Vec_Alloc(q);
+  ASSERT_TRUE(q && v);
+  EXPECT_TRUE(CHAN_FAILURE(Chan_Vec_Size(q,v,40001)));
+  Thread *t=Thread_Alloc(vec_producer,q);
+  Chan_Wait_For_Writer_Count(q,1);
+  size_t expect=1;
+  while(CHAN_SUCCESS(Chan_Next_Vec(r,&v)))
+  { size_t total=0;
+    EXPECT_EQ(expect,v->nbytes);
+    EXPECT_EQ((expect+1023)/1024,v->count);
+    for(size_t i=0;i<v->count;++i)
+    { const char *c=(const char*)v->iov[i].base;
+      EXPECT_EQ((char)(expect&0xff),c[0]);
+      EXPECT_EQ((char)(expect&0xff),c[v->iov[i].len-1]);
+      total+=v->iov[i].len;
+    }
+    EXPECT_EQ(expect,total);
+    expect=expect*3+1;
+  }
+  EXPECT_GT(expect,40000u);
+  Thread_Join(t);
+  Thread_Free(t);
+  Chan_Token_Buffer_Free(v);
+  Chan_Close(r);
+  Chan_Close(q);
+}
+
+static void vec_pattern(ChanVec *v, int check)  // byte i of a message is i*7
+{ size_t k=0;
+  for(size_t i=0;i<v->count;++i)
+    for(size_t j=0;j<v->iov[i].len;++j,++k)
+    { char *c=(char*)v->iov[i].base+j;
+      if(!check)              *c=(char)(k*7);
+      else if(*c!=(char)(k*7)) { ADD_FAILURE() << "byte " << k; return; }
+    }
+  EXPECT_EQ(k,v->nbytes);
+}
+
+TEST(ChanVecTest,ForwardsBetweenChannels)
+{ size_t chunks[]={1024,512};                  // chunks move, then get copied
+  for(int m=0;m<2;++m)
+  { Chan *a=Chan_Alloc_Vec(2,10000,1024),
+         *b=Chan_Alloc_Vec(2,10000,chunks[m]),
+         *aw=Chan_Open(a,CHAN_WRITE),*ar=Chan_Open(a,CHAN_READ),
+         *bw=Chan_Open(b,CHAN_WRITE),*br=Chan_Open(b,CHAN_READ);
+    ChanVec *v=Chan_Vec_Alloc(a),
+            *t=Chan_Vec_Alloc(a),
+            *u=Chan_Vec_Alloc(a);                // a's token for b's reader, too
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Vec_Size(a,v,5000)));
+    vec_pattern(v,0);
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next_Vec(aw,&v)));
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next_Vec(ar,&t)));
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next_Vec(bw,&t))); // a's message into b
+    ASSERT_TRUE(CHAN_SUCCESS(Chan_Next_Vec(br,&u)));
+    EXPECT_EQ(5000u,u->nbytes);
+    EXPECT_EQ((5000+chunks[m]-1)/chunks[m],u->count);
+    vec_pattern(u,1);
+    Chan_Token_Buffer_Free(v);
+    Chan_Token_Buffer_Free(t);
+    Chan_Token_Buffer_Free(u);
+    Chan_Close(br); Chan_Close(bw); Chan_Close(b);
+    Chan_Close(ar); Chan_Close(aw); Chan_Close(a);
+  }
+}
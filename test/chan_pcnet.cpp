@@ -99,7 +99,7 @@ typedef struct _input
 #define GETNEXT(e)     (((input_t*)(e))->next) 
 #define GETNEXTCHAN(e) GETCHAN(GETNEXT(e))
 #define GETID(e)       (((input_t*)(e))->id)
-#define GETTEST(e)     (((input_t*)(e))->test) 
+#define GETFIXTURE(e)     (((input_t*)(e))->test) 
 
 void ChanPCNetTest::exec_one_chan(ThreadProc *procs,size_t n)
 { 
@@ -198,7 +198,7 @@ void* producer(void* arg)
 { Chan* writer;
   int*  buf;
   size_t id;
-  ChanPCNetTest *test = GETTEST(arg);
+  ChanPCNetTest *test = GETFIXTURE(arg);
   
   id = GETID(arg);
   writer = Chan_Open(GETCHAN(arg),CHAN_WRITE);
@@ -232,7 +232,7 @@ void* consumer(void* arg)
 { Chan* reader;
   int*  buf;
   size_t id;
-  ChanPCNetTest *test = GETTEST(arg);
+  ChanPCNetTest *test = GETFIXTURE(arg);
   
   id = GETID(arg);
   reader = Chan_Open(GETCHAN(arg),CHAN_READ);
@@ -257,7 +257,7 @@ void* processor(void* arg)
 { Chan *reader,*writer;
   int  *buf;
   size_t id;
-  ChanPCNetTest *test = GETTEST(arg);
+  ChanPCNetTest *test = GETFIXTURE(arg);
   
   id = GETID(arg);
   reader = Chan_Open(GETCHAN(arg),CHAN_READ);
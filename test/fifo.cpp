@@ -92,3 +92,81 @@ TEST_F(FifoTest,PeekFull)
 }
 
 
+
+TEST(FifoInlineTest,CopiesInOrderThroughExpandAndResize)
+{ Fifo *f=Fifo_Alloc_Inline(4,sizeof(int));
+  int v,*p=&v;
+  void *buf=p;
+  ASSERT_TRUE(f!=NULL);
+  EXPECT_TRUE(Fifo_Alloc_Inline(4,FIFO_INLINE_MAX_BYTES+1)==NULL);
+  for(int i=0;i<3;++i)                       // wrap the cursors around
+  { v=i;
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push_Try(f,&buf,sizeof(int))));
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Pop(f,&buf,sizeof(int))));
+    EXPECT_EQ(i,v);
+  }
+  for(v=0;v<4;++v)
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push_Try(f,&buf,sizeof(int))));
+  EXPECT_TRUE(Fifo_Is_Full(f));
+  EXPECT_EQ(p,buf);                           // the token stays with the caller
+  v=4;
+  EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push(f,&buf,sizeof(int),1)));
+  EXPECT_EQ(8u,Fifo_Buffer_Count(f));
+  EXPECT_TRUE(FIFO_SUCCESS(Fifo_Peek_At(f,&buf,sizeof(int),4)));
+  EXPECT_EQ(4,v);
+
+  // past the inline limit messages move to separate buffers
+  Fifo_Resize(f,FIFO_INLINE_MAX_BYTES+1);
+  EXPECT_EQ((size_t)FIFO_INLINE_MAX_BYTES+1,Fifo_Buffer_Size_Bytes(f));
+  void *big=Fifo_Alloc_Token_Buffer(f);
+  for(int i=0;i<5;++i)
+  { EXPECT_TRUE(FIFO_SUCCESS(Fifo_Pop(f,&big,Fifo_Buffer_Size_Bytes(f))));
+    EXPECT_EQ(i,*(int*)big);
+  }
+  EXPECT_TRUE(Fifo_Is_Empty(f));
+  Fifo_Free_Token_Buffer(big);
+  Fifo_Free(f);
+}
+
+TEST(FifoRealtimeTest,OverwriteRejectsBadTokens)
+{ Fifo *f=Fifo_Alloc_Realtime(2,16,0);
+  void *tok=Fifo_Alloc_Token_Buffer(f),*null=NULL,*first;
+  ASSERT_TRUE(f!=NULL);
+  while(!Fifo_Is_Full(f))
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push_Try(f,&tok,16)));
+  EXPECT_EQ(2u,Fifo_Push(f,&null,16,0));      // full: would overwrite
+  EXPECT_EQ(2u,Fifo_Push(f,&tok,8,0));
+  EXPECT_TRUE(null==NULL);
+  first=tok;
+  EXPECT_EQ(1u,Fifo_Push(f,&tok,16,0));      // overwrote the oldest
+  EXPECT_NE(first,tok);
+  while(!Fifo_Is_Empty(f))
+  { EXPECT_TRUE(FIFO_SUCCESS(Fifo_Pop(f,&tok,16)));
+    EXPECT_TRUE(tok!=NULL);
+  }
+  Fifo_Free_Token_Buffer(tok);
+  Fifo_Free(f);
+}
+
+TEST(FifoInPlaceTest,LengthsSurviveExpand)
+{ Fifo *fs[]={Fifo_Alloc(2,16),Fifo_Alloc_Inline(2,16)};
+  for(int k=0;k<2;++k)
+  { Fifo *f=fs[k];
+    void *tok=Fifo_Alloc_Token_Buffer(f);
+    size_t n;
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push_Try(f,&tok,16)));
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Pop(f,&tok,16)));  // so the queue wraps
+    Fifo_Commit(f,5);
+    EXPECT_TRUE(FIFO_SUCCESS(Fifo_Push_Try(f,&tok,6)));
+    EXPECT_TRUE(Fifo_Is_Full(f));
+    Fifo_Expand(f);
+    Fifo_Commit(f,7);
+    for(size_t len=5;len<=7;++len)
+    { ASSERT_TRUE(Fifo_Acquire(f,&n)!=NULL);
+      EXPECT_EQ(len,n);
+      Fifo_Release(f);
+    }
+    Fifo_Free_Token_Buffer(tok);
+    Fifo_Free(f);
+  }
+}
@@ -0,0 +1,871 @@
+#include "mapreduce.h"
+#include "mrkernels.h"
+#include "thread.h"
+#include <gtest/gtest.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#define W 512
+#define H 512
+
+static int grayscale(void *_dst, void *_src)
+{ double        *dst = (double*) _dst;
+  unsigned char *src = (unsigned char*) _src;
+  *dst = 0.630*src[0] + 0.310*src[1] + 0.155*src[2];
+  return 0;
+}
+
+static int fail_at_100(void *_dst, void *_src)
+{ return *(unsigned char*)_src==100;
+}
+
+class MapTest:public ::testing::Test
+{ protected:
+  virtual void SetUp()
+  { for(int i=0;i<W*H*3;++i)
+      image[i]=(unsigned char)(i%101);
+    MRSetWorkerThreadCount(4);
+    MRSetGrainSize(0);
+  }
+  virtual void TearDown()
+  { MRSetWorkerThreadCount(0);
+    MRSetGrainSize(0);
+    MRSetCalibration(0);
+    MRResetCalibration();
+  }
+  void check(const double *out)
+  { for(int i=0;i<W*H;++i)
+    { unsigned char *p=image+3*i;
+      ASSERT_DOUBLE_EQ(0.630*p[0]+0.310*p[1]+0.155*p[2],out[i]) << "at " << i;
+    }
+  }
+  unsigned char image[W*H*3];
+};
+
+TEST_F(MapTest,AllocatesResult)
+{ MRData result = map(MREmpty(sizeof(double)),MRPackage(image,3,sizeof(image)),grayscale);
+  ASSERT_NE((void*)NULL,result.data);
+  EXPECT_EQ(sizeof(double),result.bytesof_elem);
+  EXPECT_EQ(W*H*sizeof(double),result.bytesof_data);
+  check((double*)result.data);
+  MRRelease(&result);
+  EXPECT_EQ((void*)NULL,result.data);
+}
+
+TEST_F(MapTest,Preallocated)
+{ static double out[W*H];
+  MRData result = map(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),grayscale);
+  EXPECT_EQ((char*)out,result.data);
+  check(out);
+}
+
+TEST_F(MapTest,DestinationTooSmall)
+{ static double out[W*H];
+  MRData result = map(MRPackage(out,8,sizeof(out)/2),MRPackage(image,3,sizeof(image)),grayscale);
+  EXPECT_EQ((void*)NULL,result.data);
+}
+
+TEST_F(MapTest,GrainSizes)
+{ static double out[W*H];
+  size_t grains[] = {1,7,1000,W*H,10*W*H};
+  for(size_t i=0;i<sizeof(grains)/sizeof(*grains);++i)
+  { memset(out,0,sizeof(out));
+    MRSetGrainSize(grains[i]);
+    ASSERT_NE((void*)NULL,map(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),grayscale).data);
+    check(out);
+  }
+}
+
+TEST_F(MapTest,SingleThread)
+{ static double out[W*H];
+  MRSetWorkerThreadCount(1);
+  ASSERT_NE((void*)NULL,map(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),grayscale).data);
+  check(out);
+}
+
+TEST_F(MapTest,Failure)
+{ MRData result = map(MREmpty(sizeof(double)),MRPackage(image,3,sizeof(image)),fail_at_100);
+  EXPECT_EQ((void*)NULL,result.data);
+}
+
+TEST_F(MapTest,SpanWithContext)
+{ static double out[W*H];
+  MRGrayWeights w = {0.630,0.310,0.155};
+  MRSetGrainSize(1001); // ragged chunks
+  ASSERT_NE((void*)NULL,map_span(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),MRKernel_Gray_RGB8_F64,&w).data);
+  check(out);
+}
+
+TEST_F(MapTest,KernelFallbacks)
+{ static double ref[W*H],out[W*H];
+  const size_t n = 1031; // exercises the scalar tails
+  unsigned masks[] = {MR_CPU_SSE41,MR_CPU_AVX2|MR_CPU_SSE41};
+  MRSetCpuFeatureMask(0);
+  MRKernel_Gray_RGB8_F64(ref,image,n,NULL);
+  for(size_t i=0;i<sizeof(masks)/sizeof(*masks);++i)
+  { MRSetCpuFeatureMask(masks[i]);
+    memset(out,0,sizeof(out));
+    MRKernel_Gray_RGB8_F64(out,image,n,NULL);
+    for(size_t j=0;j<n;++j)
+      ASSERT_DOUBLE_EQ(ref[j],out[j]) << "mask " << masks[i] << " at " << j;
+    EXPECT_EQ(0.0,out[n]);
+  }
+  MRSetCpuFeatureMask((unsigned)-1);
+  EXPECT_DOUBLE_EQ(0.299*image[0]+0.587*image[1]+0.114*image[2],ref[0]);
+}
+
+TEST_F(MapTest,Calibration)
+{ static double out[W*H];
+  MRSetCalibration(1);
+  MRResetCalibration();
+  for(int i=0;i<10;++i)
+  { memset(out,0,sizeof(out));
+    ASSERT_NE((void*)NULL,map(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),grayscale).data);
+    check(out);
+  }
+  MRCalibration c[8];
+  ASSERT_EQ(1u,MRGetCalibration(c,8));
+  EXPECT_EQ((const void*)grayscale,c[0].f);
+  EXPECT_EQ(5u,c[0].trials);  // 1,2,4 workers then two chunkings
+  EXPECT_GE(c[0].nworkers,1u);
+  EXPECT_LE(c[0].nworkers,4u);
+  EXPECT_TRUE(c[0].chunks_per_worker==1 || c[0].chunks_per_worker==4 || c[0].chunks_per_worker==16);
+  EXPECT_GT(c[0].bytes_per_second,0.0);
+  EXPECT_GT(c[0].speedup,0.0);
+
+  // a different size class gets its own entry
+  ASSERT_NE((void*)NULL,map(MRPackage(out,8,sizeof(out)/4),MRPackage(image,3,sizeof(image)/8),grayscale).data);
+  EXPECT_EQ(2u,MRGetCalibration(c,8));
+  MRResetCalibration();
+  EXPECT_EQ(0u,MRGetCalibration(c,8));
+}
+
+//
+// map_stream
+//
+
+#define NTOK   200
+#define TOKLEN 64
+
+static int double_ints(void *_dst, const void *_src, size_t n, void *ctx)
+{ const int *src=(const int*)_src;
+  volatile int spin=0;
+  for(int i=0;i<(src[0]%7)*1000;++i) spin++; // uneven cost per token
+  for(size_t i=0;i<n;++i)
+    ((int*)_dst)[i]=2*src[i];
+  return 0;
+}
+
+static int fail_on_13(void *_dst, const void *_src, size_t n, void *ctx)
+{ return ((const int*)_src)[0]==13*TOKLEN;
+}
+
+static void* produce(void *writer)
+{ int *buf=(int*)Chan_Token_Buffer_Alloc((Chan*)writer);
+  for(int k=0;k<NTOK;++k)
+  { for(int i=0;i<TOKLEN;++i) buf[i]=k*TOKLEN+i;
+    Chan_Next((Chan*)writer,(void**)&buf,TOKLEN*sizeof(int));
+  }
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close((Chan*)writer);
+  return NULL;
+}
+
+static int run_stream(MRSpanFunction f, int ordered, int *seen)
+{ Chan *in =Chan_Alloc(4,TOKLEN*sizeof(int)),
+       *out=Chan_Alloc(256,TOKLEN*sizeof(int));
+  Chan *w=Chan_Open(in,CHAN_WRITE),
+       *r=Chan_Open(in,CHAN_READ),
+       *ow=Chan_Open(out,CHAN_WRITE);
+  Thread *t=Thread_Alloc(produce,w);
+  int err=map_stream(r,ow,sizeof(int),f,NULL,4,ordered);
+  Thread_Join(t);
+  Thread_Free(t);
+  Chan_Close(ow);
+  Chan_Close(r);
+  Chan *or_=Chan_Open(out,CHAN_READ);
+  int *buf=(int*)Chan_Token_Buffer_Alloc(out),n=0;
+  while(CHAN_SUCCESS(Chan_Next(or_,(void**)&buf,TOKLEN*sizeof(int))))
+    seen[n++]=buf[0]/(2*TOKLEN);
+  Chan_Token_Buffer_Free(buf);
+  Chan_Close(or_);
+  Chan_Close(out);
+  Chan_Close(in);
+  return err?-1:n;
+}
+
+TEST(StreamTest,Ordered)
+{ int seen[NTOK];
+  ASSERT_EQ(NTOK,run_stream(double_ints,1,seen));
+  for(int k=0;k<NTOK;++k)
+    ASSERT_EQ(k,seen[k]);
+}
+
+TEST(StreamTest,Unordered)
+{ int seen[NTOK],count[NTOK]={0};
+  ASSERT_EQ(NTOK,run_stream(double_ints,0,seen));
+  for(int k=0;k<NTOK;++k)
+    count[seen[k]]++;
+  for(int k=0;k<NTOK;++k)
+    ASSERT_EQ(1,count[k]);
+}
+
+TEST(StreamTest,Failure)
+{ int seen[NTOK];
+  EXPECT_EQ(-1,run_stream(fail_on_13,1,seen));
+}
+
+TEST(StreamTest,OutputTooSmall)
+{ Chan *in =Chan_Alloc(4,TOKLEN*sizeof(int)),
+       *out=Chan_Alloc(4,TOKLEN*sizeof(int)/2);
+  Chan *r=Chan_Open(in,CHAN_READ),
+       *ow=Chan_Open(out,CHAN_WRITE);
+  EXPECT_EQ(1,map_stream(r,ow,sizeof(int),double_ints,NULL,4,1));
+  Chan_Close(ow);
+  Chan_Close(r);
+  Chan_Close(out);
+  Chan_Close(in);
+}
+
+//
+// MRLazy
+//
+
+static int scale_span(void *_dst, const void *_src, size_t n, void *ctx)
+{ for(size_t i=0;i<n;++i)
+    ((double*)_dst)[i] = ((const double*)_src)[i]*(*(double*)ctx);
+  return 0;
+}
+
+static int clamp_u8(void *_dst, void *_src)
+{ double v = *(double*)_src;
+  *(unsigned char*)_dst = (unsigned char)(v<0?0:(v>255?255:v));
+  return 0;
+}
+
+TEST_F(MapTest,LazyFused)
+{ static unsigned char out[W*H];
+  double k = 1.5;
+  MRLazy *e = MRLazy_Alloc(MRPackage(image,3,sizeof(image)));
+  ASSERT_NE((void*)NULL,e);
+  ASSERT_EQ(0,MRLazy_Map(e,grayscale,sizeof(double)));
+  ASSERT_EQ(0,MRLazy_Map_Span(e,scale_span,sizeof(double),&k));
+  ASSERT_EQ(0,MRLazy_Map(e,clamp_u8,1));
+  EXPECT_EQ((void*)NULL,MRLazy_Eval(e,MRPackage(out,8,sizeof(out)*8)).data); // wrong element size
+  for(int pass=0;pass<2;++pass)
+  { MRSetGrainSize(pass?777:0);
+    memset(out,0,sizeof(out));
+    ASSERT_EQ((char*)out,MRLazy_Eval(e,MRPackage(out,1,sizeof(out))).data);
+    for(int i=0;i<W*H;++i)
+    { unsigned char *p=image+3*i;
+      double v=(0.630*p[0]+0.310*p[1]+0.155*p[2])*k;
+      ASSERT_EQ((unsigned char)(v>255?255:v),out[i]) << "at " << i;
+    }
+  }
+  MRLazy_Free(e);
+}
+
+TEST_F(MapTest,LazyFailure)
+{ MRLazy *e = MRLazy_Alloc(MRPackage(image,3,sizeof(image)));
+  ASSERT_EQ(0,MRLazy_Map(e,fail_at_100,sizeof(double)));
+  ASSERT_EQ(0,MRLazy_Map(e,clamp_u8,1));
+  EXPECT_EQ((void*)NULL,MRLazy_Eval(e,MREmpty(1)).data);
+  MRLazy_Free(e);
+}
+
+//
+// map_tiled
+//
+
+#define TW 301
+#define TH 203
+
+static int box3(const MRTile *t, void *ctx)
+{ for(size_t y=0;y<t->h;++y)
+  { float *out = (float*)(t->dst+y*t->dst_stride);
+    for(size_t x=0;x<t->w;++x)
+    { float acc=0;
+      for(int dy=-1;dy<=1;++dy)
+        for(int dx=-1;dx<=1;++dx)
+          acc+=((const float*)(t->src+(long)(y+dy)*(long)t->src_stride))[(long)x+dx];
+      out[x]=acc;
+    }
+  }
+  return 0;
+}
+
+static int negate(const MRTile *t, void *ctx)
+{ for(size_t y=0;y<t->h;++y)
+    for(size_t x=0;x<t->w;++x)
+      ((int*)(t->dst+y*t->dst_stride))[x] = -((const int*)(t->src+y*t->src_stride))[x];
+  return 0;
+}
+
+static float at(const float *im, long x, long y)
+{ x = x<0?0:(x>=TW?TW-1:x);
+  y = y<0?0:(y>=TH?TH-1:y);
+  return im[y*TW+x];
+}
+
+TEST_F(MapTest,TiledHalo)
+{ static float im[TW*TH];
+  for(int i=0;i<TW*TH;++i) im[i]=(float)(i%97);
+  size_t sizes[][2] = {{0,0},{7,5},{1,1},{TW,TH},{1000,1000}};
+  for(size_t k=0;k<sizeof(sizes)/sizeof(*sizes);++k)
+  { MRSetTileSize(sizes[k][0],sizes[k][1]);
+    MRData2D out = map_tiled(MREmpty2D(sizeof(float)),MRPackage2D(im,sizeof(float),TW,TH,0),box3,1,NULL);
+    ASSERT_NE((void*)NULL,out.data);
+    EXPECT_EQ(TW*sizeof(float),out.stride);
+    for(long y=0;y<TH;++y)
+      for(long x=0;x<TW;++x)
+      { float e=0;
+        for(int dy=-1;dy<=1;++dy)
+          for(int dx=-1;dx<=1;++dx)
+            e+=at(im,x+dx,y+dy);
+        ASSERT_EQ(e,((float*)(out.data+y*out.stride))[x]) << "tile " << k << " at " << x << "," << y;
+      }
+    MRRelease2D(&out);
+  }
+  MRSetTileSize(0,0);
+}
+
+TEST_F(MapTest,TiledStrided)
+{ // src rows padded to 512 ints, dst a sub-rectangle of a bigger image
+  static int src[TH*512],dst[(TH+10)*1024];
+  for(int i=0;i<TH*512;++i) src[i]=i;
+  MRSetTileSize(64,16);
+  MRData2D out = map_tiled(MRPackage2D(dst,sizeof(int),1024,TH+10,0),
+                           MRPackage2D(src,sizeof(int),TW,TH,512*sizeof(int)),negate,0,NULL);
+  ASSERT_EQ((char*)dst,out.data);
+  for(int y=0;y<TH;++y)
+    for(int x=0;x<TW;++x)
+      ASSERT_EQ(-src[y*512+x],dst[y*1024+x]);
+  EXPECT_EQ(0,dst[TW]);
+  MRSetTileSize(0,0);
+}
+
+TEST_F(MapTest,WorkerAttributes)
+{ static double out[W*H];
+  unsigned cpu=0;
+  ThreadAttr attr={0};
+  attr.cpus=&cpu;
+  attr.ncpus=1;
+  attr.one_cpu_each=1;
+  attr.name="mr";
+  MRSetGrainSize(1000);
+  MRSetWorkerAttributes(&attr);
+  MRData result = map(MRPackage(out,8,sizeof(out)),MRPackage(image,3,sizeof(image)),grayscale);
+  MRSetWorkerAttributes(NULL);
+  EXPECT_EQ((char*)out,result.data);
+  check(out);
+}
+
+static int axpy(void *dst, size_t dst_stride, const void *const *src, const size_t *src_strides, size_t n, void *ctx)
+{ double a=*(double*)ctx;
+  for(size_t i=0;i<n;++i)
+    *(double*)((char*)dst+i*dst_stride) = a*(*(const double*)((const char*)src[0]+i*src_strides[0]))
+                                            +*(const double*)((const char*)src[1]+i*src_strides[1]);
+  return 0;
+}
+
+static int average_u8(void *dst, size_t dst_stride, const void *const *src, const size_t *src_strides, size_t n, void *ctx)
+{ for(size_t i=0;i<n;++i)
+    ((unsigned char*)dst)[i*dst_stride] = (unsigned char)((((const unsigned char*)src[0])[i*src_strides[0]]
+                                                          +((const unsigned char*)src[1])[i*src_strides[1]])/2);
+  return 0;
+}
+
+TEST_F(MapTest,NaryAxpy)
+{ enum { N=100000 };
+  static double x[N],y[N];
+  double a=2.5;
+  for(int i=0;i<N;++i) { x[i]=i; y[i]=N-i; }
+  MRStrided in[2]={MRPackageStrided(x,sizeof(double),0,N),MRPackageStrided(y,sizeof(double),0,N)};
+  MRStrided r=map_n(MRPackageStrided(NULL,sizeof(double),0,0),in,2,axpy,&a);
+  ASSERT_NE((void*)NULL,r.data);
+  ASSERT_EQ((size_t)N,r.count);
+  for(int i=0;i<N;++i)
+    ASSERT_EQ(a*x[i]+y[i],((double*)r.data)[i]) << i;
+  free(r.data);
+  // in place, every other element
+  r=map_n(MRPackageStrided(y,sizeof(double),2*sizeof(double),N/2),in,2,axpy,&a);
+  EXPECT_EQ((void*)NULL,r.data); // operands are longer than dst
+  MRStrided half[2]={MRPackageStrided(x,sizeof(double),2*sizeof(double),N/2),MRPackageStrided(y,sizeof(double),2*sizeof(double),N/2)};
+  r=map_n(half[1],half,2,axpy,&a);
+  ASSERT_EQ((char*)y,r.data);
+  for(int i=0;i<N;++i)
+    ASSERT_EQ(i%2?(double)(N-i):a*i+(N-i),y[i]) << i;
+  EXPECT_EQ((void*)NULL,map_n(half[1],half,0,axpy,&a).data);
+}
+
+TEST_F(MapTest,NaryInterleaved)
+{ const size_t n=640*480;
+  std::vector<unsigned char> rgb(3*n);
+  for(size_t i=0;i<rgb.size();++i) rgb[i]=(unsigned char)(i*7919);
+  std::vector<unsigned char> orig(rgb);
+  unsigned char *p=&rgb[0];
+  MRStrided rb[2]={MRPackageStrided(p,1,3,n),MRPackageStrided(p+2,1,3,n)};
+  MRStrided r=map_n(MRPackageStrided(p+1,1,3,n),rb,2,average_u8,NULL); // green = (red+blue)/2
+  ASSERT_EQ((char*)p+1,r.data);
+  for(size_t i=0;i<n;++i)
+  { ASSERT_EQ(orig[3*i],rgb[3*i]);
+    ASSERT_EQ((orig[3*i]+orig[3*i+2])/2,rgb[3*i+1]) << i;
+    ASSERT_EQ(orig[3*i+2],rgb[3*i+2]);
+  }
+}
+
+//
+// foldl
+//
+
+#define N (1<<20)
+#define P 1000003
+
+static int add_int(void *acc, void *x)
+{ *(long long*)acc += *(int*)x;
+  return 0;
+}
+
+static int add_ll(void *acc, void *x)
+{ *(long long*)acc += *(long long*)x;
+  return 0;
+}
+
+// x -> a*x+b (mod P).  Composition is associative but not commutative.
+typedef struct _affine { long long a,b; } affine;
+static int compose(void *acc_, void *x_)
+{ affine *acc=(affine*)acc_,*x=(affine*)x_;
+  acc->a = (x->a*acc->a)%P;
+  acc->b = (x->a*acc->b+x->b)%P;
+  return 0;
+}
+
+static int bin(void *h, void *x)
+{ ((unsigned*)h)[*(unsigned char*)x]++;
+  return 0;
+}
+
+static int merge(void *h, void *o)
+{ for(int i=0;i<256;++i)
+    ((unsigned*)h)[i]+=((unsigned*)o)[i];
+  return 0;
+}
+
+// Not associative.
+static int decay(void *acc, void *x)
+{ *(double*)acc = 0.5*(*(double*)acc) + *(double*)x;
+  return 0;
+}
+
+class FoldTest:public ::testing::Test
+{ protected:
+  virtual void SetUp()
+  { MRSetWorkerThreadCount(4);
+    MRSetGrainSize(0);
+  }
+  virtual void TearDown()
+  { MRSetWorkerThreadCount(0);
+    MRSetGrainSize(0);
+  }
+};
+
+TEST_F(FoldTest,Sum)
+{ static int data[N];
+  long long sum=0;
+  for(int i=0;i<N;++i) data[i]=i;
+  MRData r = foldl_ex(MRPackage(&sum,sizeof(sum),sizeof(sum)),MRPackage(data,sizeof(int),sizeof(data)),add_int,add_ll,MR_FOLD_ASSOCIATIVE);
+  EXPECT_EQ((char*)&sum,r.data);
+  EXPECT_EQ((long long)N*(N-1)/2,sum);
+}
+
+TEST_F(FoldTest,AllocatesAccumulator)
+{ static long long data[N];
+  for(int i=0;i<N;++i) data[i]=1;
+  MRData r = foldl(MREmpty(sizeof(long long)),MRPackage(data,sizeof(long long),sizeof(data)),add_ll);
+  ASSERT_NE((void*)NULL,r.data);
+  EXPECT_EQ(N,*(long long*)r.data);
+  MRRelease(&r);
+}
+
+TEST_F(FoldTest,OrderPreserved)
+{ static affine data[N/4];
+  affine serial={1,0},par={1,0};
+  for(int i=0;i<N/4;++i)
+  { data[i].a=(i*7+3)%P;
+    data[i].b=(i*13+5)%P;
+    compose(&serial,data+i);
+  }
+  size_t grains[]={0,1,3,1000};
+  for(size_t g=0;g<sizeof(grains)/sizeof(*grains);++g)
+  { MRSetGrainSize(grains[g]);
+    par.a=1; par.b=0;
+    ASSERT_NE((void*)NULL,foldl(MRPackage(&par,sizeof(par),sizeof(par)),MRPackage(data,sizeof(affine),sizeof(data)),compose).data);
+    EXPECT_EQ(serial.a,par.a);
+    EXPECT_EQ(serial.b,par.b);
+  }
+}
+
+TEST_F(FoldTest,Histogram)
+{ static unsigned char pixels[N];
+  unsigned hist[256]={0};
+  for(int i=0;i<N;++i) pixels[i]=(unsigned char)(i%256);
+  ASSERT_NE((void*)NULL,foldl_ex(MRPackage(hist,sizeof(hist),sizeof(hist)),MRPackage(pixels,1,N),bin,merge,MR_FOLD_COMMUTATIVE).data);
+  for(int i=0;i<256;++i)
+    EXPECT_EQ(N/256,hist[i]);
+}
+
+TEST_F(FoldTest,Strict)
+{ static double data[1000];
+  double serial=1.0,out=1.0;
+  for(int i=0;i<1000;++i)
+  { data[i]=i%17;
+    decay(&serial,data+i);
+  }
+  foldl_ex(MRPackage(&out,sizeof(out),sizeof(out)),MRPackage(data,sizeof(double),sizeof(data)),decay,NULL,MR_FOLD_STRICT);
+  EXPECT_EQ(serial,out);
+}
+
+// Reference results for foldl_reduce(), computed serially in double.
+template<class T> static void reference(const T *x, const T *y, size_t n, double *sum, double *mn, double *mx, double *dot)
+{ *sum=*dot=0.0; *mn=*mx=x[0];
+  for(size_t i=0;i<n;++i)
+  { *sum+=x[i];
+    *dot+=(double)x[i]*y[i];
+    if(x[i]<*mn) *mn=x[i];
+    if(x[i]>*mx) *mx=x[i];
+  }
+}
+
+template<class T> static void check_reduce(MRType type, const T *x, const T *y, size_t n)
+{ double sum,mn,mx,dot;
+  int isfloat = (type==MR_F32 || type==MR_F64);
+  reference(x,y,n,&sum,&mn,&mx,&dot);
+  MRData src = MRPackage((void*)x,sizeof(T),n*sizeof(T));
+  if(isfloat)
+  { double s,d;
+    T m;
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&s,sizeof(s),sizeof(s)),src,type,MR_SUM,NULL).data);
+    EXPECT_EQ(sum,s);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&d,sizeof(d),sizeof(d)),src,type,MR_DOT,y).data);
+    EXPECT_EQ(dot,d);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m,sizeof(m),sizeof(m)),src,type,MR_MIN,NULL).data);
+    EXPECT_EQ(mn,m);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m,sizeof(m),sizeof(m)),src,type,MR_MAX,NULL).data);
+    EXPECT_EQ(mx,m);
+  } else
+  { unsigned long long s,d;
+    T m;
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&s,sizeof(s),sizeof(s)),src,type,MR_SUM,NULL).data);
+    EXPECT_EQ((unsigned long long)sum,s);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&d,sizeof(d),sizeof(d)),src,type,MR_DOT,y).data);
+    EXPECT_EQ((unsigned long long)dot,d);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m,sizeof(m),sizeof(m)),src,type,MR_MIN,NULL).data);
+    EXPECT_EQ((T)mn,m);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m,sizeof(m),sizeof(m)),src,type,MR_MAX,NULL).data);
+    EXPECT_EQ((T)mx,m);
+  }
+}
+
+TEST_F(FoldTest,BuiltinReductions)
+{ const size_t n = N+13; // ragged tails everywhere
+  static unsigned char  a8[N+13], b8[N+13];
+  static unsigned short a16[N+13],b16[N+13];
+  static float          a32[N+13],b32[N+13];
+  static double         a64[N+13],b64[N+13];
+  for(size_t i=0;i<n;++i)
+  { a8[i] =(unsigned char)(i*7+11);   b8[i] =(unsigned char)(255-i%256);
+    a16[i]=(unsigned short)(i*31+5);  b16[i]=(unsigned short)(65535-i%1000);
+    a32[i]=(float)((i*37)%1001)-500;  b32[i]=(float)(i%3);
+    a64[i]=(double)((i*41)%2003)-1000;b64[i]=(double)(i%5);
+  }
+  unsigned masks[] = {0,MR_CPU_SSE41,MR_CPU_AVX2|MR_CPU_SSE41};
+  for(size_t k=0;k<sizeof(masks)/sizeof(*masks);++k)
+  { SCOPED_TRACE(masks[k]);
+    MRSetCpuFeatureMask(masks[k]);
+    check_reduce(MR_U8 ,a8 ,b8 ,n);
+    check_reduce(MR_U16,a16,b16,n);
+    check_reduce(MR_F32,a32,b32,n);
+    check_reduce(MR_F64,a64,b64,n);
+
+    // infinities must survive min and max
+    for(size_t i=0;i<100;++i) { a32[i]=HUGE_VALF; a64[i]=-HUGE_VAL; }
+    float  m32;
+    double m64;
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m32,sizeof(m32),sizeof(m32)),MRPackage(a32,sizeof(float),100*sizeof(float)),MR_F32,MR_MIN,NULL).data);
+    EXPECT_EQ(HUGE_VALF,m32);
+    ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(&m64,sizeof(m64),sizeof(m64)),MRPackage(a64,sizeof(double),100*sizeof(double)),MR_F64,MR_MAX,NULL).data);
+    EXPECT_EQ(-HUGE_VAL,m64);
+    for(size_t i=0;i<100;++i)
+    { a32[i]=(float)((i*37)%1001)-500;
+      a64[i]=(double)((i*41)%2003)-1000;
+    }
+  }
+  MRSetCpuFeatureMask((unsigned)-1);
+
+  // element size must match the type
+  double s;
+  EXPECT_EQ((void*)NULL,foldl_reduce(MRPackage(&s,sizeof(s),sizeof(s)),MRPackage(a32,1,n*sizeof(float)),MR_F32,MR_SUM,NULL).data);
+}
+
+TEST_F(FoldTest,BuiltinHistogram)
+{ static unsigned short pixels[N];
+  for(int i=0;i<N;++i) pixels[i]=(unsigned short)(i%4096);
+  MRData r = foldl_reduce(MREmpty(MRReduceBytes(MR_U16,MR_HISTOGRAM)),MRPackage(pixels,2,sizeof(pixels)),MR_U16,MR_HISTOGRAM,NULL);
+  ASSERT_NE((void*)NULL,r.data);
+  for(int i=0;i<65536;++i)
+    ASSERT_EQ((unsigned long long)(i<4096?N/4096:0),((unsigned long long*)r.data)[i]) << "bin " << i;
+  MRRelease(&r);
+
+  unsigned long long h8[256];
+  ASSERT_NE((void*)NULL,foldl_reduce(MRPackage(h8,sizeof(h8),sizeof(h8)),MRPackage(pixels,1,sizeof(pixels)),MR_U8,MR_HISTOGRAM,NULL).data);
+  unsigned long long total=0;
+  for(int i=0;i<256;++i) total+=h8[i];
+  EXPECT_EQ((unsigned long long)sizeof(pixels),total);
+  EXPECT_EQ(0u,MRReduceBytes(MR_F32,MR_HISTOGRAM));
+}
+
+//
+// scan
+//
+
+TEST_F(FoldTest,ScanAdd)
+{ static int data[N],out[N];
+  for(int i=0;i<N;++i) data[i]=(i*7)%13-6;
+  size_t grains[]={0,1,5,1000};
+  for(size_t g=0;g<sizeof(grains)/sizeof(*grains);++g)
+  { MRSetGrainSize(grains[g]);
+    ASSERT_EQ((char*)out,scan(MRPackage(out,sizeof(int),sizeof(out)),MRPackage(data,sizeof(int),sizeof(data)),MRAdd_I32,NULL,MR_SCAN_INCLUSIVE).data);
+    int acc=0;
+    for(int i=0;i<N;++i)
+    { acc+=data[i];
+      ASSERT_EQ(acc,out[i]) << "grain " << grains[g] << " at " << i;
+    }
+  }
+}
+
+TEST_F(FoldTest,ScanExclusiveInPlace)
+{ static double data[N];
+  for(int i=0;i<N;++i) data[i]=i%3;
+  ASSERT_NE((void*)NULL,scan(MRPackage(data,sizeof(double),sizeof(data)),MRPackage(data,sizeof(double),sizeof(data)),MRAdd_F64,NULL,MR_SCAN_EXCLUSIVE).data);
+  double acc=0;
+  for(int i=0;i<N;++i)
+  { ASSERT_EQ(acc,data[i]) << "at " << i;
+    acc+=i%3;
+  }
+}
+
+TEST_F(FoldTest,ScanGeneric)
+{ static affine data[N/4];
+  const affine id={1,0};
+  for(int i=0;i<N/4;++i)
+  { data[i].a=(i*7+3)%P;
+    data[i].b=(i*13+5)%P;
+  }
+  int modes[]={MR_SCAN_INCLUSIVE,MR_SCAN_EXCLUSIVE};
+  for(int m=0;m<2;++m)
+  { MRSetGrainSize(m?0:777);
+    MRData r = scan(MREmpty(sizeof(affine)),MRPackage(data,sizeof(affine),sizeof(data)),compose,&id,(MRScanMode)modes[m]);
+    ASSERT_NE((void*)NULL,r.data);
+    affine acc=id;
+    for(int i=0;i<N/4;++i)
+    { if(modes[m]==MR_SCAN_INCLUSIVE) compose(&acc,data+i);
+      ASSERT_EQ(acc.a,((affine*)r.data)[i].a) << "at " << i;
+      ASSERT_EQ(acc.b,((affine*)r.data)[i].b) << "at " << i;
+      if(modes[m]==MR_SCAN_EXCLUSIVE) compose(&acc,data+i);
+    }
+    MRRelease(&r);
+  }
+}
+
+//
+// sort
+//
+
+static int cmp_int(const void *a, const void *b)
+{ int x=*(const int*)a,y=*(const int*)b;
+  return (x>y)-(x<y);
+}
+
+typedef struct _record { unsigned key; int seq; char pad[24]; } record;
+static unsigned long long record_key(const void *r) { return ((const record*)r)->key; }
+
+TEST_F(FoldTest,Sort)
+{ static int data[N+7],ref[N+7];
+  size_t grains[]={0,1000,7777,N};
+  for(size_t g=0;g<sizeof(grains)/sizeof(*grains);++g)
+  { for(int i=0;i<N+7;++i) data[i]=ref[i]=(int)((i*2654435761u)%100003)-50000;
+    std::sort(ref,ref+N+7);
+    MRSetGrainSize(grains[g]);
+    ASSERT_EQ(0,mr_sort(MRPackage(data,sizeof(int),sizeof(data)),cmp_int));
+    for(int i=0;i<N+7;++i)
+      ASSERT_EQ(ref[i],data[i]) << "grain " << grains[g] << " at " << i;
+  }
+}
+
+TEST_F(FoldTest,SortByKeyStable)
+{ static record r[N/4];
+  for(int i=0;i<N/4;++i)
+  { r[i].key = (i*40503u)%1000 + (i%3==0?0x10000000u:0);
+    r[i].seq = i;
+  }
+  MRSetGrainSize(999);
+  ASSERT_EQ(0,mr_sort_by_key(MRPackage(r,sizeof(record),sizeof(r)),record_key));
+  for(int i=1;i<N/4;++i)
+  { ASSERT_LE(r[i-1].key,r[i].key) << "at " << i;
+    if(r[i-1].key==r[i].key)
+      ASSERT_LT(r[i-1].seq,r[i].seq) << "at " << i;
+  }
+}
+
+//
+// map_reduce_by_key
+//
+
+#define NKEYS 5003
+
+static int emit_sensor(MREmitter *out, const void *elem, void *ctx)
+{ int x=*(const int*)elem;
+  long long one=1;
+  if(MREmit(out,(unsigned long long)(x%NKEYS),&one)) return 1;
+  if(x%2==0) return MREmit(out,1000000ULL+x%7,&one); // some elements emit twice
+  return 0;
+}
+
+TEST_F(FoldTest,ReduceByKey)
+{ static int data[N];
+  static long long expect[NKEYS];
+  long long seven[7]={0};
+  memset(expect,0,sizeof(expect));
+  for(int i=0;i<N;++i)
+  { data[i]=(int)((i*2654435761u)%1000003);
+    expect[data[i]%NKEYS]++;
+    if(data[i]%2==0) seven[data[i]%7]++;
+  }
+  MRData r = map_reduce_by_key(MRPackage(data,sizeof(int),sizeof(data)),sizeof(long long),emit_sensor,add_ll,NULL);
+  ASSERT_NE((void*)NULL,r.data);
+  ASSERT_EQ(MRKeyValueBytes(sizeof(long long)),r.bytesof_elem);
+  size_t n=r.bytesof_data/r.bytesof_elem,seen=0;
+  EXPECT_EQ((size_t)(NKEYS+7),n);
+  for(size_t i=0;i<n;++i)
+  { char *rec=r.data+i*r.bytesof_elem;
+    unsigned long long k=*(unsigned long long*)rec;
+    long long v=*(long long*)(rec+sizeof(unsigned long long));
+    if(k>=1000000ULL) { ASSERT_LT(k-1000000ULL,7ULL); EXPECT_EQ(seven[k-1000000ULL],v); }
+    else              { ASSERT_LT(k,(unsigned long long)NKEYS); EXPECT_EQ(expect[k],v) << "key " << k; ++seen; }
+  }
+  EXPECT_EQ((size_t)NKEYS,seen);
+  MRRelease(&r);
+}
+
+static int keep_multiple(const void *e, void *ctx)
+{ return *(const int*)e % *(int*)ctx == 0;
+}
+
+TEST_F(FoldTest,Filter)
+{ static int data[N],out[N];
+  int k=3;
+  for(int i=0;i<N;++i)
+    data[i]=(int)((i*2654435761u)%1000003);
+  std::vector<int> expect;
+  for(int i=0;i<N;++i)
+    if(data[i]%k==0) expect.push_back(data[i]);
+  size_t grains[]={0,1000,7777,N};
+  for(size_t g=0;g<sizeof(grains)/sizeof(*grains);++g)
+  { MRSetGrainSize(grains[g]);
+    MRData r = mr_filter(MREmpty(sizeof(int)),MRPackage(data,sizeof(int),sizeof(data)),keep_multiple,&k);
+    ASSERT_NE((void*)NULL,r.data);
+    ASSERT_EQ(expect.size()*sizeof(int),r.bytesof_data);
+    EXPECT_EQ(0,memcmp(&expect[0],r.data,r.bytesof_data)) << "grain " << grains[g];
+    MRRelease(&r);
+  }
+  MRData r = mr_filter(MRPackage(out,sizeof(int),sizeof(out)),MRPackage(data,sizeof(int),sizeof(data)),keep_multiple,&k);
+  ASSERT_EQ((char*)out,r.data);
+  EXPECT_EQ(expect.size()*sizeof(int),r.bytesof_data);
+  EXPECT_EQ(0,memcmp(&expect[0],out,r.bytesof_data));
+  // too small for every element
+  EXPECT_EQ((void*)NULL,mr_filter(MRPackage(out,sizeof(int),sizeof(int)),MRPackage(data,sizeof(int),sizeof(data)),keep_multiple,&k).data);
+}
+
+static long repeat_mod4(void *out, const void *e, void *ctx)
+{ int v=*(const int*)e;
+  long n=v%4;
+  for(long i=0;i<n;++i)
+    ((long long*)out)[i]=(long long)v*10+i;
+  return n;
+}
+
+static long fail_at(void *out, const void *e, void *ctx)
+{ return *(const int*)e==*(int*)ctx?-1:0;
+}
+
+TEST_F(FoldTest,FlatMap)
+{ static int data[N];
+  for(int i=0;i<N;++i)
+    data[i]=(int)((i*2654435761u)%1000003);
+  std::vector<long long> expect;
+  for(int i=0;i<N;++i)
+    for(int j=0;j<data[i]%4;++j)
+      expect.push_back((long long)data[i]*10+j);
+  size_t grains[]={0,1000,7777,N};
+  for(size_t g=0;g<sizeof(grains)/sizeof(*grains);++g)
+  { MRSetGrainSize(grains[g]);
+    MRData r = mr_flat_map(MREmpty(sizeof(long long)),MRPackage(data,sizeof(int),sizeof(data)),3,repeat_mod4,NULL);
+    ASSERT_NE((void*)NULL,r.data);
+    ASSERT_EQ(expect.size()*sizeof(long long),r.bytesof_data);
+    EXPECT_EQ(0,memcmp(&expect[0],r.data,r.bytesof_data)) << "grain " << grains[g];
+    MRRelease(&r);
+  }
+  int bad=data[N/2];
+  EXPECT_EQ((void*)NULL,mr_flat_map(MREmpty(sizeof(long long)),MRPackage(data,sizeof(int),sizeof(data)),3,fail_at,&bad).data);
+  // more outputs than promised
+  EXPECT_EQ((void*)NULL,mr_flat_map(MREmpty(sizeof(long long)),MRPackage(data,sizeof(int),sizeof(data)),2,repeat_mod4,NULL).data);
+}
+
+
+static int square_i32_f64(void *dst, const void *src, size_t n, void *ctx)
+{ const int *s=(const int*)src;
+  double *d=(double*)dst;
+  for(size_t i=0;i<n;++i)
+  { if(ctx && s[i]==*(int*)ctx) return 1;
+    d[i]=(double)s[i]*s[i];
+  }
+  return 0;
+}
+
+TEST(FileTest,MapWindows)
+{ const char *in="mapreduce_test_in.bin",*out="mapreduce_test_out.bin";
+  static int data[N];
+  for(int i=0;i<N;++i)
+    data[i]=(int)((i*2654435761u)%1000003);
+  FILE *fp=fopen(in,"wb");
+  ASSERT_NE((FILE*)NULL,fp);
+  ASSERT_EQ((size_t)N,fwrite(data,sizeof(int),N,fp));
+  fclose(fp);
+
+  MRSetFileWindowSize(100000); // not a multiple of the page or element size
+  MRFile *src=MRPackageFile(in,sizeof(int)),
+         *dst=MRPackageFileOut(out,sizeof(double));
+  ASSERT_NE((MRFile*)NULL,src);
+  ASSERT_NE((MRFile*)NULL,dst);
+  ASSERT_EQ(0,map_file(dst,src,square_i32_f64,NULL));
+  MRData r=MRFileData(dst);
+  ASSERT_EQ(N*sizeof(double),r.bytesof_data);
+  for(int i=0;i<N;++i)
+    ASSERT_EQ((double)data[i]*data[i],((double*)r.data)[i]) << i;
+  int bad=data[N-10];
+  EXPECT_EQ(1,map_file(dst,src,square_i32_f64,&bad));
+  EXPECT_EQ(1,map_file(src,src,square_i32_f64,NULL)); // not writable
+  MRReleaseFile(src);
+  MRReleaseFile(dst);
+  MRSetFileWindowSize(0);
+
+  fp=fopen(out,"rb");
+  ASSERT_NE((FILE*)NULL,fp);
+  fseek(fp,0,SEEK_END);
+  EXPECT_EQ((long)(N*sizeof(double)),ftell(fp));
+  fclose(fp);
+  remove(in);
+  remove(out);
+  EXPECT_EQ((MRFile*)NULL,MRPackageFile("does/not/exist",sizeof(int)));
+}
@@ -0,0 +1,114 @@
+#include "config.h"
+#include "scheduler.h"
+#include <gtest/gtest.h>
+
+#define N 100000
+
+typedef struct _sum_args
+{ const int *data;
+  long long  partial[64];
+  long       calls;
+} sum_args;
+
+static int sum_range(size_t beg, size_t end, unsigned worker, void *a)
+{ sum_args *args = (sum_args*)a;
+  size_t i;
+  for(i=beg;i<end;++i)
+    args->partial[worker]+=args->data[i];
+  InterlockedIncrement(&args->calls);
+  return 0;
+}
+
+// Cost grows with the index so static partitioning would be unbalanced.
+static int uneven_range(size_t beg, size_t end, unsigned worker, void *a)
+{ int *out = (int*)a;
+  size_t i;
+  for(i=beg;i<end;++i)
+  { volatile int k,acc=0;
+    for(k=0;k<(int)(i/64);++k) acc+=k;
+    out[i]=1;
+  }
+  return 0;
+}
+
+static int fail_range(size_t beg, size_t end, unsigned worker, void *a)
+{ return (beg<=500 && 500<end)?42:0;
+}
+
+class SchedTest:public ::testing::Test
+{ protected:
+  virtual void SetUp()    { pool = ThreadPool_Alloc(3); }
+  virtual void TearDown() { ThreadPool_Free(pool); }
+  ThreadPool *pool;
+};
+
+static long long total(sum_args *args)
+{ long long t=0;
+  for(int i=0;i<64;++i) t+=args->partial[i];
+  return t;
+}
+
+TEST_F(SchedTest,Sum)
+{ static int data[N];
+  sum_args args;
+  memset(&args,0,sizeof(args));
+  for(int i=0;i<N;++i) data[i]=i;
+  args.data=data;
+  EXPECT_EQ(4,Sched_Max_Workers(pool));
+  EXPECT_EQ(0,Sched_For(pool,4,N,1000,sum_range,&args));
+  EXPECT_EQ((long long)N*(N-1)/2,total(&args));
+  EXPECT_EQ(N/1000,args.calls);
+}
+
+TEST_F(SchedTest,RaggedLastChunk)
+{ static int data[N];
+  sum_args args;
+  memset(&args,0,sizeof(args));
+  for(int i=0;i<N;++i) data[i]=1;
+  args.data=data;
+  EXPECT_EQ(0,Sched_For(pool,4,N-1,777,sum_range,&args));
+  EXPECT_EQ(N-1,total(&args));
+}
+
+TEST_F(SchedTest,Serial)
+{ static int data[N];
+  sum_args args;
+  memset(&args,0,sizeof(args));
+  for(int i=0;i<N;++i) data[i]=1;
+  args.data=data;
+  EXPECT_EQ(0,Sched_For(NULL,4,N,100,sum_range,&args));
+  EXPECT_EQ(N,args.partial[0]);
+}
+
+TEST_F(SchedTest,Uneven)
+{ static int out[N/10];
+  memset(out,0,sizeof(out));
+  EXPECT_EQ(0,Sched_For(pool,4,N/10,16,uneven_range,out));
+  for(int i=0;i<N/10;++i)
+    ASSERT_EQ(1,out[i]);
+}
+
+TEST_F(SchedTest,Error)
+{ EXPECT_EQ(42,Sched_For(pool,4,N,100,fail_range,NULL));
+}
+
+typedef struct _nested_args
+{ ThreadPool *pool;
+  long        count;
+} nested_args;
+
+static int count_range(size_t beg, size_t end, unsigned worker, void *a)
+{ InterlockedExchangeAdd(&((nested_args*)a)->count,(long)(end-beg));
+  return 0;
+}
+
+static int nested_range(size_t beg, size_t end, unsigned worker, void *a)
+{ nested_args *args = (nested_args*)a;
+  return Sched_For(args->pool,4,100,1,count_range,args);
+}
+
+TEST_F(SchedTest,Nested)
+{ nested_args args = {pool,0};
+  EXPECT_EQ(0,Sched_For(pool,4,64,1,nested_range,&args));
+  EXPECT_EQ(64*100,args.count);
+}
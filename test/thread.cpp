@@ -127,3 +127,218 @@ TEST(MutexTest,OrphanUnlockFails)
   ASSERT_DEATH(Mutex_Unlock(m),"Detected an attempt to unlock a mutex that hasn't been locked.*");
   Mutex_Free(m);
 }
+
+static void* pool_inc(void *a)
+{ InterlockedIncrement((long*)a);
+  return NULL;
+}
+
+TEST(ThreadPoolTest,SubmitWait)
+{ ThreadPool *pool = ThreadPool_Alloc(4);
+  long n=0;
+  int i;
+  ASSERT_NE(pool,(void*)NULL);
+  EXPECT_EQ(4,ThreadPool_Thread_Count(pool));
+  for(i=0;i<1000;++i) // more than the initial queue capacity
+    EXPECT_EQ(0,ThreadPool_Submit(pool,pool_inc,&n));
+  ThreadPool_Wait(pool);
+  EXPECT_EQ(1000,n);
+  ThreadPool_Free(pool);
+}
+
+TEST(ThreadPoolTest,WaitIdle)
+{ ThreadPool *pool = ThreadPool_Alloc(2);
+  ThreadPool_Wait(pool); // nothing submitted - shouldn't block
+  ThreadPool_Free(pool);
+}
+
+TEST(ThreadPoolTest,FreeRunsQueued)
+{ ThreadPool *pool = ThreadPool_Alloc(1);
+  long n=0;
+  int i;
+  ThreadPool_Submit(pool,pause_100ms,NULL);
+  for(i=0;i<10;++i)
+    ThreadPool_Submit(pool,pool_inc,&n);
+  ThreadPool_Free(pool);
+  EXPECT_EQ(10,n);
+}
+
+#ifdef __linux__
+typedef struct _placement
+{ int    cpu;
+  int    ncpus;     // processors allowed
+  char   name[16];
+  volatile int go;
+} placement;
+
+static void* where(void *a)
+{ placement *p=(placement*)a;
+  cpu_set_t set;
+  while(!p->go) usleep(100);
+  pthread_getname_np(pthread_self(),p->name,sizeof(p->name));
+  sched_getaffinity(0,sizeof(set),&set);
+  p->ncpus=CPU_COUNT(&set);
+  p->cpu=sched_getcpu();
+  return NULL;
+}
+
+TEST(ThreadAttrTest,PinAndName)
+{ unsigned cpu=0;
+  placement p={-1,0,{0},1};
+  ThreadAttr attr={0};
+  attr.cpus=&cpu;
+  attr.ncpus=1;
+  attr.stack_bytes=256*1024;
+  attr.name="attr-test-thread-name";
+  Thread *t=Thread_Alloc_Ex(where,&p,&attr);
+  ASSERT_NE(t,(void*)NULL);
+  Thread_Join(t);
+  Thread_Free(t);
+  EXPECT_EQ(0,p.cpu);
+  EXPECT_EQ(1,p.ncpus);
+  EXPECT_STREQ("attr-test-threa",p.name);
+}
+
+TEST(ThreadAttrTest,SetAffinity)
+{ unsigned cpu=0;
+  placement p={-1,0,{0},0};
+  Thread *t=Thread_Alloc(where,&p);
+  EXPECT_EQ(0,Thread_Set_Affinity(t,&cpu,1));
+  p.go=1;
+  Thread_Join(t);
+  EXPECT_EQ(0,p.cpu);
+  EXPECT_EQ(1,p.ncpus);
+  Thread_Free(t);
+}
+
+TEST(ThreadAttrTest,BadProcessor)
+{ unsigned cpu=THREAD_MAX_CPUS;
+  placement p={-1,0,{0},1};
+  ThreadAttr attr={0};
+  attr.cpus=&cpu;
+  attr.ncpus=1;
+  EXPECT_EQ((Thread*)NULL,Thread_Alloc_Ex(where,&p,&attr));
+  EXPECT_EQ((ThreadPool*)NULL,ThreadPool_Alloc_Ex(2,&attr));
+}
+
+TEST(ThreadAttrTest,PoolOneCpuEach)
+{ unsigned cpu=0;
+  placement p[4];
+  ThreadAttr attr={0};
+  attr.cpus=&cpu;
+  attr.ncpus=1;
+  attr.one_cpu_each=1;
+  attr.name="pool";
+  memset(p,0,sizeof(p));
+  ThreadPool *pool=ThreadPool_Alloc_Ex(4,&attr);
+  ASSERT_NE(pool,(void*)NULL);
+  for(int i=0;i<4;++i)
+  { p[i].go=1;
+    ThreadPool_Submit(pool,where,p+i);
+  }
+  ThreadPool_Wait(pool);
+  ThreadPool_Free(pool);
+  for(int i=0;i<4;++i)
+  { EXPECT_EQ(0,p[i].cpu);
+    EXPECT_EQ(1,p[i].ncpus);
+    EXPECT_EQ(0,strncmp("pool",p[i].name,4));
+  }
+}
+#endif
+
+static const ThreadStats* find_stats(const ThreadStats *s, size_t n, const char *name)
+{ for(size_t i=0;i<n;++i)
+    if(!strcmp(s[i].name,name))
+      return s+i;
+  return NULL;
+}
+
+static void* spin_50ms(void *a)
+{ double t0=Thread_Time();
+  volatile double x=0;
+  while(Thread_Time()-t0<0.05)
+    x+=1.0;
+  return a;
+}
+
+TEST(ThreadStatsTest,CpuAndWall)
+{ ThreadAttr spin={0},nap={0};
+  ThreadStats s[64];
+  spin.name="stats-spin";
+  nap.name ="stats-nap";
+  Thread *a=Thread_Alloc_Ex(spin_50ms,(void*)42,&spin),
+         *b=Thread_Alloc_Ex(pause_100ms,NULL,&nap);
+  ASSERT_NE(a,(void*)NULL);
+  ASSERT_NE(b,(void*)NULL);
+  EXPECT_EQ((void*)42,Thread_Join(a)); // the accounting wrapper passes the result through
+  Thread_Join(b);
+  Thread_Free(a);
+  Thread_Free(b);
+  size_t n=Thread_Stats(s,64);
+  ASSERT_LE(n,(size_t)64);
+  const ThreadStats *ps=find_stats(s,n,"stats-spin"),
+                    *pn=find_stats(s,n,"stats-nap");
+  ASSERT_NE((void*)NULL,ps);
+  ASSERT_NE((void*)NULL,pn);
+  EXPECT_FALSE(ps->running);
+  EXPECT_GE(ps->wall,0.05);
+  EXPECT_GT(ps->utilization,0.2); // shares processors with the other thread
+  EXPECT_LT(pn->utilization,0.5);
+  EXPECT_EQ(0.0,pn->blocked);
+  Thread_Stats_Clear();
+  n=Thread_Stats(s,64);
+  EXPECT_EQ((void*)NULL,find_stats(s,n,"stats-spin"));
+}
+
+TEST(ThreadStatsTest,TrackSelf)
+{ ThreadStats s[64];
+  Thread_Track_Self("stats-self");
+  spin_50ms(NULL);
+  size_t n=Thread_Stats(s,64);
+  const ThreadStats *p=find_stats(s,n,"stats-self");
+  ASSERT_NE((void*)NULL,p);
+  EXPECT_TRUE(p->running);
+  EXPECT_GT(p->cpu,0.0);
+  Thread_Untrack_Self();
+  n=Thread_Stats(s,64);
+  p=find_stats(s,n,"stats-self");
+  ASSERT_NE((void*)NULL,p);
+  EXPECT_FALSE(p->running);
+  Thread_Stats_Clear();
+}
+
+static void* exit_early(void *a)
+{ spin_50ms(NULL);
+  Thread_Exit(0);
+  return NULL;
+}
+
+static void* track_and_return(void *a)
+{ Thread_Track_Self("stats-forgot");
+  spin_50ms(NULL);
+  return NULL; // never untracked
+}
+
+TEST(ThreadStatsTest,ExitingThreadsFinish)
+{ ThreadAttr attr={0};
+  ThreadStats s[64];
+  attr.name="stats-exit";
+  Thread *a=Thread_Alloc_Ex(exit_early,NULL,&attr),
+         *b=Thread_Alloc(track_and_return,NULL);
+  Thread_Join(a);
+  Thread_Join(b);
+  Thread_Free(a);
+  Thread_Free(b);
+  size_t n=Thread_Stats(s,64);
+  const ThreadStats *pa=find_stats(s,n,"stats-exit"),
+                    *pb=find_stats(s,n,"stats-forgot");
+  ASSERT_NE((void*)NULL,pa);
+  ASSERT_NE((void*)NULL,pb);
+  EXPECT_FALSE(pa->running);
+  EXPECT_FALSE(pb->running);
+  EXPECT_GT(pa->cpu,0.0);
+  EXPECT_GT(pb->cpu,0.0);
+  Thread_Stats_Clear();
+  n=Thread_Stats(s,64);
+  EXPECT_EQ((void*)NULL,find_stats(s,n,"stats-exit"));
+}